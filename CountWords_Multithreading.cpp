@@ -1,7 +1,10 @@
 /**
  * Copyright 2021 Michael Glum
  * A program to use multiple threads to count words from data obtained
- * via a given set of URLs.
+ * via a given set of URLs.  The data is downloaded in chunks that are
+ * counted by a pool of threads (1 per core), so even a single large
+ * document is counted using all of the cores.  The data is downloaded
+ * asynchronously via HTTPFetcher (link with -lz).
  */
 
 #include <boost/asio.hpp>
@@ -13,144 +16,1247 @@
 #include <cctype>
 #include <algorithm>
 #include <thread>
-#include <unordered_map>
+#include <string_view>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "HTTPFetcher.h"
 
 // Using namespace to streamline working with Boost socket.
 using namespace boost::asio;
 using namespace boost::system;
 
-// Shortcut an unordered_map of words. 
-using Dictionary = std::unordered_map<std::string, bool>;
+/**
+ * A read-only set of words stored in a single flat block of memory: a
+ * header, an open-addressing hash table of 8-byte slots, and the words
+ * themselves.  Each slot holds the upper 32 bits of the word's hash and
+ * the offset of the word (which is stored as a 2-byte length followed
+ * by its characters), so a lookup usually touches just 1 slot and 1
+ * word, and no strings are allocated.  The block can be written to an
+ * index file once (see Dictionary::build) and memory-mapped when the
+ * program starts, instead of parsing the word list every time.
+ */
+class Dictionary {
+public:
+    /**
+     * Load the dictionary for a word list (with 1 word per line).  If
+     * an up-to-date index file (the word list's path with ".idx" in
+     * place of its extension) exists it is memory-mapped.  Otherwise the
+     * index is built in memory from the word list.
+     *
+     * \param[in] filePath The path to the word list, e.g. "english.txt".
+     */
+    explicit Dictionary(const std::string& filePath) {
+        const std::string indexPath = indexPathFor(filePath);
+        struct stat textInfo, indexInfo;
+        const bool textExists = (::stat(filePath.c_str(), &textInfo) == 0);
+        if (::stat(indexPath.c_str(), &indexInfo) == 0 && (!textExists ||
+            indexInfo.st_mtime >= textInfo.st_mtime) && map(indexPath)) {
+            return;
+        }
+        owned = build(filePath);
+        data = owned.data();
+        size = owned.size();
+        if (!valid()) {
+            data = nullptr;
+        }
+    }
+
+    ~Dictionary() {
+        if (mapped) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    Dictionary(const Dictionary&) = delete;
+    Dictionary& operator=(const Dictionary&) = delete;
+
+    /**
+     * \param[in] word The word to look up (already in lower case).
+     *
+     * \return True if the word is in the dictionary.
+     */
+    bool contains(const std::string_view word) const {
+        return contains(word, fnv1a(word));
+    }
+
+    /**
+     * \param[in] word The word to look up (already in lower case).
+     *
+     * \param[in] hash The hash of the word (see fnv1a).
+     *
+     * \return True if the word is in the dictionary.
+     */
+    bool contains(const std::string_view word, const uint64_t hash) const {
+        if (data == nullptr) {
+            return false;
+        }
+        const uint64_t mask = header().numSlots - 1;
+        const Slot* slots = reinterpret_cast<const Slot*>(data +
+                                                          sizeof(Header));
+        for (uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if (slot.offset == EmptySlot) {
+                return false;
+            }
+            if (slot.hash == static_cast<uint32_t>(hash >> 32)) {
+                uint16_t len;
+                std::memcpy(&len, data + slot.offset, 2);
+                if (len == word.size() && std::memcmp(data + slot.offset + 2,
+                                                      word.data(), len) == 0) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    /**
+     * Build the index for a word list (with 1 word per line).  The
+     * table has at least twice as many slots as there are words.
+     *
+     * \param[in] filePath The path to the word list.
+     *
+     * \return The index, which can be saved to a file as it is.
+     */
+    static std::string build(const std::string& filePath) {
+        std::vector<std::string> words;
+        std::ifstream ifs(filePath);
+        for (std::string line; std::getline(ifs, line);) {
+            if (!line.empty() && line.size() <= UINT16_MAX) {
+                words.push_back(line);
+            }
+        }
+        std::sort(words.begin(), words.end());
+        words.erase(std::unique(words.begin(), words.end()), words.end());
+        Header hdr = {{'W', 'O', 'R', 'D', 'I', 'D', 'X', '1'}, 1, 0};
+        while (hdr.numSlots < 2 * words.size()) {
+            hdr.numSlots *= 2;
+        }
+        hdr.numWords = words.size();
+        std::vector<Slot> slots(hdr.numSlots, Slot{0, EmptySlot});
+        std::string text;
+        const size_t textStart = sizeof(Header) + hdr.numSlots * sizeof(Slot);
+        for (const auto& word : words) {
+            const uint64_t hash = fnv1a(word);
+            uint64_t i = hash & (hdr.numSlots - 1);
+            while (slots[i].offset != EmptySlot) {
+                i = (i + 1) & (hdr.numSlots - 1);
+            }
+            slots[i] = {static_cast<uint32_t>(hash >> 32),
+                        static_cast<uint32_t>(textStart + text.size())};
+            const uint16_t len = word.size();
+            text.append(reinterpret_cast<const char*>(&len), 2).append(word);
+        }
+        std::string index(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        index.append(reinterpret_cast<const char*>(slots.data()),
+                     slots.size() * sizeof(Slot));
+        return index + text;
+    }
+
+    /**
+     * \param[in] filePath The path to a word list.
+     *
+     * \return The path of the index file for the word list.
+     */
+    static std::string indexPathFor(const std::string& filePath) {
+        const size_t dot = filePath.rfind('.');
+        return filePath.substr(0, (dot == std::string::npos ||
+            filePath.find('/', dot) != std::string::npos) ?
+            filePath.size() : dot) + ".idx";
+    }
+
+    /** \return The 64-bit FNV-1a hash of a word (stable across builds) */
+    static uint64_t fnv1a(const std::string_view word) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (const char c : word) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+private:
+    // The start of the index
+    struct Header {
+        char magic[8];
+        uint64_t numSlots, numWords;
+    };
 
-// Forward declaration for method. 
-Dictionary loadDictionary(const std::string& filePath);
+    // 1 entry in the hash table
+    struct Slot {
+        uint32_t hash, offset;
+    };
 
+    // The offset stored in slots that do not hold a word
+    static constexpr uint32_t EmptySlot = UINT32_MAX;
+
+    /** \return The header at the start of the index. */
+    const Header& header() const {
+        return *reinterpret_cast<const Header*>(data);
+    }
+
+    /**
+     * \return True if the index has a valid header and table size.
+     */
+    bool valid() const {
+        return size >= sizeof(Header) &&
+            std::memcmp(header().magic, "WORDIDX1", 8) == 0 &&
+            header().numSlots > 0 &&
+            (header().numSlots & (header().numSlots - 1)) == 0 &&
+            header().numSlots > header().numWords &&
+            sizeof(Header) + header().numSlots * sizeof(Slot) <= size;
+    }
+
+    /**
+     * Memory-map an index file.
+     *
+     * \param[in] indexPath The path to the index file.
+     *
+     * \return True if the file was mapped and is a valid index.
+     */
+    bool map(const std::string& indexPath) {
+        const int fd = ::open(indexPath.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat info;
+        void* addr = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            addr = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char*>(addr);
+        size = info.st_size;
+        if (!valid()) {
+            munmap(addr, size);
+            data = nullptr;
+            return false;
+        }
+        mapped = true;
+        return true;
+    }
+
+    // The index: either memory-mapped or held in owned
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::string owned;
+};
 
 // The global dictionary of valid words 
-const Dictionary dictionary = loadDictionary("english.txt");
+const Dictionary dictionary("english.txt");
 
-Dictionary loadDictionary(const std::string& filePath) {
-    Dictionary dictionary;
-    std::ifstream ifs(filePath);
-    std::string line;
-    while (std::getline(ifs, line)) {
-        dictionary[line] = true;
+/**
+ * Helper method to check if a character separates words, i.e., if it
+ * is white space or punctuation (in the "C" locale).
+ *
+ * \param[in] c The character to be checked.
+ *
+ * \return True if c is a separator.
+ */
+inline bool isSeparator(const unsigned char c) {
+    return (c >= '\t' && c <= '\r') || (c >= ' ' && c <= '~' &&
+        !(c >= '0' && c <= '9') && !(c >= 'A' && c <= 'Z') &&
+        !(c >= 'a' && c <= 'z'));
+}
+
+/**
+ * Helper method to convert upto 32 characters to lower case in place
+ * and to find the separators among them, one character at a time.
+ *
+ * \param[in,out] data The characters to be processed.
+ *
+ * \param[in] len The number of characters (at most 32).
+ *
+ * \return A mask with bit i set if data[i] is a separator.
+ */
+inline uint32_t foldScalar(char* data, const size_t len) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = data[i];
+        if (c >= 'A' && c <= 'Z') {
+            data[i] = c | 0x20;
+        }
+        mask |= uint32_t(isSeparator(c)) << i;
     }
-    return dictionary;
+    return mask;
 }
 
-void processData(std::istream& is, std::string& result) {
-    std::string line, word;
-    int wordCount = 0, englishWordCount = 0;
-    while (std::getline(is, line)) {
-        // Remove punctuations in a line
-        std::replace_if(line.begin(), line.end(), ispunct, ' ');
-        // Convert the word to lower case to check against the dictionary. 
-        std::transform(line.begin(), line.end(), line.begin(), tolower);
-        std::istringstream iss(line);
-        while (iss >> word) {
-            if (dictionary.find(word) != dictionary.end()) {
-                englishWordCount++;
+#if defined(__AVX2__)
+/**
+ * Helper method to convert 32 characters to lower case in place and to
+ * find the separators among them using AVX2 instructions.
+ *
+ * \param[in,out] data The 32 characters to be processed.
+ *
+ * \return A mask with bit i set if data[i] is a separator.
+ */
+inline uint32_t foldBlock(char* data) {
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<__m256i*>(data));
+    // Signed comparisons, so characters >= 128 are never in a range
+    auto inRange = [&c](const char lo, const char hi) {
+        return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(lo - 1)),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), c));
+    };
+    const __m256i upper = inRange('A', 'Z');
+    const __m256i alnum = _mm256_or_si256(upper, _mm256_or_si256(
+        inRange('0', '9'), inRange('a', 'z')));
+    const __m256i sep = _mm256_or_si256(inRange('\t', '\r'),
+        _mm256_andnot_si256(alnum, inRange(' ', '~')));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data), _mm256_or_si256(c,
+        _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+    return _mm256_movemask_epi8(sep);
+}
+#elif defined(__SSE2__)
+/**
+ * Helper method to convert 16 characters to lower case in place and to
+ * find the separators among them using SSE2 instructions.
+ *
+ * \param[in,out] data The 16 characters to be processed.
+ *
+ * \return A mask with bit i set if data[i] is a separator.
+ */
+inline uint32_t foldBlock16(char* data) {
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<__m128i*>(data));
+    // Signed comparisons, so characters >= 128 are never in a range
+    auto inRange = [&c](const char lo, const char hi) {
+        return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                             _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), c));
+    };
+    const __m128i upper = inRange('A', 'Z');
+    const __m128i alnum = _mm_or_si128(upper, _mm_or_si128(
+        inRange('0', '9'), inRange('a', 'z')));
+    const __m128i sep = _mm_or_si128(inRange('\t', '\r'),
+        _mm_andnot_si128(alnum, inRange(' ', '~')));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data), _mm_or_si128(c,
+        _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+    return _mm_movemask_epi8(sep);
+}
+
+/**
+ * Helper method to convert 32 characters to lower case in place and to
+ * find the separators among them using SSE2 instructions.
+ *
+ * \param[in,out] data The 32 characters to be processed.
+ *
+ * \return A mask with bit i set if data[i] is a separator.
+ */
+inline uint32_t foldBlock(char* data) {
+    return foldBlock16(data) | (foldBlock16(data + 16) << 16);
+}
+#else
+/**
+ * Helper method to convert 32 characters to lower case in place and to
+ * find the separators among them (no SIMD instructions available).
+ *
+ * \param[in,out] data The 32 characters to be processed.
+ *
+ * \return A mask with bit i set if data[i] is a separator.
+ */
+inline uint32_t foldBlock(char* data) {
+    return foldScalar(data, 32);
+}
+#endif
+
+/**
+ * Split a buffer into words in a single pass.  The buffer is converted
+ * to lower case in place (32 characters at a time) and each word is
+ * passed to a callback as a string_view into the buffer.  A word is a
+ * run of characters that are neither white space nor punctuation,
+ * which is the same as replacing punctuation with spaces and reading
+ * words with operator>>.
+ *
+ * \param[in,out] data The characters to be split into words.
+ *
+ * \param[in] len The number of characters in data.
+ *
+ * \param[in] fn The callback that is called with each complete word.
+ *
+ * \return The number of characters at the end of data that form the
+ * start of a word which may continue after data (zero if data ends
+ * with a separator).
+ */
+template <typename Callback>
+size_t tokenize(char* data, const size_t len, const Callback& fn) {
+    size_t start = std::string::npos;  // Start of the current word
+    for (size_t pos = 0; pos < len; pos += 32) {
+        const size_t limit = std::min<size_t>(32, len - pos);
+        const uint32_t sep = (limit == 32) ? foldBlock(data + pos) :
+            foldScalar(data + pos, limit);
+        // Find word boundaries using the separator mask
+        for (size_t i = 0; i < limit;) {
+            const uint32_t bits = (start == std::string::npos ? ~sep : sep)
+                >> i;
+            if (bits == 0) {
+                break;
+            }
+            i += __builtin_ctz(bits);
+            if (i >= limit) {
+                break;
+            }
+            if (start == std::string::npos) {
+                start = pos + i;
+            } else {
+                fn(std::string_view(data + start, pos + i - start));
+                start = std::string::npos;
             }
-            wordCount++;
         }
     }
-    result += ": words=" + std::to_string(wordCount)
-        + ", English words=" + std::to_string(englishWordCount);
+    return (start == std::string::npos) ? 0 : len - start;
 }
 
 /**
- * Helper method to break down a URL into hostname, port and path.
+ * A fixed pool of worker threads that count words.  Each worker has its
+ * own queue of tasks; tasks are handed out to the queues round-robin,
+ * and a worker whose queue is empty steals the oldest task from
+ * another worker's queue, so all of the workers stay busy no matter
+ * which downloads the tasks came from.  The number of tasks that are
+ * queued at any time is bounded, so a fast download cannot fill up
+ * memory with data that has not been counted yet.
+ */
+class WorkStealingPool {
+public:
+    /**
+     * Create the worker threads for the pool.
+     *
+     * \param[in] numWorkers The number of worker threads to create.
+     *
+     * \param[in] capacity The maximum number of tasks that may be
+     * queued (but not yet started) at any given time.
+     */
+    WorkStealingPool(const unsigned int numWorkers, const size_t capacity) :
+        capacity(std::max<size_t>(capacity, 1)) {
+        for (unsigned int i = 0; i < std::max(numWorkers, 1u); i++) {
+            queues.push_back(std::make_unique<TaskQueue>());
+        }
+        for (size_t i = 0; i < queues.size(); i++) {
+            workers.emplace_back([this, i] { workerMain(i); });
+        }
+    }
+
+    /**
+     * Wait for the queued tasks to finish and stop the worker threads.
+     */
+    ~WorkStealingPool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    /**
+     * Add a task to the pool, waiting if too many tasks are queued.
+     *
+     * \param[in] task The task to be run by one of the workers.
+     */
+    void submit(std::function<void()> task) {
+        std::unique_lock<std::mutex> lock(mutex);
+        spaceAvailable.wait(lock, [this] { return queued < capacity; });
+        TaskQueue& queue = *queues[nextQueue++ % queues.size()];
+        {
+            std::unique_lock<std::mutex> queueLock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        queued++;
+        unfinished++;
+        lock.unlock();
+        taskAvailable.notify_one();
+    }
+
+    /**
+     * Wait until all of the tasks submitted so far have finished.
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        allDone.wait(lock, [this] { return unfinished == 0; });
+    }
+
+    /** \return The number of worker threads in the pool. */
+    size_t size() const { return workers.size(); }
+
+    /**
+     * \return The index (0 to size() - 1) of the worker thread that calls
+     * this method, e.g. to find per-worker data in a task.
+     */
+    static size_t workerIndex() { return currentWorker; }
+
+private:
+    // The queue of tasks of 1 worker, on its own cache line(s)
+    struct alignas(64) TaskQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    /**
+     * The method run by each worker thread.  It runs tasks from its own
+     * queue (newest first) or, if that is empty, steals tasks from the
+     * other queues (oldest first) until the pool is destroyed.
+     *
+     * \param[in] self The index of this worker's queue.
+     */
+    void workerMain(const size_t self) {
+        currentWorker = self;
+        while (true) {
+            {
+                // Reserve 1 of the queued tasks, wherever it may be
+                std::unique_lock<std::mutex> lock(mutex);
+                taskAvailable.wait(lock, [this] {
+                    return stopping || queued > 0; });
+                if (queued == 0) {
+                    return;  // Pool is stopping and all work is done
+                }
+                queued--;
+            }
+            spaceAvailable.notify_one();
+            std::function<void()> task;
+            for (size_t i = 0; !task; i++) {
+                TaskQueue& queue = *queues[(self + i) % queues.size()];
+                std::unique_lock<std::mutex> queueLock(queue.mutex);
+                if (!queue.tasks.empty()) {
+                    if (i == 0) {
+                        task = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                    } else {
+                        task = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                    }
+                }
+            }
+            task();
+            std::unique_lock<std::mutex> lock(mutex);
+            if (--unfinished == 0) {
+                allDone.notify_all();
+            }
+        }
+    }
+
+    // The maximum number of tasks permitted in the queues
+    const size_t capacity;
+    // The queue of each worker
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    // The worker threads
+    std::vector<std::thread> workers;
+    // Mutex and conditional variables guarding the counts below
+    std::mutex mutex;
+    std::condition_variable taskAvailable, spaceAvailable, allDone;
+    // The number of tasks in the queues, the number of tasks not yet
+    // finished, and the queue that gets the next task
+    size_t queued = 0, unfinished = 0, nextQueue = 0;
+    // Flag set by the destructor to shut down the workers
+    bool stopping = false;
+    // The index of the worker running on this thread
+    static inline thread_local size_t currentWorker = 0;
+};
+
+/**
+ * Cuts the data of (a part of) 1 document into chunks of about 1 MB
+ * and hands each chunk to the pool to be counted.  Data is added in
+ * blocks of any size as it is downloaded.  Each chunk ends after a
+ * separator, so that no word is split between 2 chunks.  The partial
+ * words at the very start and end of the part are not counted here,
+ * because they may continue in the neighbouring parts (see
+ * serveClient).
+ */
+class PartSplitter {
+public:
+    /** The approximate size of the chunks handed to the pool. */
+    static constexpr size_t ChunkSize = 1024 * 1024;
+
+    /**
+     * Add a block of data to this part.
+     *
+     * \param[in] data The data to be added.
+     *
+     * \param[in] len The number of bytes of data.
+     *
+     * \param[in] submit Called with each chunk that is ready.
+     */
+    template <typename Submit>
+    void add(const char* data, const size_t len, const Submit& submit) {
+        pending.append(data, len);
+        if (pending.size() >= ChunkSize) {
+            cut(false, submit);
+        }
+    }
+
+    /**
+     * Hand the rest of the data to the pool, once all of the data of
+     * this part has been added.
+     *
+     * \param[in] submit Called with the last chunk (if any).
+     */
+    template <typename Submit>
+    void finish(const Submit& submit) {
+        cut(true, submit);
+    }
+
+    // The characters before the first separator in this part (the whole
+    // part if it has no separators) and after its last separator
+    std::string head, tail;
+    // True if this part has at least 1 separator
+    bool hasSeparator = false;
+
+private:
+    /**
+     * Cut the pending data after its last separator and hand it to
+     * the pool.
+     *
+     * \param[in] final If true, all of the data has been added, so the
+     * characters after the last separator become the tail.
+     *
+     * \param[in] submit Called with the chunk.
+     */
+    template <typename Submit>
+    void cut(const bool final, const Submit& submit) {
+        size_t begin = 0;
+        if (!hasSeparator) {
+            // Split off the head first
+            while (begin < pending.size() && !isSeparator(pending[begin])) {
+                begin++;
+            }
+            if (begin == pending.size()) {
+                if (final) {
+                    head.swap(pending);
+                }
+                return;
+            }
+            head.assign(pending, 0, begin);
+            hasSeparator = true;
+        }
+        size_t end = pending.size();
+        while (end > begin && !isSeparator(pending[end - 1])) {
+            end--;
+        }
+        std::string rest(pending, end);
+        if (end > begin) {
+            pending.erase(end);
+            pending.erase(0, begin);
+            submit(std::move(pending));
+        }
+        if (final) {
+            tail.swap(rest);
+            pending.clear();
+        } else {
+            pending.swap(rest);
+        }
+    }
+
+    // Data that has not been handed to the pool yet
+    std::string pending;
+};
+
+/**
+ * An open-addressing hash table that counts the occurrences of words.
+ * The words are copied into a single block of characters and each slot
+ * holds a word's hash, count and position in that block, so counting a
+ * word that has been seen before does not allocate any memory.  Each
+ * worker thread counts into its own tables, so no locking is needed.
+ */
+class WordTable {
+public:
+    /** A word and its count, as passed to forEach. */
+    struct Entry {
+        std::string_view word;
+        uint64_t hash, count;
+    };
+
+    /**
+     * Add to the count of a word.
+     *
+     * \param[in] word The word to be counted.
+     *
+     * \param[in] hash The hash of the word (see Dictionary::fnv1a).
+     *
+     * \param[in] count The number of occurrences to be added.
+     *
+     * \return The new count of the word.
+     */
+    uint64_t add(const std::string_view word, const uint64_t hash,
+                 const uint64_t count = 1) {
+        return (find(word, hash).count += count);
+    }
+
+    /**
+     * Set the count of a word (adding the word if needed).
+     *
+     * \param[in] word The word whose count is set.
+     *
+     * \param[in] hash The hash of the word (see Dictionary::fnv1a).
+     *
+     * \param[in] count The count of the word, which must not be zero.
+     */
+    void set(const std::string_view word, const uint64_t hash,
+             const uint64_t count) {
+        find(word, hash).count = count;
+    }
+
+    /**
+     * Call a function with each word in the table (in no particular
+     * order).
+     *
+     * \param[in] fn The function to be called with each Entry.
+     */
+    template <typename Function>
+    void forEach(const Function& fn) const {
+        for (const Slot& slot : slots) {
+            if (slot.count != 0) {
+                fn(Entry{std::string_view(text.data() + slot.offset,
+                                          slot.length), slot.hash,
+                         slot.count});
+            }
+        }
+    }
+
+    /** \return The number of different words in the table. */
+    size_t size() const { return numWords; }
+
+    /**
+     * Remove all but the words with the highest counts from the table.
+     *
+     * \param[in] keep The number of words that are kept.
+     */
+    void prune(const size_t keep) {
+        std::vector<Entry> entries;
+        entries.reserve(numWords);
+        forEach([&entries](const Entry& e) { entries.push_back(e); });
+        if (entries.size() <= keep) {
+            return;
+        }
+        std::nth_element(entries.begin(), entries.begin() + keep,
+                         entries.end(), [](const Entry& e1, const Entry& e2) {
+                             return e1.count > e2.count; });
+        WordTable kept;
+        for (size_t i = 0; i < keep; i++) {
+            kept.set(entries[i].word, entries[i].hash, entries[i].count);
+        }
+        *this = std::move(kept);
+    }
+
+private:
+    // 1 entry in the hash table.  A count of zero marks an empty slot.
+    struct Slot {
+        uint64_t hash, count;
+        uint32_t offset, length;
+    };
+
+    /**
+     * Find the slot for a word, adding the word with a count of zero if
+     * it is not in the table yet.
+     */
+    Slot& find(const std::string_view word, const uint64_t hash) {
+        if (2 * (numWords + 1) > slots.size()) {
+            grow();
+        }
+        const size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (slot.count == 0) {
+                slot = {hash, 0, static_cast<uint32_t>(text.size()),
+                        static_cast<uint32_t>(word.size())};
+                text.append(word);
+                numWords++;
+                return slot;
+            }
+            if (slot.hash == hash && slot.length == word.size() &&
+                std::memcmp(text.data() + slot.offset, word.data(),
+                            word.size()) == 0) {
+                return slot;
+            }
+        }
+    }
+
+    /** Double the number of slots (which is always a power of 2). */
+    void grow() {
+        std::vector<Slot> old(std::max<size_t>(2 * slots.size(), 64));
+        old.swap(slots);
+        const size_t mask = slots.size() - 1;
+        for (const Slot& slot : old) {
+            if (slot.count != 0) {
+                size_t i = slot.hash & mask;
+                while (slots[i].count != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = slot;
+            }
+        }
+    }
+
+    // The hash table
+    std::vector<Slot> slots;
+    // The characters of all of the words in the table
+    std::string text;
+    // The number of slots in use
+    size_t numWords = 0;
+};
+
+/**
+ * A Count-Min sketch: a fixed-size grid of counters that estimates the
+ * count of any word from its hash.  The estimate is never lower than
+ * the real count and is usually close to it for frequent words.
+ * Sketches of the same size can be merged by adding their counters.
+ */
+class CountMinSketch {
+public:
+    /** The number of rows (i.e., hash functions) in the sketch. */
+    static constexpr size_t Depth = 4;
+
+    /**
+     * \param[in] minWidth The minimum number of counters in each row. It
+     * is rounded up to a power of 2.
+     */
+    explicit CountMinSketch(const size_t minWidth) {
+        while (width < minWidth) {
+            width *= 2;
+        }
+        counters.resize(Depth * width);
+    }
+
+    /**
+     * Count 1 occurrence of a word.
+     *
+     * \param[in] hash The hash of the word.
+     *
+     * \return The estimated count of the word (including this one).
+     */
+    uint64_t add(const uint64_t hash) {
+        uint64_t estimate = UINT64_MAX;
+        for (size_t row = 0; row < Depth; row++) {
+            estimate = std::min(estimate, ++counters[index(hash, row)]);
+        }
+        return estimate;
+    }
+
+    /**
+     * \param[in] hash The hash of a word.
+     *
+     * \return The estimated count of the word.
+     */
+    uint64_t estimate(const uint64_t hash) const {
+        uint64_t estimate = UINT64_MAX;
+        for (size_t row = 0; row < Depth; row++) {
+            estimate = std::min(estimate, counters[index(hash, row)]);
+        }
+        return estimate;
+    }
+
+    /**
+     * Add the counters in a range of another sketch (of the same size)
+     * to this sketch.  Different ranges can be merged by different
+     * threads at the same time.
+     *
+     * \param[in] other The sketch to be merged into this one.
+     *
+     * \param[in] part The part (0 to numParts - 1) to be merged.
+     *
+     * \param[in] numParts The number of parts the counters are split in.
+     */
+    void merge(const CountMinSketch& other, const size_t part,
+               const size_t numParts) {
+        const size_t begin = counters.size() * part / numParts,
+            end = counters.size() * (part + 1) / numParts;
+        for (size_t i = begin; i < end; i++) {
+            counters[i] += other.counters[i];
+        }
+    }
+
+    /** \return The number of counters in each row. */
+    size_t getWidth() const { return width; }
+
+private:
+    /**
+     * \return The index of the counter for a hash in a row.  The hash
+     * functions of the rows are derived from the 2 halves of the hash.
+     */
+    size_t index(const uint64_t hash, const size_t row) const {
+        const uint64_t h = (hash & 0xFFFFFFFF) + row * ((hash >> 32) | 1);
+        return row * width + (h & (width - 1));
+    }
+
+    // The number of counters in each row
+    size_t width = 1;
+    // The rows of counters, 1 after the other
+    std::vector<uint64_t> counters;
+};
+
+/**
+ * The word frequencies counted by 1 worker for 1 URL.  Every word is
+ * counted exactly unless a limit is set on the number of words.  In
+ * that case all of the words are counted in a Count-Min sketch and only
+ * the words with the highest estimated counts (the heavy hitters) are
+ * kept in the table, so the memory used is bounded no matter how many
+ * different words there are.
+ */
+class WordFrequencies {
+public:
+    /**
+     * \param[in] maxWords The maximum number of words kept in the table,
+     * or zero to count every word exactly.
+     */
+    explicit WordFrequencies(const size_t maxWords) : maxWords(maxWords) {
+        if (maxWords != 0) {
+            sketch = std::make_unique<CountMinSketch>(16 * maxWords);
+        }
+    }
+
+    /**
+     * Count 1 occurrence of a word.
+     *
+     * \param[in] word The word to be counted.
+     *
+     * \param[in] hash The hash of the word (see Dictionary::fnv1a).
+     */
+    void add(const std::string_view word, const uint64_t hash) {
+        if (sketch == nullptr) {
+            table.add(word, hash);
+            return;
+        }
+        table.set(word, hash, sketch->add(hash));
+        if (table.size() > maxWords) {
+            // Make room for new words in 1 go rather than 1 at a time
+            table.prune(maxWords / 2);
+        }
+    }
+
+    // The words (or heavy hitters) and their (estimated) counts
+    WordTable table;
+    // The sketch that all of the words are counted in, if bounded
+    std::unique_ptr<CountMinSketch> sketch;
+
+private:
+    const size_t maxWords;
+};
+
+/** A word and its (estimated) count in a list of most frequent words. */
+using WordFreq = std::pair<std::string, uint64_t>;
+
+/**
+ * Sort a list of words by decreasing counts (breaking ties
+ * alphabetically) and keep only the first k words.
  *
- * @param url A string containing a valid URL. The port number in URL
- * is always optional.  The default port number is assumed to be 80.
+ * \param[in,out] words The list of words to be sorted.
  *
- * @return This method returns a std::tuple with 3 strings. The 3
- * strings are in the order: hostname, port, and path.
+ * \param[in] k The number of words to keep.
  */
-std::tuple<std::string, std::string, std::string>
-breakDownURL(const std::string& url) {
-    // The values to be returned.
-    std::string hostName, port = "80", path = "/";
+void keepTop(std::vector<WordFreq>& words, const size_t k) {
+    auto higher = [](const WordFreq& w1, const WordFreq& w2) {
+        return w1.second > w2.second ||
+            (w1.second == w2.second && w1.first < w2.first);
+    };
+    const size_t n = std::min(k, words.size());
+    std::partial_sort(words.begin(), words.begin() + n, words.end(), higher);
+    words.resize(n);
+}
 
-    // Extract the substrings from the given url into the above
-    // variables.
-    std::size_t start = url.find("//") + 2;
-    std::size_t end;
-    hostName = url.substr(start);
-    if (hostName.find(':') != std::string::npos) {
-        end = hostName.find(':');
-        port = hostName.substr(end + 1);
-        port = port.substr(0, port.find('/'));
-    } else {
-        end = hostName.find('/');
-    }
-    path = hostName.substr(hostName.find('/'));
-    hostName = hostName.substr(0, end);
+/**
+ * \param[in] table The table of words to choose from.
+ *
+ * \param[in] k The number of words to choose.
+ *
+ * \return The k words with the highest counts in the table.
+ */
+std::vector<WordFreq> topWords(const WordTable& table, const size_t k) {
+    std::vector<WordFreq> words;
+    words.reserve(table.size());
+    table.forEach([&words](const WordTable::Entry& e) {
+        words.emplace_back(e.word, e.count); });
+    keepTop(words, k);
+    return words;
+}
 
-    // Return 3-values encapsulated into 1-tuple.
-    return { hostName, port, path };
+/**
+ * The word counts for the data from 1 URL.  The data is counted in
+ * chunks by the workers in a WorkStealingPool, and the counts for each
+ * chunk are added here once the chunk is done.
+ */
+struct WordCounts {
+    std::atomic<long> words{0}, englishWords{0};
+    // Set if the data was downloaded (i.e., the server sent 200 OK)
+    bool downloaded = false;
+    // The parts that the data is downloaded in (see fetchParts)
+    std::vector<PartSplitter> parts;
+    // The word frequencies counted by each worker (in --top mode only)
+    std::vector<std::unique_ptr<WordFrequencies>> frequencies;
+    // The most frequent words (see findTopWords)
+    std::vector<WordFreq> top;
+};
+
+/**
+ * Count the words in 1 chunk of data.  This method is run by the
+ * workers in the WorkStealingPool.
+ *
+ * \param[in,out] chunk The data to be counted.  It must not end in the
+ * middle of a word.  It is converted to lower case in place.
+ *
+ * \param[out] counts The counts that this chunk's counts are added to.
+ */
+void countChunk(std::string& chunk, WordCounts& counts) {
+    long wordCount = 0, englishWordCount = 0;
+    WordFrequencies* const frequencies = counts.frequencies.empty() ?
+        nullptr : counts.frequencies[WorkStealingPool::workerIndex()].get();
+    auto countWord = [&](const std::string_view word) {
+        const uint64_t hash = Dictionary::fnv1a(word);
+        if (dictionary.contains(word, hash)) {
+            englishWordCount++;
+        }
+        if (frequencies != nullptr) {
+            frequencies->add(word, hash);
+        }
+        wordCount++;
+    };
+    // The chunk ends at the end of a word, so a word at its end is complete
+    if (const size_t last = tokenize(&chunk[0], chunk.size(), countWord)) {
+        countWord(std::string_view(chunk.data() + chunk.size() - last, last));
+    }
+    counts.words += wordCount;
+    counts.englishWords += englishWordCount;
 }
 
 /**
- * Helper method that uses the breakDownURL method to obtain the host, port,
- * and path of the data file to be processed. It then creates a GET request
- * to download the file from the URL, and performs the initial steps of
- * processing the data stream. Ultimately calls helper method to process data.
+ * Start downloading the data at a URL.  Large documents are downloaded
+ * as several parts in parallel (1 per core, if the server supports
+ * Range requests) and the data is streamed into the pool in chunks as
+ * it arrives.  Once all of the parts are done, the words that span 2
+ * parts are put back together and counted.
  *
  * @param url A string containing a valid URL.
  *
+ * @param counts The counts for the data at the URL.
+ *
+ * @param fetcher The fetcher used to download the data.
+ *
+ * @param pool The pool that counts the data.
  */
-void serveClient(const std::string& url, std::string& result) {
-    std::string hostname, port, path;
-    // Extract URL components
-    std::tie(hostname, port, path) = breakDownURL(url);
-    // Start the download of the file (that the user wants to be
-    // processed) at the specified URL.
-    boost::asio::ip::tcp::iostream data(hostname, port);
-    data << "GET " << path << " HTTP/1.1\r\n"
-        << "Host: " << hostname << "\r\n"
-        << "Connection: Close\r\n\r\n";
-    // Get the first HTTP response line and ensure it has 200 OK in it
-    // to indicate that the data stream is good.
-    std::string line;
-    std::getline(data, line);
-    if (line.find("200 OK") == std::string::npos) {
-        return;
-    }
-    // Skip over HTTP response headers.
-    for (std::string hdr; std::getline(data, hdr) && !hdr.empty()
-        && hdr != "\r";) {
-    }
-    // Process data from the file.
-    processData(data, result);
+void serveClient(const std::string& url, WordCounts& counts,
+                 HTTPFetcher& fetcher, WorkStealingPool& pool) {
+    auto submit = [&pool, &counts](std::string chunk) {
+        pool.submit([&counts, chunk = std::move(chunk)]() mutable {
+            countChunk(chunk, counts); });
+    };
+    auto makeHandler = [&counts, submit](const size_t part,
+                                         const size_t numParts) {
+        if (counts.parts.empty()) {
+            counts.parts.resize(numParts);
+        }
+        PartSplitter& splitter = counts.parts[part];
+        return [&splitter, submit](const char* data, const size_t len) {
+            splitter.add(data, len, submit);
+        };
+    };
+    const unsigned int cores = std::max(std::thread::hardware_concurrency(),
+                                        1u);
+    fetcher.fetchParts(url, cores, 4 * PartSplitter::ChunkSize, makeHandler,
+        [&counts, submit](const boost::system::error_code& ec,
+                          const HTTPFetcher::Response& resp) {
+            counts.downloaded = !ec && resp.status == 200;
+            // Join the words that span the boundaries between parts
+            std::string word;
+            for (PartSplitter& part : counts.parts) {
+                part.finish(submit);
+                word += part.head;
+                if (part.hasSeparator) {
+                    if (!word.empty()) {
+                        submit(std::move(word));
+                    }
+                    word = std::move(part.tail);
+                }
+            }
+            if (!word.empty()) {
+                submit(std::move(word));
+            }
+            counts.parts.clear();
+        });
 }
 
-void threadMain(const std::string& fileName, std::string& result) {
-    result = fileName;
-    serveClient(fileName, result);
+/**
+ * Merge the word frequencies counted by the workers and find the most
+ * frequent words for each URL and for all of the URLs together.  The
+ * words are split into as many partitions (by hash) as there are
+ * workers, and each partition is merged by 1 task on the pool into a
+ * table of its own, so no locks are needed.  The top words of the
+ * partitions are then combined.  In bounded mode the sketches are
+ * merged first (again 1 range of counters per task) and the counts of
+ * the heavy hitters are estimated from the merged sketches.
+ *
+ * \param[in,out] counts The counts for each URL.  The top words are
+ * stored in each entry.
+ *
+ * \param[in] k The number of top words to find.
+ *
+ * \param[in] pool The pool that does the merging.
+ *
+ * \return The top words for all of the URLs together.
+ */
+std::vector<WordFreq> findTopWords(std::vector<WordCounts>& counts,
+                                   const size_t k, WorkStealingPool& pool) {
+    const size_t numParts = pool.size();
+    const bool bounded = !counts.empty() &&
+        counts[0].frequencies[0]->sketch != nullptr;
+    // In bounded mode, the sketch of each URL is merged into its first
+    // worker's sketch and the sketches of all URLs into total
+    std::unique_ptr<CountMinSketch> total;
+    if (bounded) {
+        total = std::make_unique<CountMinSketch>(
+            counts[0].frequencies[0]->sketch->getWidth());
+        for (size_t part = 0; part < numParts; part++) {
+            pool.submit([&counts, &total, part, numParts] {
+                for (size_t i = 0; i < counts.size(); i++) {
+                    auto& freqs = counts[i].frequencies;
+                    for (size_t w = 1; w < freqs.size(); w++) {
+                        freqs[0]->sketch->merge(*freqs[w]->sketch, part,
+                                                numParts);
+                    }
+                    total->merge(*freqs[0]->sketch, part, numParts);
+                }
+            });
+        }
+        pool.wait();
+    }
+    // The top words in each partition for each URL (and in the last
+    // entry, for all of the URLs)
+    std::vector<std::vector<std::vector<WordFreq>>> partTops(numParts,
+        std::vector<std::vector<WordFreq>>(counts.size() + 1));
+    for (size_t part = 0; part < numParts; part++) {
+        pool.submit([&, part] {
+            WordTable all;
+            for (size_t i = 0; i < counts.size(); i++) {
+                const CountMinSketch* sketch = bounded ?
+                    counts[i].frequencies[0]->sketch.get() : nullptr;
+                WordTable merged;
+                for (const auto& freqs : counts[i].frequencies) {
+                    freqs->table.forEach([&](const WordTable::Entry& e) {
+                        if ((e.hash >> 32) % numParts != part) {
+                            return;
+                        } else if (sketch == nullptr) {
+                            merged.add(e.word, e.hash, e.count);
+                            all.add(e.word, e.hash, e.count);
+                        } else {
+                            merged.set(e.word, e.hash,
+                                       sketch->estimate(e.hash));
+                            all.set(e.word, e.hash, total->estimate(e.hash));
+                        }
+                    });
+                }
+                partTops[part][i] = topWords(merged, k);
+            }
+            partTops[part][counts.size()] = topWords(all, k);
+        });
+    }
+    pool.wait();
+    // Combine the top words of the partitions
+    std::vector<WordFreq> overall;
+    for (size_t i = 0; i <= counts.size(); i++) {
+        std::vector<WordFreq>& top = (i < counts.size()) ? counts[i].top :
+            overall;
+        for (auto& partTop : partTops) {
+            std::move(partTop[i].begin(), partTop[i].end(),
+                      std::back_inserter(top));
+        }
+        keepTop(top, k);
+    }
+    return overall;
 }
 
 /**
- * The main function that begins the process of downloading and processing
- * log entries from the given URL and detecting potential hacking attempts.
+ * Print a list of most frequent words, 1 per line.
  *
- * \param[in] argc The number of command-line arguments.  This program
- * requires exactly one command-line argument.
+ * \param[in] top The words to be printed.
+ */
+void printTop(const std::vector<WordFreq>& top) {
+    for (const auto& wf : top) {
+        std::cout << "    " << wf.first << '=' << wf.second << '\n';
+    }
+}
+
+/**
+ * The main function that begins the process of downloading and counting
+ * the words in the documents at the given URLs.
+ *
+ * \param[in] argc The number of command-line arguments.
  *
- * \param[in] argv The actual command-line argument. This should be an URL.
+ * \param[in] argv The command-line arguments: the options followed by
+ * the URLs.  The options are:
+ *   --top K        Also print the K most frequent words for each URL
+ *                  and for all of the URLs together.
+ *   --max-words N  With --top, bound the memory used by keeping only
+ *                  (about) N heavy hitters per worker and URL; their
+ *                  counts are then estimated with Count-Min sketches.
+ * Alternatively "--build-dictionary english.txt english.idx" builds the
+ * index file for the dictionary (see Dictionary) and exits.
  */
 int main(int argc, char* argv[]) {
-    std::vector<std::string> results(argc - 1, "");
-    std::vector<std::thread> myThreads;
-    for (int i = 1; i < argc; i++) {
-        myThreads.push_back(std::thread(threadMain, argv[i],
-            std::ref(results[i-1])));
+    if (argc == 4 && std::string(argv[1]) == "--build-dictionary") {
+        std::ofstream(argv[3], std::ios::binary) << Dictionary::build(argv[2]);
+        return 0;
+    }
+    size_t topK = 0, maxWords = 0;
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        const std::string opt = argv[first];
+        if (opt == "--top") {
+            topK = std::stoul(argv[first + 1]);
+        } else if (opt == "--max-words") {
+            maxWords = std::stoul(argv[first + 1]);
+        } else {
+            std::cerr << "Unknown option " << opt << std::endl;
+            return 1;
+        }
+    }
+    const std::vector<std::string> urls(argv + first, argv + argc);
+    // Count words on every core, however many URLs there are and
+    // however large they are.  All of the downloads are done
+    // asynchronously by 1 thread that feeds chunks to the counters.
+    const unsigned int cores = std::max(std::thread::hardware_concurrency(),
+                                        1u);
+    WorkStealingPool pool(cores, 4 * cores);
+    std::vector<WordCounts> counts(urls.size());
+    for (size_t i = 0; topK > 0 && i < urls.size(); i++) {
+        for (size_t w = 0; w < pool.size(); w++) {
+            counts[i].frequencies.push_back(
+                std::make_unique<WordFrequencies>(maxWords));
+        }
+    }
+    boost::asio::io_context io;
+    HTTPFetcher fetcher(io, cores);
+    for (size_t i = 0; i < urls.size(); i++) {
+        serveClient(urls[i], counts[i], fetcher, pool);
     }
-    for (auto& t : myThreads) {
-        t.join();
+    io.run();
+    pool.wait();
+    std::vector<WordFreq> overall;
+    if (topK > 0) {
+        overall = findTopWords(counts, topK, pool);
+    }
+    for (size_t i = 0; i < urls.size(); i++) {
+        std::cout << urls[i];
+        if (counts[i].downloaded) {
+            std::cout << ": words=" << counts[i].words
+                      << ", English words=" << counts[i].englishWords;
+        }
+        std::cout << std::endl;
+        if (counts[i].downloaded) {
+            printTop(counts[i].top);
+        }
     }
-    for (int i = 0; i < argc - 1; i++) {
-        std::cout << results[i] << std::endl;
+    if (topK > 0) {
+        std::cout << "All URLs:" << std::endl;
+        printTop(overall);
     }
 }
@@ -1,13 +1,19 @@
 /* 
 * Copyright 2021 Michael Glum
 * 
- * A custom shell that uses fork() and execvp() for running commands
- * in serial or in parallel.
+ * A custom shell that runs commands in serial, in parallel, or as a
+ * graph of dependent targets with pipelines.  Commands are started with
+ * posix_spawn (or fork() and execvp(), or helper
+ * processes; see ProcessLauncher.h).
  * 
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <chrono>
+#include <deque>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -15,19 +21,36 @@
 #include <vector>
 #include <algorithm>
 #include <iomanip>
-#include "ChildProcess.h"
+#include <thread>
+#include <unordered_map>
+#include "ProcessLauncher.h"
 
 // A vector of strings to ease running programs with command-line
 // arguments.
 using StrVec = std::vector<std::string>;
 
-// A vector of integers to hold child process ID's when operating in
-// parallel mode.
-using IntVec = std::vector<int>;
+// A command running as a child process in parallel mode.
+struct Job {
+    std::string cmd;
+    ProcessLauncher::Process proc;
+};
+
+// A vector of the jobs running in parallel mode.
+using JobVec = std::vector<Job>;
+
+// Starts the commands run by this shell
+ProcessLauncher launcher;
+
+// Flag to indicate if the time taken to launch each command is printed
+bool showLaunchTime = false;
+
+// The number of jobs run at once in parallel mode, unless a PARALLEL
+// command gives its own limit.
+size_t defaultJobs = std::max(1u, std::thread::hardware_concurrency());
 
 // Header for processCmds method implemented below.
 void processCmds(std::istream& is, std::ostream& os, bool parMode,
-    const std::string prompt);
+    const std::string prompt, const size_t maxJobs = defaultJobs);
 
 /** Convenience method to split a given line into individual words.
 
@@ -49,24 +72,354 @@ StrVec split(const std::string& line) {
 /**
     This helper method waits for a child process to terminate and prints its
     exit code.
-    \param[in] pid The pid of the child process.
+    \param[in] proc The child process.
     \param[in] os The output stream to be printed to.
 */
-void waitAndPrint(const int pid, std::ostream& os) {
-    int exitCode = 0;
-    waitpid(pid, &exitCode, 0);
+void waitAndPrint(ProcessLauncher::Process& proc, std::ostream& os) {
+    int exitCode = launcher.wait(proc);
     os << "Exit code: " << exitCode << std::endl;
 }
 
+/** \return The number of seconds in a timeval. */
+double seconds(const timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
 /**
-    This helper method checks if the first word of the input is one of three
+    This helper method prints the exit code of a finished job along with its
+    name, its wall time, and its CPU usage.
+    \param[in] os The output stream to be printed to.
+    \param[in] exitCode The raw exit code of the job.
+    \param[in] name The command (or target) that was run.
+    \param[in] started When the job was started.
+    \param[in] user The user CPU time used by the job (in seconds).
+    \param[in] sys The system CPU time used by the job (in seconds).
+*/
+void printExit(std::ostream& os, const int exitCode, const std::string& name,
+    const std::chrono::steady_clock::time_point started, const double user,
+    const double sys) {
+    const std::chrono::duration<double> wall =
+        std::chrono::steady_clock::now() - started;
+    os << "Exit code: " << exitCode << " [" << name << "] " << std::fixed
+       << std::setprecision(3) << "wall: " << wall.count() << "s user: "
+       << user << "s sys: " << sys << 's' << std::defaultfloat << std::endl;
+}
+
+/**
+    This helper method waits for whichever running job finishes first, prints
+    its exit code along with the command, its wall time, and its CPU usage,
+    and removes it from the running jobs.
+    \param[in,out] jobs The running jobs. This must not be empty.
+    \param[in] os The output stream to be printed to.
+*/
+void reapJob(JobVec& jobs, std::ostream& os) {
+    std::vector<ProcessLauncher::Process*> procs;
+    for (Job& job : jobs) {
+        procs.push_back(&job.proc);
+    }
+    int exitCode = 0;
+    rusage usage;
+    const size_t done = launcher.waitAny(procs, exitCode, &usage);
+    printExit(os, exitCode, jobs[done].cmd, jobs[done].proc.started,
+              seconds(usage.ru_utime), seconds(usage.ru_stime));
+    jobs.erase(jobs.begin() + done);
+}
+
+/**
+    A batch of commands whose order is constrained by dependencies. The batch
+    file has make-style targets: a line "name: dep1 dep2" starts a target, and
+    the indented lines that follow are its commands. A target is run once all
+    the targets it depends on have succeeded, with up to maxJobs targets
+    running at once. Its commands run one after another until one fails. A
+    command may be a pipeline ("cmd1 | cmd2"), whose stages run at once
+    connected by pipes, and "&&" separates commands on one line. Lines that
+    are neither targets nor indented are commands with no dependencies.
+*/
+class DagBatch {
+public:
+    /**
+        Read the targets in a batch file.
+        \param[in] is The input stream to read the batch file from.
+        \param[in] os The output stream for errors in the file.
+        \return True if the file is valid (and can be run).
+    */
+    bool load(std::istream& is, std::ostream& os) {
+        std::string line;
+        bool inTarget = false;
+        while (std::getline(is, line)) {
+            const StrVec words = split(line);
+            if (words.empty() || words[0][0] == '#') {
+                continue;
+            }
+            const bool indented = (line[0] == ' ' || line[0] == '\t');
+            if (!indented && words[0].size() > 1 && words[0].back() == ':') {
+                // A new target along with the names of its dependencies
+                const std::string name(words[0], 0, words[0].size() - 1);
+                if (!byName.emplace(name, targets.size()).second) {
+                    os << "Duplicate target: " << name << std::endl;
+                    return false;
+                }
+                targets.push_back({name, StrVec(words.begin() + 1,
+                                                words.end())});
+                inTarget = true;
+                continue;
+            }
+            if (!indented || !inTarget) {
+                // A command of its own, named after itself
+                targets.push_back({line});
+                inTarget = false;
+            }
+            if (!addPipelines(words, targets.back())) {
+                os << "Syntax error: " << line << std::endl;
+                return false;
+            }
+        }
+        // Link each target with the targets that depend on it
+        for (size_t i = 0; i < targets.size(); i++) {
+            for (const std::string& dep : targets[i].deps) {
+                const auto it = byName.find(dep);
+                if (it == byName.end()) {
+                    os << "Unknown target: " << dep << " (needed by "
+                       << targets[i].name << ")" << std::endl;
+                    return false;
+                }
+                targets[it->second].dependents.push_back(i);
+                targets[i].waitingFor++;
+            }
+        }
+        return true;
+    }
+
+    /**
+        Run the targets, keeping as many running as the dependencies (and the
+        limit) allow. The exit code of each target is printed, in the order
+        they finish, with its wall time and the CPU used by its commands.
+        \param[in] os The output stream for the results to be sent to
+        \param[in] maxJobs The number of targets that may run at once.
+    */
+    void run(std::ostream& os, const size_t maxJobs) {
+        std::deque<size_t> ready;
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i].waitingFor == 0) {
+                ready.push_back(i);
+            }
+        }
+        size_t running = 0;
+        while (true) {
+            while (!ready.empty() && running < maxJobs) {
+                Target& target = targets[ready.front()];
+                ready.pop_front();
+                target.started = std::chrono::steady_clock::now();
+                if (target.pipelines.empty()) {
+                    finish(target, ready, os);  // Nothing to run
+                } else {
+                    running++;
+                    startPipeline(target, os);
+                }
+            }
+            if (stages.empty()) {
+                break;
+            }
+            // Wait for any stage of any running pipeline to finish
+            std::vector<ProcessLauncher::Process*> procs;
+            for (Stage& stage : stages) {
+                procs.push_back(&stage.proc);
+            }
+            int exitCode = 0;
+            rusage usage;
+            const size_t done = launcher.waitAny(procs, exitCode, &usage);
+            Target& target = targets[stages[done].target];
+            target.user += seconds(usage.ru_utime);
+            target.sys += seconds(usage.ru_stime);
+            if (stages[done].last) {
+                // A pipeline's exit code is that of its last stage
+                target.exitCode = exitCode;
+            }
+            stages.erase(stages.begin() + done);
+            if (--target.running > 0) {
+                continue;
+            } else if (target.exitCode == 0 &&
+                       target.next < target.pipelines.size()) {
+                startPipeline(target, os);
+            } else {
+                running--;
+                finish(target, ready, os);
+            }
+        }
+        // Targets that never became ready are in a dependency cycle or
+        // depend on one
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i].state == Target::Waiting) {
+                os << (inCycle(i) ? "Not run (dependency cycle): " :
+                       "Not run (blocked by a dependency cycle): ")
+                   << targets[i].name << std::endl;
+            }
+        }
+    }
+
+private:
+    // A command along with the commands it sends its output to
+    using Pipeline = std::vector<StrVec>;
+
+    // A named group of pipelines that run one after another
+    struct Target {
+        enum State { Waiting, Done, Skipped };
+
+        std::string name;
+        // The names of the targets that must succeed first
+        StrVec deps;
+        std::vector<Pipeline> pipelines;
+        // The indexes of the targets that depend on this one
+        std::vector<size_t> dependents;
+        // The number of dependencies that have not yet succeeded
+        size_t waitingFor = 0;
+        // The next pipeline to run and the number of its stages running
+        size_t next = 0, running = 0;
+        int exitCode = 0;
+        State state = Waiting;
+        std::chrono::steady_clock::time_point started;
+        // The CPU time (in seconds) used by the target's commands
+        double user = 0, sys = 0;
+    };
+
+    // A running stage of a target's current pipeline
+    struct Stage {
+        size_t target;
+        bool last;
+        ProcessLauncher::Process proc;
+    };
+
+    /**
+        Helper method to split a command line into pipelines separated by
+        "&&", each made up of commands separated by "|".
+        \return False if any of the commands is empty.
+    */
+    static bool addPipelines(const StrVec& words, Target& target) {
+        Pipeline pipeline(1);
+        for (size_t i = 0; i <= words.size(); i++) {
+            if (i < words.size() && words[i] != "|" && words[i] != "&&") {
+                pipeline.back().push_back(words[i]);
+            } else if (pipeline.back().empty()) {
+                return false;
+            } else if (i < words.size() && words[i] == "|") {
+                pipeline.emplace_back();
+            } else {
+                target.pipelines.push_back(std::move(pipeline));
+                pipeline.assign(1, StrVec());
+            }
+        }
+        return true;
+    }
+
+    /**
+        Helper method to check if a target is in a dependency cycle, that
+        is, if it (indirectly) depends on itself.
+        \return True if the target is in a cycle.
+    */
+    bool inCycle(const size_t start) const {
+        std::vector<bool> seen(targets.size());
+        std::vector<size_t> todo(targets[start].dependents);
+        while (!todo.empty()) {
+            const size_t i = todo.back();
+            todo.pop_back();
+            if (i == start) {
+                return true;
+            } else if (!seen[i]) {
+                seen[i] = true;
+                todo.insert(todo.end(), targets[i].dependents.begin(),
+                            targets[i].dependents.end());
+            }
+        }
+        return false;
+    }
+
+    /**
+        Helper method to start a target's next pipeline, with a pipe from
+        each stage to the next one.
+    */
+    void startPipeline(Target& target, std::ostream& os) {
+        const Pipeline& pipeline = target.pipelines[target.next++];
+        os << "Running: ";
+        for (size_t i = 0; i < pipeline.size(); i++) {
+            for (size_t j = 0; j < pipeline[i].size(); j++) {
+                os << (i + j > 0 ? (j == 0 ? " | " : " ") : "")
+                   << pipeline[i][j];
+            }
+        }
+        os << std::endl;
+        int inFd = -1;
+        for (size_t i = 0; i < pipeline.size(); i++) {
+            const bool last = (i + 1 == pipeline.size());
+            int pipeFds[2] = {-1, -1};
+            if (!last && pipe2(pipeFds, O_CLOEXEC) != 0) {
+                pipeFds[0] = pipeFds[1] = -1;
+            }
+            stages.push_back({static_cast<size_t>(&target - &targets[0]),
+                              last, launcher.launch(pipeline[i], inFd,
+                                                    pipeFds[1])});
+            target.running++;
+            if (showLaunchTime) {
+                os << "Launch time: " << stages.back().proc.launchTime.count()
+                   << " us" << std::endl;
+            }
+            // The ends of the pipes are now held by the stages only
+            for (const int fd : {inFd, pipeFds[1]}) {
+                if (fd != -1) {
+                    close(fd);
+                }
+            }
+            inFd = pipeFds[0];
+        }
+    }
+
+    /**
+        Helper method to report a finished target and make the targets that
+        depend on it ready (if it succeeded) or skip them (if it failed).
+    */
+    void finish(Target& target, std::deque<size_t>& ready, std::ostream& os) {
+        target.state = Target::Done;
+        printExit(os, target.exitCode, target.name, target.started,
+                  target.user, target.sys);
+        for (const size_t dependent : target.dependents) {
+            if (target.exitCode != 0) {
+                skip(targets[dependent], os);
+            } else if (--targets[dependent].waitingFor == 0 &&
+                       targets[dependent].state == Target::Waiting) {
+                ready.push_back(dependent);
+            }
+        }
+    }
+
+    /** Helper method to skip a target (and all those that depend on it). */
+    void skip(Target& target, std::ostream& os) {
+        if (target.state == Target::Waiting) {
+            target.state = Target::Skipped;
+            os << "Skipped: " << target.name << std::endl;
+            for (const size_t dependent : target.dependents) {
+                skip(targets[dependent], os);
+            }
+        }
+    }
+
+    // The targets, in the order they appear in the batch file
+    std::vector<Target> targets;
+    std::unordered_map<std::string, size_t> byName;
+    // The stages of the pipelines that are running
+    std::vector<Stage> stages;
+};
+
+/**
+    This helper method checks if the first word of the input is one of four
     special cases: "exit" (resulting in termination of the program), "SERIAL"
     (indicating that the commands should be processed serially from a file), 
-    or "PARALLEL" (indicating that the commands should be processed from a file
-    in parallel). In the case of the first word being "SERIAL" or "PARALLEL"
+    "PARALLEL" (indicating that the commands should be processed from a file
+    in parallel), or "DAG" (indicating that the targets in a file should be
+    run as their dependencies allow; see DagBatch).
+    In the case of the first word being "SERIAL" or "PARALLEL"
     the current instance of the processCmds method is terminated, and
     the method is called again with an input stream from a file denoted by
-    the second word.
+    the second word. "PARALLEL <file> -j N" runs at most N of the file's
+    commands at once, as does "DAG <file> -j N" for targets.
     \param[in] words The vector of strings containing each command line
     argument.
     \param[in] os The output stream to be passed back to processCmds
@@ -93,44 +446,69 @@ bool specialFirstWord(const StrVec& words, std::ostream& os) {
         // so that it does not appear that the file input is being prompted.
         // Terminate the old instance of processCmds.
         std::ifstream in(words[1]);
-        processCmds(in, os, true, "");
+        const size_t maxJobs = (words.size() > 3 && words[2] == "-j") ?
+            std::max(1, std::stoi(words[3])) : defaultJobs;
+        processCmds(in, os, true, "", maxJobs);
+        b = true;
+    } else if (words[0] == "DAG") {
+        // Run the targets in the given file and then return to prompting
+        // the user, as for SERIAL and PARALLEL.
+        std::ifstream in(words[1]);
+        const size_t maxJobs = (words.size() > 3 && words[2] == "-j") ?
+            std::max(1, std::stoi(words[3])) : defaultJobs;
+        DagBatch batch;
+        if (batch.load(in, os)) {
+            batch.run(os, maxJobs);
+        }
+        os << "> ";
         b = true;
     }
     return b;
 }
 
 /**
-    This helper method calls forkNexec to create child processes and execute
+    This helper method uses the launcher to create child processes and execute
     each of the commands as they are passed to this method line by line. It
     also prints output showing the running status of the commands, as
     well as the results of the commands when processed serially. 
     \param[in] words A vector of strings containing a command and
     its associated arguments.
-    \param[in] pids A reference to a vector of integer for pids to be stored
+    \param[in] jobs A reference to a vector for the running jobs to be stored
     in when the commands are processed in parallel.
     \param[in] os The output stream for the results to be sent to
     \param[in] parmode Boolean indicating whether the commands should be
     processed in parallel.
+    \param[in] maxJobs The number of jobs that may run at once in parallel
+    mode. When that many are running, one must finish before the next starts.
 */
-void runCmds(StrVec words, IntVec& pids, std::ostream& os, bool parMode) {
+void runCmds(StrVec words, JobVec& jobs, std::ostream& os, bool parMode,
+    const size_t maxJobs) {
+    while (parMode && jobs.size() >= maxJobs) {
+        reapJob(jobs, os);
+    }
     // Print and format the command and arguments being run
     os << "Running: ";
     for (size_t i = 0; i < words.size() - 1; i++) {
         os << words[i] << " ";
     }
     os << words[words.size() - 1] << std::endl;
-    // Create a ChildProcess object to be used to call forkNexec
-    ChildProcess cp;
-    // Call forkNexec to execute the command within a child process
-    // and store its pid.
-    int pid = cp.forkNexec(words);
-    // If the commands are to be processed in parallel, add the pid
-    // to the vector of pids to be used within processCmds.
-    // Otherwise, call a helper method to call waitpid and print the results.
+    // Execute the command within a child process
+    ProcessLauncher::Process proc = launcher.launch(words);
+    if (showLaunchTime) {
+        os << "Launch time: " << proc.launchTime.count() << " us"
+           << std::endl;
+    }
+    // If the commands are to be processed in parallel, add the job
+    // to the vector of jobs to be used within processCmds.
+    // Otherwise, call a helper method to wait and print the results.
     if (parMode == true) {
-        pids.push_back(pid);
+        std::string cmd = words[0];
+        for (size_t i = 1; i < words.size(); i++) {
+            cmd += " " + words[i];
+        }
+        jobs.push_back({cmd, proc});
     } else {
-        waitAndPrint(pid, os);
+        waitAndPrint(proc, os);
     }
 }
 
@@ -146,11 +524,12 @@ void runCmds(StrVec words, IntVec& pids, std::ostream& os, bool parMode) {
     processed in parallel.
     \param[in] prompt Either the text used to prompt the user for input, or
     an emptry string when reading lines from a file.
+    \param[in] maxJobs The number of commands run at once in parallel mode.
 */
 void processCmds(std::istream& is, std::ostream& os, bool parMode,
-    const std::string prompt) {
+    const std::string prompt, const size_t maxJobs) {
     std::string line;
-    IntVec pids;
+    JobVec jobs;
     // Prompt user and read input.
     while (os << prompt, std::getline(is, line)) {
         // Ignore empty or commented lines
@@ -166,14 +545,14 @@ void processCmds(std::istream& is, std::ostream& os, bool parMode,
                 break;
             }
             // Helper method to execute the commands
-            runCmds(words, pids, os, parMode);
+            runCmds(words, jobs, os, parMode, maxJobs);
         }
     }
-    // In the case that the commands are processed in parallel, the IntVec of
-    // pids will be populated. Use a helper method to call waitpid for each
-    // of the child processes and print the exit code.
-    for (size_t i = 0; i < pids.size(); i++) {
-        waitAndPrint(pids[i], os);
+    // In the case that the commands are processed in parallel, the JobVec
+    // will hold the jobs still running. Use a helper method to wait for each
+    // of them, in the order they finish, and print the exit code.
+    while (!jobs.empty()) {
+        reapJob(jobs, os);
     }
     // After input has been read from a file, return to prompting the user
     // as normal.
@@ -185,8 +564,28 @@ void processCmds(std::istream& is, std::ostream& os, bool parMode,
 
 /**
     Simple main method to call the processCmds method which operates the shell.
+    The optional arguments choose how commands are launched: "--fork" uses
+    fork() and execvp(), "--helpers N" uses N pre-forked helper processes,
+    "--timing" prints the time taken to launch each command, and "-j N" sets
+    the number of jobs that PARALLEL runs at once (default: number of cores).
 */
-int main() {
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--fork") {
+            launcher.setMode(ProcessLauncher::Mode::Fork);
+        } else if (arg == "--helpers" && i + 1 < argc) {
+            launcher.startHelpers(std::stoi(argv[++i]));
+        } else if (arg == "--timing") {
+            showLaunchTime = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            defaultJobs = std::max(1, std::stoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--fork] [--helpers N] [--timing] [-j N]\n";
+            return 1;
+        }
+    }
     processCmds(std::cin, std::cout, false, "> ");
 }
 
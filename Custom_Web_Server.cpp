@@ -1,49 +1,648 @@
 /*
 * Copyright 2021 Michael Glum
+*
+* A simple web-server that serves files and runs commands.  Each client
+* connection is served by a thread of its own.  Files are served from a
+* cache of open files with sendfile, and support ETags and byte ranges.
+* Small files and the output of read-only commands are also kept in an
+* in-memory LRU cache of responses.
 */
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "HTTPFile.h"
+#include "HTTPRequest.h"
 #include "ChildProcess.h"
+#include "ProcessLauncher.h"
 
 // Convenience namespace to streamline the code below.
 using namespace boost::asio;
 using namespace boost::asio::ip;
 
-// Forward declaration for url_decode method defined below.  We need
-// this declaration this just to organize the starter code into
-// sections that students should not modify (to minimize problems for
-// students).
-std::string url_decode(std::string url);
+/**
+ * An open file along with the metadata needed to serve it.  The file
+ * stays open for as long as the FileCache (or a request that is
+ * sending it) holds on to it.
+ */
+struct OpenFile {
+    ~OpenFile() { close(fd); }
+
+    int fd;
+    uint64_t size;
+    // Used to tell whether the file has changed since it was opened
+    ino_t inode;
+    timespec mtime;
+    // The entity tag of this version of the file
+    std::string etag;
+    std::string contentType;
+    // When the file's metadata was last compared with the file system
+    std::chrono::steady_clock::time_point checked;
+};
+
+/**
+ * A cache of open files and their metadata, shared by all of the
+ * connections.  A hot file is served without any open or stat system
+ * calls: its metadata is revalidated (with 1 stat) at most once a
+ * second, so a changed file is noticed within a second.
+ */
+class FileCache {
+public:
+    /** The maximum number of files kept open. */
+    static constexpr size_t MaxFiles = 256;
+
+    /**
+     * Find (or open) a regular file.
+     *
+     * \param[in] path The path to the file.
+     *
+     * \return The open file, or nullptr if it is not a readable,
+     * regular file.
+     */
+    std::shared_ptr<const OpenFile> get(const std::string& path) {
+        const auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = files.find(path);
+        if (it != files.end() && now - it->second->checked <
+            std::chrono::seconds(1)) {
+            return it->second;
+        }
+        std::shared_ptr<OpenFile> file = (it == files.end()) ? nullptr :
+            it->second;
+        lock.unlock();
+        // Check the file system without holding the lock
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            file = nullptr;
+        } else if (file == nullptr || file->inode != info.st_ino ||
+                   file->size != static_cast<uint64_t>(info.st_size) ||
+                   file->mtime.tv_sec != info.st_mtim.tv_sec ||
+                   file->mtime.tv_nsec != info.st_mtim.tv_nsec) {
+            file = open(path);
+        }
+        lock.lock();
+        if (file == nullptr) {
+            files.erase(path);
+            return nullptr;
+        }
+        file->checked = now;
+        if (files.size() >= MaxFiles && files.find(path) == files.end()) {
+            // Make room by closing the file checked longest ago
+            files.erase(std::min_element(files.begin(), files.end(),
+                [](const auto& f1, const auto& f2) {
+                    return f1.second->checked < f2.second->checked; }));
+        }
+        files[path] = file;
+        return file;
+    }
+
+private:
+    /**
+     * Open a file and read its metadata.
+     *
+     * \return The file, or nullptr if it could not be opened.
+     */
+    static std::shared_ptr<OpenFile> open(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd == -1) {
+            return nullptr;
+        } else if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            ::close(fd);
+            return nullptr;
+        }
+        auto file = std::make_shared<OpenFile>();
+        file->fd = fd;
+        file->size = info.st_size;
+        file->inode = info.st_ino;
+        file->mtime = info.st_mtim;
+        std::ostringstream etag;
+        etag << '"' << std::hex << info.st_ino << '-' << info.st_size << '-'
+             << info.st_mtim.tv_sec << '.' << info.st_mtim.tv_nsec << '"';
+        file->etag = etag.str();
+        file->contentType = contentType(path);
+        file->checked = std::chrono::steady_clock::now();
+        return file;
+    }
+
+    /** \return The MIME type for a file, based on its extension. */
+    static std::string contentType(const std::string& path) {
+        static const std::unordered_map<std::string, std::string> types = {
+            {"html", "text/html"}, {"htm", "text/html"},
+            {"css", "text/css"}, {"js", "application/javascript"},
+            {"json", "application/json"}, {"xml", "application/xml"},
+            {"png", "image/png"}, {"jpg", "image/jpeg"},
+            {"jpeg", "image/jpeg"}, {"gif", "image/gif"},
+            {"svg", "image/svg+xml"}, {"ico", "image/x-icon"},
+            {"pdf", "application/pdf"}, {"zip", "application/zip"},
+            {"gz", "application/gzip"}, {"txt", "text/plain"}};
+        const size_t dot = path.rfind('.');
+        const auto it = (dot == std::string::npos) ? types.end() :
+            types.find(path.substr(dot + 1));
+        return (it != types.end()) ? it->second : "text/plain";
+    }
+
+    // The files, by path
+    std::unordered_map<std::string, std::shared_ptr<OpenFile>> files;
+    std::mutex mutex;
+};
+
+// The open files shared by all of the connections
+FileCache fileCache;
+
+/**
+ * A complete response body kept in the ResponseCache.
+ */
+struct CachedResponse {
+    std::string contentType;
+    // The entity tag of the file the body was read from (if any)
+    std::string etag;
+    std::string body;
+    // When the response must no longer be used
+    std::chrono::steady_clock::time_point expires;
+};
+
+/**
+ * A size-bounded cache of responses, keyed by decoded URL, for the
+ * small files and read-only commands that make up most requests.  The
+ * cache is split into shards (each with its own lock and least
+ * recently used list) so that concurrent connections rarely contend.
+ */
+class ResponseCache {
+public:
+    /** The number of independently locked shards. */
+    static constexpr size_t NumShards = 16;
+
+    /** The largest body that is cached. */
+    static constexpr size_t MaxEntrySize = 1 << 20;
+
+    /**
+     * Create an empty cache.
+     *
+     * \param[in] maxBytes The total size of the bodies in the cache.
+     */
+    explicit ResponseCache(const size_t maxBytes) :
+        shardBytes(maxBytes / NumShards) {}
+
+    /**
+     * Find a response and mark it as the most recently used one.
+     *
+     * \param[in] url The decoded URL of the request.
+     *
+     * \param[in] etag The current entity tag of the file the response
+     * must have been read from, or empty for a command's output.  A
+     * response with any other tag is stale and is removed.
+     *
+     * \return The response, or nullptr if there is no usable one.
+     */
+    std::shared_ptr<const CachedResponse> get(const std::string_view url,
+                                              const std::string& etag = "") {
+        Shard& shard = getShard(url);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.index.find(url);
+        if (it == shard.index.end()) {
+            misses++;
+            return nullptr;
+        }
+        const auto entry = it->second;
+        if (entry->response->etag != etag ||
+            entry->response->expires <= std::chrono::steady_clock::now()) {
+            shard.remove(entry);
+            misses++;
+            return nullptr;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+        hits++;
+        return entry->response;
+    }
+
+    /**
+     * Add (or replace) a response, removing the least recently used
+     * responses in its shard to make room.
+     *
+     * \param[in] url The decoded URL of the request.
+     *
+     * \param[in] response The response to be cached.
+     */
+    void put(const std::string_view url,
+             std::shared_ptr<const CachedResponse> response) {
+        if (response->body.size() > std::min(MaxEntrySize, shardBytes)) {
+            return;
+        }
+        Shard& shard = getShard(url);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.index.find(url);
+        if (it != shard.index.end()) {
+            shard.remove(it->second);
+        }
+        while (shard.bytes + response->body.size() > shardBytes) {
+            shard.remove(std::prev(shard.lru.end()));
+        }
+        shard.bytes += response->body.size();
+        shard.lru.push_front({std::string(url), std::move(response)});
+        shard.index.emplace(shard.lru.front().url, shard.lru.begin());
+    }
+
+    /**
+     * Print the hit and miss counters and the size of the cache.
+     *
+     * \param[out] os The output stream to print to.
+     */
+    void printStats(std::ostream& os) {
+        size_t entries = 0, bytes = 0;
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            entries += shard.lru.size();
+            bytes += shard.bytes;
+        }
+        os << "hits: " << hits << "\nmisses: " << misses << "\nentries: "
+           << entries << "\nbytes: " << bytes << '\n';
+    }
+
+private:
+    // One response in a shard's least recently used list
+    struct Entry {
+        std::string url;
+        std::shared_ptr<const CachedResponse> response;
+    };
+    using EntryList = std::list<Entry>;
+
+    // The responses whose URLs hash to the same shard
+    struct Shard {
+        /** Remove a response from the list and the index. */
+        void remove(const EntryList::iterator entry) {
+            bytes -= entry->response->body.size();
+            index.erase(entry->url);
+            lru.erase(entry);
+        }
+
+        std::mutex mutex;
+        // The responses, most recently used first
+        EntryList lru;
+        // The responses by URL.  The keys refer to the urls in lru.
+        std::unordered_map<std::string_view, EntryList::iterator> index;
+        // The total size of the bodies in this shard
+        size_t bytes = 0;
+    };
+
+    /** \return The shard that a URL belongs to. */
+    Shard& getShard(const std::string_view url) {
+        return shards[std::hash<std::string_view>()(url) % NumShards];
+    }
+
+    Shard shards[NumShards];
+    // The maximum size of the bodies in each shard
+    const size_t shardBytes;
+    // The number of lookups that did and did not find a response
+    std::atomic<size_t> hits{0}, misses{0};
+};
+
+// The responses shared by all of the connections (up to 64 MB)
+ResponseCache responseCache(64 << 20);
+
+// The commands whose output is cached, and for how long
+const std::unordered_set<std::string> CachedCommands = {
+    "cat", "df", "du", "head", "ls", "tail", "wc"};
+const auto CommandCacheTTL = std::chrono::seconds(5);
+
+// How long a command's output may wait to be sent as part of a larger
+// chunk (see sendChildOutput)
+std::chrono::milliseconds cgiFlushDelay(50);
+
+// Starts the commands run by cgi-bin/exec (with posix_spawn)
+ProcessLauncher launcher;
 
 /**
- * This method assumes the input stream is an HTTP GET request and
- * extracts the URL to be processed from the 1st line of the input stream.
+ * Helper method to find the body of a small file in the ResponseCache,
+ * reading the file into the cache if it is not there (or has changed).
  *
- * @param is The input stream with the HTTP GET request to be processed
- * 
- * @return This method returns the path specified in the GET
- * request.
+ * \param[in] url The decoded URL of the request.
+ *
+ * \param[in] file The file that is requested.
+ *
+ * \return The cached response, or nullptr if the file is not cached.
  */
-std::string extractURL(std::istream& is) {
-    std::string line, url;
+std::shared_ptr<const CachedResponse> getCachedFile(
+    const std::string_view url, const OpenFile& file) {
+    if (file.size > ResponseCache::MaxEntrySize) {
+        return nullptr;
+    }
+    auto cached = responseCache.get(url, file.etag);
+    if (cached == nullptr) {
+        auto response = std::make_shared<CachedResponse>();
+        response->body.resize(file.size);
+        if (pread(file.fd, response->body.data(), file.size, 0) !=
+            static_cast<ssize_t>(file.size)) {
+            return nullptr;  // The file is being changed
+        }
+        response->contentType = file.contentType;
+        response->etag = file.etag;
+        response->expires = std::chrono::steady_clock::time_point::max();
+        responseCache.put(url, response);
+        cached = std::move(response);
+    }
+    return cached;
+}
 
-    // Extract the GET request line from the input
-    std::getline(is, line);
+/**
+ * Helper method to parse the value of a Range header for a single
+ * range of bytes, e.g. "bytes=0-99", "bytes=100-" or "bytes=-100".
+ *
+ * \param[in] range The value of the Range header.
+ *
+ * \param[in] size The size of the file.
+ *
+ * \param[out] first The first byte in the range.
+ *
+ * \param[out] last The last byte in the range (inclusive).
+ *
+ * \return 1 if the range is valid, 0 if it is unsatisfiable, or -1 if
+ * the header is not a single byte range (in which case it is ignored).
+ */
+int parseRange(std::string_view range, const uint64_t size,
+               uint64_t& first, uint64_t& last) {
+    if (range.substr(0, 6) != "bytes=" ||
+        range.find(',') != std::string_view::npos) {
+        return -1;
+    }
+    range.remove_prefix(6);
+    const size_t dash = range.find('-');
+    if (dash == std::string_view::npos) {
+        return -1;
+    }
+    auto number = [](const std::string_view str, uint64_t& value) {
+        const auto res = std::from_chars(str.data(), str.data() + str.size(),
+                                         value);
+        return !str.empty() && res.ec == std::errc() &&
+            res.ptr == str.data() + str.size();
+    };
+    uint64_t start = 0, end = 0;
+    const bool hasStart = number(range.substr(0, dash), start),
+        hasEnd = number(range.substr(dash + 1), end);
+    if (hasStart && (hasEnd || dash + 1 == range.size())) {
+        if (start >= size) {
+            return 0;
+        }
+        first = start;
+        last = hasEnd ? std::min(end, size - 1) : size - 1;
+        return (last >= first) ? 1 : -1;
+    } else if (dash == 0 && hasEnd) {
+        if (end == 0 || size == 0) {
+            return 0;
+        }
+        first = size - std::min(end, size);
+        last = size - 1;
+        return 1;
+    }
+    return -1;
+}
 
-    // Read and skip HTTP headers. Without reading & skipping HTTP
-    // headers, your program will not work correctly with
-    // web-browsers.
-    for (std::string hdr; std::getline(is, hdr)
-        && !hdr.empty() && hdr != "\r";) {
+/**
+ * Helper method to send part of a file to a socket with sendfile, so
+ * the data is copied by the kernel without passing through user space.
+ *
+ * \param[in] socketFd The socket to send the data to.
+ *
+ * \param[in] file The file to be sent.
+ *
+ * \param[in] offset The offset of the first byte to be sent.
+ *
+ * \param[in] count The number of bytes to be sent.
+ *
+ * \return True if all of the data was sent.
+ */
+bool sendFile(const int socketFd, const OpenFile& file, uint64_t offset,
+              uint64_t count) {
+    while (count > 0) {
+        off_t pos = offset;
+        const ssize_t sent = sendfile(socketFd, file.fd, &pos, count);
+        if (sent > 0) {
+            offset += sent;
+            count -= sent;
+        } else if (sent == -1 && (errno == EAGAIN || errno == EINTR)) {
+            // The socket may be in non-blocking mode: wait until it
+            // can take more data
+            pollfd pfd = {socketFd, POLLOUT, 0};
+            if (errno == EAGAIN && ::poll(&pfd, 1, 30000) <= 0) {
+                return false;
+            }
+        } else {
+            return false;  // Error, or the file became shorter
+        }
     }
+    return true;
+}
 
-    // Do basic substring operation to extract the URL that is
-    // delimited by space from the first line of input.
-    line = line.substr(line.find('/'));
-    url = line.substr(0, line.find(' '));
-    return url;
+/**
+ * Helper method to send part of a file to an output stream (when the
+ * response does not go directly to a socket, e.g. when testing).
+ *
+ * \param[out] os The output stream to send the data to.
+ *
+ * \param[in] file The file to be sent.
+ *
+ * \param[in] offset The offset of the first byte to be sent.
+ *
+ * \param[in] count The number of bytes to be sent.
+ */
+void copyFile(std::ostream& os, const OpenFile& file, uint64_t offset,
+              uint64_t count) {
+    char buf[65536];
+    while (count > 0) {
+        const ssize_t got = pread(file.fd, buf, std::min<uint64_t>(
+            count, sizeof(buf)), offset);
+        if (got <= 0) {
+            break;
+        }
+        os.write(buf, got);
+        offset += got;
+        count -= got;
+    }
+}
+
+/**
+ * Send a file (or the range of it that was requested) as the response
+ * to a request.  The response has a Content-Length and an ETag, so a
+ * client can keep the connection open and revalidate its copy.  Small
+ * files are sent from the ResponseCache.
+ *
+ * @param request The request for the file.
+ *
+ * @param url The decoded URL of the request.
+ *
+ * @param path The path to the file.
+ *
+ * @param os The output stream to send the response headers to.
+ *
+ * @param socketFd The socket that os writes to (the body is sent
+ * directly to it with sendfile), or -1 to send the body through os.
+ *
+ * @return True if the connection can be used for further requests.
+ */
+bool serveFile(const HTTPRequest& request, const std::string_view url,
+               const std::string& path, std::ostream& os,
+               const int socketFd) {
+    const bool keepAlive = request.isKeepAlive();
+    const char* const connection = keepAlive ? "keep-alive" : "close";
+    const std::shared_ptr<const OpenFile> file = fileCache.get(path);
+    if (file == nullptr) {
+        const std::string msg = "The following file was not found: " +
+            path + "\n";
+        os << "HTTP/1.1 404 Not Found\r\nServer: SimpleServer\r\n"
+           << "Content-Type: text/plain\r\nContent-Length: " << msg.size()
+           << "\r\nConnection: " << connection << "\r\n\r\n" << msg;
+        os.flush();
+        return keepAlive;
+    }
+    const bool head = (request.getMethod() == "HEAD");
+    if (request.getHeader("If-None-Match") == file->etag) {
+        os << "HTTP/1.1 304 Not Modified\r\nServer: SimpleServer\r\n"
+           << "ETag: " << file->etag << "\r\nConnection: " << connection
+           << "\r\n\r\n";
+        os.flush();
+        return keepAlive;
+    }
+    uint64_t first = 0, last = file->size - 1;
+    const std::string_view ifRange = request.getHeader("If-Range");
+    const int range = (!ifRange.empty() && ifRange != file->etag) ? -1 :
+        parseRange(request.getHeader("Range"), file->size, first, last);
+    if (range == 0) {
+        os << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+           << "Server: SimpleServer\r\nContent-Range: bytes */"
+           << file->size << "\r\nContent-Length: 0\r\nConnection: "
+           << connection << "\r\n\r\n";
+        os.flush();
+        return keepAlive;
+    }
+    const uint64_t length = (file->size == 0) ? 0 : last - first + 1;
+    os << (range == 1 ? "HTTP/1.1 206 Partial Content" : "HTTP/1.1 200 OK")
+       << "\r\nServer: SimpleServer\r\nContent-Type: " << file->contentType
+       << "\r\nContent-Length: " << length << "\r\nETag: " << file->etag
+       << "\r\nAccept-Ranges: bytes\r\nConnection: " << connection;
+    if (range == 1) {
+        os << "\r\nContent-Range: bytes " << first << '-' << last << '/'
+           << file->size;
+    }
+    os << "\r\n\r\n";
+    os.flush();
+    if (head || length == 0) {
+        return keepAlive;
+    } else if (const auto cached = getCachedFile(url, *file)) {
+        os.write(cached->body.data() + first, length);
+        os.flush();
+        return keepAlive;
+    } else if (socketFd == -1) {
+        copyFile(os, *file, first, length);
+        os.flush();
+        return keepAlive;
+    }
+    return sendFile(socketFd, *file, first, length) && keepAlive;
+}
+
+/**
+ * Send the output of a child process as HTTP chunks of up to 64 KB,
+ * rather than one chunk per line.  The output is read straight from the
+ * pipe in large blocks.  A partly filled chunk is sent once its first
+ * byte has waited for cgiFlushDelay, so that the output of interactive
+ * commands still streams promptly.
+ *
+ * @param fd The read end of the pipe from the child process.
+ *
+ * @param os The output stream to send the chunks to.
+ *
+ * @param output If not nullptr, the output is also appended to this
+ * string (until it is longer than ResponseCache::MaxEntrySize).
+ */
+void sendChildOutput(const int fd, std::ostream& os, std::string* output) {
+    constexpr size_t ChunkSize = 64 * 1024;
+    std::vector<char> buf(ChunkSize);
+    size_t used = 0;
+    auto sendChunk = [&] {
+        if (used > 0) {
+            os << std::hex << used << std::dec << "\r\n";
+            os.write(buf.data(), used) << "\r\n";
+            os.flush();
+            if (output != nullptr &&
+                output->size() <= ResponseCache::MaxEntrySize) {
+                output->append(buf.data(), used);
+            }
+            used = 0;
+        }
+    };
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline;
+    while (true) {
+        // Wait for more output, but not beyond the pending chunk's deadline
+        const int timeout = (used == 0) ? -1 : std::max<int64_t>(0,
+            std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - Clock::now()).count());
+        pollfd pfd = {fd, POLLIN, 0};
+        const int ready = ::poll(&pfd, 1, timeout);
+        if (ready == 0) {
+            sendChunk();
+            continue;
+        }
+        const ssize_t got = (ready < 0) ? -1 :
+            ::read(fd, buf.data() + used, ChunkSize - used);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            break;  // The child closed its output
+        }
+        if (used == 0) {
+            deadline = Clock::now() + cgiFlushDelay;
+        }
+        used += got;
+        if (used == ChunkSize) {
+            sendChunk();
+        }
+    }
+    sendChunk();
+}
+
+/**
+ * Send a plain text response with a Content-Length (rather than as
+ * chunks, since the whole body is already known).
+ *
+ * @param request The request being responded to.
+ *
+ * @param text The body of the response.
+ *
+ * @param os The output stream to send the response to.
+ *
+ * @return True if the connection can be used for further requests.
+ */
+bool sendText(const HTTPRequest& request, const std::string& text,
+              std::ostream& os) {
+    const bool keepAlive = request.isKeepAlive();
+    os << "HTTP/1.1 200 OK\r\nServer: SimpleServer\r\n"
+       << "Content-Type: text/plain\r\nContent-Length: " << text.size()
+       << "\r\nConnection: " << (keepAlive ? "keep-alive" : "close")
+       << "\r\n\r\n";
+    if (request.getMethod() != "HEAD") {
+        os << text;
+    }
+    os.flush();
+    return keepAlive;
 }
 
 /**
@@ -54,54 +653,112 @@ std::string extractURL(std::istream& is) {
  * requests.
  *
  * \note For running commands this method uses ChildProcess class from
- * prior exercises/projects.
+ * prior exercises/projects to split the command, and a ProcessLauncher
+ * (see "/launch-stats") to start it.
+ *
+ * \note Files are served from a FileCache, with the body sent by
+ * sendfile when the output stream is a socket.  Small files and the
+ * output of read-only commands are kept in a ResponseCache, whose
+ * counters are reported at "/cache-stats".
  *
- * \note For file requests this method uses the HTTPFile convenience
- * class supplied as starter code.
- * 
  * @param is The input stream to read HTTP reqeust data from client
  * (or web-browser).
  *
  * @param os The output stream to send chunked HTTP response data back
  * to the client (or web-browser).
+ *
+ * @param socketFd The socket that os writes to, or -1 if os is not a
+ * socket (e.g. when testing).
+ *
+ * @return True if the connection can be used for further requests.
  */
-void serveClient(std::istream& is, std::ostream& os) {
+bool serveClient(std::istream& is, std::ostream& os,
+                 const int socketFd = -1) {
     // Process the GET request from the input stream.
-    std::string url = extractURL(is);
-    // Decode the url for further processing
-    url = url_decode(url);
-    // If the url is a file process using the helper methods in HTTPFile.cpp
+    HTTPRequest request;
+    if (!request.read(is)) {
+        return false;
+    }
+    // Decode the url (in place) for further processing
+    const std::string_view url = request.decodeURL();
+    // Report how well the ResponseCache is doing
+    if (url == "/cache-stats") {
+        std::ostringstream stats;
+        responseCache.printStats(stats);
+        return sendText(request, stats.str(), os);
+    }
+    // Report how long commands take to be launched
+    if (url == "/launch-stats") {
+        std::ostringstream stats;
+        launcher.printStats(stats);
+        return sendText(request, stats.str(), os);
+    }
+    // If the url is a file serve it from the cache of open files
     if (url.substr(0, 13) != "/cgi-bin/exec") {
-        const std::string path = url.substr(1);
-        os << http::file(path);
+        const std::string path(url.substr(std::min<size_t>(1, url.size())));
+        return serveFile(request, url, path, os, socketFd);
     } else {
-        // Create a new child process
+        // Split the command to be executed and any additional arguments
+        // into a vector of strings
         ChildProcess cp;
-        std::string cmd = url.substr(url.find('=') + 1);
-        // Create a vector of strings containing the command to be executed
-        // and any additional arguments
+        std::string cmd(url.substr(url.find('=') + 1));
         StrVec argList = cp.split(cmd);
-        // Execute the command within the child process
-        cp.forkNexecIO(argList);
-        // Access the data stream created by forkNexecIO
-        std::istream& childOutput = cp.getChildOutput();
+        // The output of read-only commands is reused for a few seconds
+        const bool cacheable = !argList.empty() &&
+            CachedCommands.count(argList[0]) > 0;
+        if (cacheable) {
+            if (const auto cached = responseCache.get(url)) {
+                return sendText(request, cached->body, os);
+            }
+        }
+        std::string output;
+        // Execute the command in a child process with a pipe from its
+        // standard output
+        ProcessLauncher::Process child = launcher.launch(argList, true);
         // Output the HTTP header chunk
         os << http::DefaultHttpHeaders << "text/plain" << "\r\n\r\n";
-        // Now stream the contents out.
-        for (std::string line; std::getline(childOutput, line);) {
-            // Note that std::getline() consumes/removes '\n'. So,
-            // below we add the '\n' back because that was actually
-            // present in the original data and it must be included.
-            line += '\n';
-            // Write the line of data as an HTTP-chunk
-            os << std::hex << line.size() << "\r\n" << line << "\r\n";
+        // Now stream the contents out in large chunks.
+        if (child.output != -1) {
+            sendChildOutput(child.output, os, cacheable ? &output : nullptr);
+            close(child.output);
         }
         // Finally send the trailing "0" chunk to finish the HTTP-response.
         os << "0\r\n\r\n";
-        cp.wait();
+        os.flush();
+        if (launcher.wait(child) == 0 && cacheable) {
+            auto response = std::make_shared<CachedResponse>();
+            response->contentType = "text/plain";
+            response->body = std::move(output);
+            response->expires = std::chrono::steady_clock::now() +
+                CommandCacheTTL;
+            responseCache.put(url, std::move(response));
+        }
+        // The default headers do not promise to keep the connection open
+        return false;
     }
 }
 
+/**
+ * Serve the requests that a client sends on 1 connection (in a thread
+ * of its own, so that a slow request does not hold up other clients).
+ * The connection is closed when the client asks for that or stays idle
+ * for 30 seconds.
+ *
+ * @param client The connection to the client.
+ */
+void serveConnection(tcp::iostream& client) {
+    // Flush explicitly after each response rather than after every <<
+    client.unsetf(std::ios_base::unitbuf);
+    const int socketFd = client.socket().native_handle();
+    // Only the wait for the next request is limited, not the responses
+    while (client.expires_after(std::chrono::seconds(30)),
+           client.peek() != std::char_traits<char>::eof()) {
+        client.expires_at(std::chrono::steady_clock::time_point::max());
+        if (!serveClient(client, client, socketFd) || !client.good()) {
+            break;
+        }
+    }
+}
 
 //------------------------------------------------------------------
 //  DO  NOT  MODIFY  CODE  BELOW  THIS  LINE
@@ -127,13 +784,15 @@ void runServer(int port) {
               << " & ready to process clients...\n";
     // Process client connections one-by-one...forever
     while (true) {
-        // Wait for a client to connect.
-        tcp::iostream client;
+        // Wait for a client to connect.  Added to the starter code:
+        // the connection is on the heap so that a thread can own it.
+        auto client = std::make_shared<tcp::iostream>();
         // The following method calls waits (could wait forever) until
         // a client connects.
-        server.accept(*client.rdbuf());
-        // Have helper method process the client connection.
-        serveClient(client, client);
+        server.accept(*client->rdbuf());
+        // Added to the starter code: have a thread of its own process
+        // the (persistent) client connection.
+        std::thread([client] { serveConnection(*client); }).detach();
     }
 }
 
@@ -173,15 +832,29 @@ std::string url_decode(std::string str) {
  * command-line arguments.
  *
  * \param[in] argc The number of command-line arguments.  This test
- * harness can work with zero or one command-line argument.
+ * harness can work with zero to three command-line arguments.
  *
  * \param[in] argv The actual command-line arguments.  If this is an
  * number it is assumed to be a port number.  Otherwise it is assumed
- * to be an file name that contains inputs for testing.
+ * to be an file name that contains inputs for testing.  The optional
+ * second argument is the flush deadline for command output in
+ * milliseconds (default 50), and the optional third one is the number
+ * of helper processes that launch commands (default 0).
  */
 int main(int argc, char *argv[]) {
     // Check and use first command-line argument if any as port or file
     std::string arg = (argc > 1 ? argv[1] : "0");
+    // Added to the starter code: the optional flush deadline for
+    // command output
+    if (argc > 2) {
+        cgiFlushDelay = std::chrono::milliseconds(std::stoi(argv[2]));
+    }
+    // Added to the starter code: the optional number of helpers that
+    // launch commands.  Start the helpers while this process is still
+    // small.
+    if (argc > 3) {
+        launcher.startHelpers(std::stoi(argv[3]));
+    }
     
     // Check and use a given input data file for testing.
     if (arg.find_first_not_of("1234567890") == std::string::npos) {
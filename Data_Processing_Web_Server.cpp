@@ -2,7 +2,11 @@
  * Copyright 2021 Michael Glum
  * 
  * A custom web-server that performs some simple data processing with
- * values from web-browser.
+ * values from web-browser.  The integers in a data file are analyzed
+ * in a single streaming pass (see StreamStats).  When run with
+ * --serve, it is a concurrent server that can merge the results of
+ * several data files fetched in parallel (see serveSources).  Data
+ * files are then fetched with HTTPFetcher, so link with -lz.
  *
  */
 
@@ -15,6 +19,22 @@
 #include <boost/asio.hpp>
 #include <boost/format.hpp>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+#include "HTTPRequest.h"
+// Also provides breakDownURL
+#include "HTTPFetcher.h"
 
 /** A convenience format string to generate results in HTML
     format. Note that this format string has place holders in the form
@@ -76,64 +96,527 @@ const std::string HTTPRespHeader =
  * request.
  */
 std::string extractURL(std::istream& is) {
-    std::string line, url;
-
-    // Extract the GET request line from the input
-    std::getline(is, line);
-    
-    // Read and skip HTTP headers. Without reading & skipping HTTP
-    // headers, your program will not work correctly with
-    // web-browsers.
-    for (std::string hdr; std::getline(is, hdr)
-        && !hdr.empty() && hdr != "\r";) {
-    }
-
-    // Do basic substring operation to extract the URL that is
-    // delimited by space from the first line of input.
-    line = line.substr(line.find('/') + 1);
-    url = line.substr(0, line.find(' '));
-    return url;
+    // Read the GET request line and the HTTP headers (which are not
+    // used here) using the shared, allocation-free request parser.
+    HTTPRequest request;
+    request.read(is);
+    // The URL to be processed follows the leading '/' in the request
+    const std::string_view url = request.getURL();
+    return std::string(url.substr(std::min<size_t>(1, url.size())));
 }
 
 /**
- * Helper method to break down a URL into hostname, port and path. For
- * example, given the url: "https://localhost:8080/~raodm/one.txt"
- * this method returns <"localhost", "8080", "/~raodm/one.txt">
+ * The statistics that can be requested with query parameters on the
+ * URL of the data file, e.g. "http://host/nums.txt?stats=top,quantiles&k=5".
+ * The parameters are:
+ *
+ *   - stats: A comma separated list of "top" (the k largest distinct
+ *     values), "min", "max", "count", "sum", "mean", "variance",
+ *     "quantiles", or "all".
  *
- * Similarly, given the url: "ftp://ftp.files.miamioh.edu/index.html"
- * this method returns <"ftp.files.miamioh.edu", "80", "/index.html">
+ *   - k: The number of largest values reported by "top" (default 2).
  *
- * @param url A string containing a valid URL. The port number in URL
- * is always optional.  The default port number is assumed to be 80.
+ *   - q: The quantiles reported by "quantiles", e.g. "0.5,0.99"
+ *     (default 0.5,0.9,0.99).
  *
- * @return This method returns a std::tuple with 3 strings. The 3
- * strings are in the order: hostname, port, and path.  Here we use
- * std::tuple because a method can return only 1 value.  The
- * std::tuple is a convenient class to encapsulate multiple return
- * values into a single return value.
+ * Without a stats parameter the maximum and 2nd maximum values are
+ * reported (in the HTMLData format).
  */
-std::tuple<std::string, std::string, std::string>
-breakDownURL(const std::string& url) {
-    // The values to be returned.
-    std::string hostName, port = "80", path = "/";
-    
-    // Extract the substrings from the given url into the above
-    // variables.
-    std::size_t start = url.find("//") + 2;
-    std::size_t end;
-    hostName = url.substr(start);
-    if (hostName.find(':') != std::string::npos) {
-        end = hostName.find(':');
-        port = hostName.substr(end+1);
-        port = port.substr(0, port.find('/'));
-    } else {
-        end = hostName.find('/');
-    }
-    path = hostName.substr(hostName.find('/'));
-    hostName = hostName.substr(0, end);
-    
-    // Return 3-values encapsulated into 1-tuple.
-    return {hostName, port, path};
+struct StatsOptions {
+    bool top = false, min = false, max = false, count = false, sum = false,
+        mean = false, variance = false, quantiles = false;
+    size_t k = 2;
+    std::vector<double> q = {0.5, 0.9, 0.99};
+
+    /** \return True if any statistic was requested. */
+    bool any() const {
+        return top || min || max || count || sum || mean || variance ||
+            quantiles;
+    }
+};
+
+/**
+ * Helper method to remove the statistics parameters (see StatsOptions)
+ * from the query string of a URL.  Other parameters are left in the URL
+ * as they are meant for the web-server that has the data file.
+ *
+ * @param url The URL of the data file.  The statistics parameters are
+ * removed from it.
+ *
+ * @return The statistics that were requested.
+ */
+StatsOptions parseStatsOptions(std::string& url) {
+    StatsOptions options;
+    const size_t query = url.find('?');
+    if (query == std::string::npos) {
+        return options;
+    }
+    std::string rest;
+    std::istringstream params(url.substr(query + 1));
+    for (std::string param; std::getline(params, param, '&');) {
+        const size_t eq = param.find('=');
+        const std::string name = param.substr(0, eq),
+            value = (eq == std::string::npos) ? "" : param.substr(eq + 1);
+        std::istringstream values(value);
+        if (name == "stats") {
+            for (std::string stat; std::getline(values, stat, ',');) {
+                const bool all = (stat == "all");
+                options.top |= all || stat == "top";
+                options.min |= all || stat == "min";
+                options.max |= all || stat == "max";
+                options.count |= all || stat == "count";
+                options.sum |= all || stat == "sum";
+                options.mean |= all || stat == "mean";
+                options.variance |= all || stat == "variance";
+                options.quantiles |= all || stat == "quantiles";
+            }
+        } else if (name == "k") {
+            options.k = std::max(1, std::atoi(value.c_str()));
+        } else if (name == "q") {
+            options.q.clear();
+            for (std::string q; std::getline(values, q, ',');) {
+                options.q.push_back(std::clamp(std::atof(q.c_str()), 0.0,
+                                               1.0));
+            }
+        } else {
+            rest += (rest.empty() ? "?" : "&") + param;
+        }
+    }
+    url = url.substr(0, query) + rest;
+    return options;
+}
+
+/**
+ * An approximate quantile sketch (the KLL sketch of Karnin, Lang, and
+ * Liberty).  Values are kept in a hierarchy of compactors: when a
+ * level fills up it is sorted and every other value (starting at a
+ * random offset) is promoted to the next level, where each value
+ * stands for twice as many.  The sketch uses O(k) memory however many
+ * values are added, with a rank error of about 1.7/k.
+ */
+class QuantileSketch {
+public:
+    /**
+     * Create an empty sketch.
+     *
+     * \param[in] k The accuracy of the sketch (the capacity of the top
+     * level).
+     */
+    explicit QuantileSketch(const size_t k = 200) : k(k) { grow(); }
+
+    /** Add a value to the sketch. */
+    void add(const int64_t value) {
+        compactors[0].push_back(value);
+        if (++size >= maxSize) {
+            compress();
+        }
+    }
+
+    /**
+     * Merge another sketch (of other values) into this one.
+     *
+     * \param[in] other The sketch to be merged in.
+     */
+    void merge(const QuantileSketch& other) {
+        while (compactors.size() < other.compactors.size()) {
+            grow();
+        }
+        for (size_t h = 0; h < other.compactors.size(); h++) {
+            compactors[h].insert(compactors[h].end(),
+                                 other.compactors[h].begin(),
+                                 other.compactors[h].end());
+            size += other.compactors[h].size();
+        }
+        while (size >= maxSize) {
+            compress();
+        }
+    }
+
+    /**
+     * Estimate a quantile.
+     *
+     * \param[in] q The quantile, e.g. 0.5 for the median.
+     *
+     * \return The smallest value whose estimated rank is at least q
+     * times the number of values, or 0 if the sketch is empty.
+     */
+    int64_t quantile(const double q) const {
+        std::vector<std::pair<int64_t, uint64_t>> weighted;
+        uint64_t total = 0;
+        for (size_t h = 0; h < compactors.size(); h++) {
+            for (const int64_t value : compactors[h]) {
+                weighted.emplace_back(value, uint64_t(1) << h);
+                total += uint64_t(1) << h;
+            }
+        }
+        std::sort(weighted.begin(), weighted.end());
+        uint64_t rank = 0;
+        for (const auto& [value, weight] : weighted) {
+            if ((rank += weight) >= q * total) {
+                return value;
+            }
+        }
+        return weighted.empty() ? 0 : weighted.back().first;
+    }
+
+private:
+    /** \return The number of values that level h may hold. */
+    size_t capacity(const size_t h) const {
+        const double depth = compactors.size() - h - 1;
+        return static_cast<size_t>(std::ceil(std::pow(2.0 / 3, depth) * k))
+            + 1;
+    }
+
+    /** Add a level to the top of the hierarchy. */
+    void grow() {
+        compactors.emplace_back();
+        maxSize = 0;
+        for (size_t h = 0; h < compactors.size(); h++) {
+            maxSize += capacity(h);
+        }
+    }
+
+    /** Compact the lowest level that is full into the level above. */
+    void compress() {
+        for (size_t h = 0; h < compactors.size(); h++) {
+            std::vector<int64_t>& level = compactors[h];
+            if (level.size() >= capacity(h)) {
+                if (h + 1 == compactors.size()) {
+                    grow();  // Note: invalidates level
+                }
+                std::vector<int64_t>& from = compactors[h];
+                std::sort(from.begin(), from.end());
+                // An odd value out stays at this level
+                const bool odd = from.size() % 2;
+                const int64_t last = from.back();
+                const size_t end = from.size() - odd;
+                for (size_t i = random() & 1; i < end; i += 2) {
+                    compactors[h + 1].push_back(from[i]);
+                }
+                from.clear();
+                if (odd) {
+                    from.push_back(last);
+                }
+                break;
+            }
+        }
+        size = 0;
+        for (const auto& level : compactors) {
+            size += level.size();
+        }
+    }
+
+    // The accuracy parameter
+    const size_t k;
+    // The values at each level; a value at level h stands for 2^h values
+    std::vector<std::vector<int64_t>> compactors;
+    // The number of values kept, and the most kept before compacting
+    size_t size = 0, maxSize = 0;
+    // Chooses which half of a level is promoted
+    std::minstd_rand random;
+};
+
+/**
+ * Statistics of a stream of integers, updated one value at a time in
+ * constant time (apart from the top values and the quantile sketch).
+ */
+class StreamStats {
+public:
+    /**
+     * Create empty statistics.
+     *
+     * \param[in] options The statistics to be tracked.
+     */
+    explicit StreamStats(const StatsOptions& options) : options(options) {}
+
+    /** Add a value to the statistics. */
+    void add(const int64_t val) {
+        addMax(val, count);
+        min = (count == 0) ? val : std::min(min, val);
+        count++;
+        sum += val;
+        // Welford's method for a numerically stable running variance
+        const double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+        if (options.top && (top.size() < options.k || val > *top.begin())) {
+            if (top.insert(val).second && top.size() > options.k) {
+                top.erase(top.begin());
+            }
+        }
+        if (options.quantiles) {
+            sketch.add(val);
+        }
+    }
+
+    /**
+     * Merge the statistics of other values into these ones.
+     *
+     * \param[in] other The statistics to be merged in (tracking the
+     * same statistics as these ones).
+     */
+    void merge(const StreamStats& other) {
+        if (other.count == 0) {
+            return;
+        }
+        addMax(other.max, count);
+        if (other.count > 1) {
+            addMax(other.max2nd, count + 1);
+        }
+        min = (count == 0) ? other.min : std::min(min, other.min);
+        // Chan et al.'s method of combining means and variances
+        const double delta = other.mean - mean;
+        const int64_t total = count + other.count;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        count = total;
+        sum += other.sum;
+        for (const int64_t val : other.top) {
+            if (top.insert(val).second && top.size() > options.k) {
+                top.erase(top.begin());
+            }
+        }
+        sketch.merge(other.sketch);
+    }
+
+    /**
+     * \param[in] notes Additional paragraphs to be included, e.g. about
+     * data that could not be processed.  They are plain text (which may
+     * come from the client), so they are escaped here.
+     *
+     * \return The results in HTML format.
+     */
+    std::string toHtml(const std::vector<std::string>& notes = {}) const {
+        std::ostringstream html;
+        if (!options.any()) {
+            html << boost::format(HTMLData) % max % max2nd;
+        } else {
+            html << "<html>\n  <body>\n    <h2>Analysis results</h2>\n";
+            printStats(html);
+            html << "  </body>\n</html>\n";
+        }
+        std::string result = html.str();
+        std::string paragraphs;
+        for (const auto& note : notes) {
+            paragraphs += "    <p>" + escapeHtml(note) + "</p>\n";
+        }
+        return result.insert(result.rfind("  </body>"), paragraphs);
+    }
+
+private:
+    /** \return A copy of text with HTML's special characters escaped. */
+    static std::string escapeHtml(const std::string& text) {
+        std::string escaped;
+        for (const char c : text) {
+            switch (c) {
+            case '&': escaped += "&amp;";  break;
+            case '<': escaped += "&lt;";   break;
+            case '>': escaped += "&gt;";   break;
+            case '"': escaped += "&quot;"; break;
+            default:  escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    /**
+     * Update the maximum and 2nd maximum values in the way they were
+     * originally computed by process.
+     *
+     * \param[in] val The next value.
+     *
+     * \param[in] seen The number of values before this one.
+     */
+    void addMax(const int64_t val, const int64_t seen) {
+        if (seen == 0) {
+            max = val;
+        } else if (seen == 1) {
+            max2nd = val;
+            if (max < max2nd) {
+                std::swap(max, max2nd);
+            }
+        } else if (val > max) {
+            max2nd = max;
+            max = val;
+        } else if (val > max2nd && val != max) {
+            max2nd = val;
+        }
+    }
+
+    /**
+     * Print the requested statistics as HTML paragraphs.
+     *
+     * \param[out] html The stream to print to.
+     */
+    void printStats(std::ostream& html) const {
+        if (options.count) {
+            html << "    <p>Number of integer values: " << count << "</p>\n";
+        }
+        if (options.min) {
+            html << "    <p>Minimum integer value: " << min << "</p>\n";
+        }
+        if (options.max) {
+            html << "    <p>Maximum integer value: " << max << "</p>\n";
+        }
+        if (options.top) {
+            html << "    <p>The " << options.k << " largest integer values:";
+            for (auto it = top.rbegin(); it != top.rend(); it++) {
+                html << (it == top.rbegin() ? " " : ", ") << *it;
+            }
+            html << "</p>\n";
+        }
+        if (options.sum) {
+            html << "    <p>Sum: " << sum << "</p>\n";
+        }
+        if (options.mean) {
+            html << "    <p>Mean: " << mean << "</p>\n";
+        }
+        if (options.variance) {
+            html << "    <p>Variance: " << (count == 0 ? 0 : m2 / count)
+                 << "</p>\n";
+        }
+        if (options.quantiles) {
+            for (const double q : options.q) {
+                html << "    <p>Approximate " << q << " quantile: "
+                     << sketch.quantile(q) << "</p>\n";
+            }
+        }
+    }
+
+    const StatsOptions options;
+    int64_t count = 0, min = 0, max = 0, max2nd = 0, sum = 0;
+    double mean = 0, m2 = 0;
+    // The largest distinct values (up to options.k of them)
+    std::set<int64_t> top;
+    QuantileSketch sketch;
+};
+
+/**
+ * Parses whitespace separated integers from blocks of data, as they
+ * are received, in place with std::from_chars (rather than extracting
+ * them one value at a time from an iostream).  A token that is split
+ * between blocks is carried over to the next block.  As with
+ * operator>>, parsing stops at the first token that does not start
+ * with an int.
+ */
+class IntegerParser {
+public:
+    /**
+     * Create a parser.
+     *
+     * \param[out] stats The statistics the values are added to.
+     */
+    explicit IntegerParser(StreamStats& stats) : stats(stats) {}
+
+    /**
+     * Parse the next block of data.
+     *
+     * \param[in] data The data.
+     *
+     * \param[in] len The number of bytes of data.
+     */
+    void feed(const char* data, const size_t len) {
+        if (stopped) {
+            return;  // The rest of the data is ignored
+        }
+        const char* const end = data + len;
+        // The last token may continue in the next block
+        const char* limit = end;
+        while (limit > data && !isSpace(limit[-1])) {
+            limit--;
+        }
+        if (!carry.empty() || limit == data) {
+            // Complete the carried over token first
+            const char* tokenEnd = std::find_if(data, end, isSpace);
+            carry.append(data, tokenEnd);
+            if (tokenEnd == end) {
+                // An overlong token cannot be an int
+                if (carry.size() > MaxToken) {
+                    stopped = true;
+                    carry.clear();
+                }
+                return;
+            }
+            parse(carry.data(), carry.data() + carry.size());
+            carry.clear();
+            data = tokenEnd;
+        }
+        parse(data, limit);
+        carry.assign(limit, end);
+    }
+
+    /** Parse the last token, once all of the data has been fed. */
+    void finish() {
+        parse(carry.data(), carry.data() + carry.size());
+        carry.clear();
+    }
+
+private:
+    /** \return True if c is a whitespace character. */
+    static bool isSpace(const char c) {
+        return std::isspace(static_cast<unsigned char>(c));
+    }
+
+    /**
+     * Parse the integers in a range of complete tokens (unless parsing
+     * has already stopped).
+     *
+     * \param[in] pos The start of the range.
+     *
+     * \param[in] limit The end of the range.
+     */
+    void parse(const char* pos, const char* const limit) {
+        while (!stopped) {
+            while (pos < limit && isSpace(*pos)) {
+                pos++;
+            }
+            if (pos == limit) {
+                return;
+            }
+            // from_chars does not accept a leading '+' (as >> does)
+            const char* digits = (*pos == '+' && pos + 1 < limit &&
+                                  std::isdigit(static_cast<unsigned char>(
+                                      pos[1]))) ? pos + 1 : pos;
+            int val;
+            const auto res = std::from_chars(digits, limit, val);
+            if (res.ec != std::errc()) {
+                stopped = true;
+                return;
+            }
+            stats.add(val);
+            pos = res.ptr;
+            // The next token would fail to be read
+            stopped = (pos < limit && !isSpace(*pos));
+        }
+    }
+
+    // The longest token that is kept while waiting for its end
+    static constexpr size_t MaxToken = 64;
+    StreamStats& stats;
+    // A token that started at the end of the previous block
+    std::string carry;
+    // Set once a token that is not an int has been found
+    bool stopped = false;
+};
+
+/**
+ * Helper method to parse whitespace separated integers from a stream
+ * buffer, read in large blocks, with an IntegerParser.
+ *
+ * \param[in] sb The stream buffer to read from.
+ *
+ * \param[out] stats The statistics the values are added to.
+ */
+void parseIntegers(std::streambuf& sb, StreamStats& stats) {
+    constexpr std::streamsize BlockSize = 1 << 16;
+    std::vector<char> buf(BlockSize);
+    IntegerParser parser(stats);
+    // A short read means the stream has ended
+    for (std::streamsize got = BlockSize; got == BlockSize;) {
+        got = sb.sgetn(buf.data(), BlockSize);
+        parser.feed(buf.data(), std::max<std::streamsize>(got, 0));
+    }
+    parser.finish();
 }
 
 /**
@@ -141,15 +624,16 @@ breakDownURL(const std::string& url) {
  * results (as HTTP response) the web-browser.
  *
  * \param[in] is The input stream from where the HTTP response is to
- * be read and the number of words are to be counted. This method
- * should also compute the total number of characters in the words. In
- * addition, it should also compute average number of characters per
- * word.
+ * be read and the integers in it are to be analyzed.
  *
  * \param[out] os The output stream to where HTTP response along with
  * HTML data is to be sent back to the client.
+ *
+ * \param[in] options The statistics to be reported (by default the
+ * maximum and 2nd maximum values).
  */
-void process(std::istream& is, std::ostream& os) {
+void process(std::istream& is, std::ostream& os,
+             const StatsOptions& options = StatsOptions()) {
     using namespace std;
     
     // Get the first HTTP response line and ensure it has 200 OK in it
@@ -163,33 +647,246 @@ void process(std::istream& is, std::ostream& os) {
     }
     for (string hdr; getline(is, hdr) && !hdr.empty() && hdr != "\r";) {
     }
-    
-    // Track the 1st and 2nd largest numbers so that it can be reported back
-    // to the client (as required in this project).
-    int max, max2nd, val;
-    is >> max >> max2nd;   // Read first 2 values.
-    // Ensure they are in the correct order
-    if (max < max2nd) {
-        swap(max, max2nd);
-    }
-
-    // Now process rest of the numbers while tracking the maximum and
-    // 2nd maximum values (as required for this project).
-    while (is >> val) {
-        if (val > max) {
-            max2nd = max;
-            max = val;
-        } else if (val > max2nd && val != max) {
-            max2nd = val;
-        }
-    }
+
+    // Compute the statistics in a single pass over the data, parsing
+    // the integers straight from the stream's buffer.
+    StreamStats stats(options);
+    parseIntegers(*is.rdbuf(), stats);
 
     // Generate results in correct format and be sent it back to the
     // client in HTML format.
-    string data = boost::str(boost::format(HTMLData) % max % max2nd);
+    string data = stats.toHtml();
     os << boost::str(boost::format(HTTPRespHeader) % data.length()) << data;
 }
 
+/**
+ * The fetchers that download data files in the concurrent server mode.
+ * Each fetcher keeps its own pool of keep-alive connections and parses
+ * the data it receives on its own strand, so the data files of a
+ * request are spread over the fetchers to be parsed in parallel.
+ */
+class FetcherPool {
+public:
+    /**
+     * Create the fetchers and the threads that run them.
+     *
+     * \param[in] count The number of fetchers (and threads).
+     */
+    explicit FetcherPool(const size_t count) :
+        work(boost::asio::make_work_guard(io)) {
+        for (size_t i = 0; i < count; i++) {
+            fetchers.push_back(std::make_unique<HTTPFetcher>(io));
+        }
+        for (size_t i = 0; i < count; i++) {
+            threads.emplace_back([this] { io.run(); });
+        }
+    }
+
+    ~FetcherPool() {
+        work.reset();
+        io.stop();
+        for (auto& thr : threads) {
+            thr.join();
+        }
+    }
+
+    /** \return The fetcher to be used for the next data file. */
+    HTTPFetcher& next() {
+        return *fetchers[nextFetcher++ % fetchers.size()];
+    }
+
+private:
+    boost::asio::io_context io;
+    // Keeps the threads running while there is no work
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+    work;
+    std::vector<std::unique_ptr<HTTPFetcher>> fetchers;
+    std::vector<std::thread> threads;
+    // Used to pick fetchers round-robin
+    std::atomic<size_t> nextFetcher{0};
+};
+
+/**
+ * Helper method to split a list of comma separated URLs, e.g.
+ * "http://host/a.txt,http://host:8080/b.txt".  A comma only separates
+ * URLs when it is followed by "http://".
+ *
+ * \param[in] urls The list of URLs.
+ *
+ * \return The URLs in the list.
+ */
+std::vector<std::string> splitSources(const std::string& urls) {
+    std::vector<std::string> sources;
+    size_t start = 0;
+    for (size_t comma; (comma = urls.find(",http://", start)) !=
+             std::string::npos; start = comma + 1) {
+        sources.push_back(urls.substr(start, comma - start));
+    }
+    sources.push_back(urls.substr(start));
+    return sources;
+}
+
+/**
+ * Fetch several data files in parallel, compute the statistics of each
+ * one (in the same way as process does) as its data is received, and
+ * merge them.  A data file that has not been received within the
+ * timeout is left out, so that 1 slow web-server does not hold up the
+ * results of the others.
+ *
+ * \param[in] urls The URLs of the data files.
+ *
+ * \param[in] options The statistics to be reported.
+ *
+ * \param[in] fetchers The fetchers used to download the data files.
+ *
+ * \param[in] timeout The longest time to wait for the data files.
+ *
+ * \return The merged results in HTML format, along with a note for
+ * each data file that was left out.
+ */
+std::string analyzeSources(const std::vector<std::string>& urls,
+                           const StatsOptions& options,
+                           FetcherPool& fetchers,
+                           const std::chrono::milliseconds timeout) {
+    // The results of 1 data file.  They are shared with the fetcher's
+    // handlers, which may still run after a data file has timed out.
+    struct Source {
+        explicit Source(const StatsOptions& options) :
+            stats(options), parser(stats) {}
+        std::mutex mutex;
+        StreamStats stats;
+        IntegerParser parser;
+        // Set once the data file has been received or left out
+        bool done = false;
+        std::string error;
+    };
+    // The number of data files still being received
+    struct Progress {
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t pending;
+    };
+    auto progress = std::make_shared<Progress>();
+    progress->pending = urls.size();
+    std::vector<std::shared_ptr<Source>> sources;
+    for (const auto& url : urls) {
+        auto src = std::make_shared<Source>(options);
+        sources.push_back(src);
+        HTTPFetcher::Request request;
+        request.url = url;
+        // Also frees the (pooled) connection of a slow web-server
+        request.timeout = timeout;
+        request.onData = [src](const char* data, const size_t len) {
+            std::lock_guard<std::mutex> lock(src->mutex);
+            if (!src->done) {
+                src->parser.feed(data, len);
+            }
+        };
+        request.onDone = [src, progress](const boost::system::error_code& ec,
+                                         const HTTPFetcher::Response& resp) {
+            {
+                std::lock_guard<std::mutex> lock(src->mutex);
+                if (src->done) {
+                    return;  // Already left out
+                }
+                src->done = true;
+                if (ec) {
+                    src->error = ec.message();
+                } else if (resp.status != 200) {
+                    src->error = "HTTP status " + std::to_string(resp.status);
+                } else {
+                    src->parser.finish();
+                }
+            }
+            std::lock_guard<std::mutex> lock(progress->mutex);
+            if (--progress->pending == 0) {
+                progress->finished.notify_all();
+            }
+        };
+        fetchers.next().fetch(std::move(request));
+    }
+    {
+        std::unique_lock<std::mutex> lock(progress->mutex);
+        progress->finished.wait_for(lock, timeout, [&progress] {
+            return progress->pending == 0; });
+    }
+    // Merge the results of the data files that were received
+    StreamStats stats(options);
+    std::vector<std::string> notes;
+    for (size_t i = 0; i < urls.size(); i++) {
+        Source& src = *sources[i];
+        std::lock_guard<std::mutex> lock(src.mutex);
+        if (!src.done) {
+            src.done = true;
+            src.error = "timed out";
+        }
+        if (src.error.empty()) {
+            stats.merge(src.stats);
+        } else {
+            notes.push_back("Left out " + urls[i] + ": " + src.error);
+        }
+    }
+    return stats.toHtml(notes);
+}
+
+/**
+ * Serve 1 client in the concurrent server mode.  The GET request may
+ * name several data files separated by commas, e.g.
+ * "GET /http://host1/a.txt,http://host2/b.txt?stats=all HTTP/1.1".
+ * The statistics parameters (see StatsOptions) are given on the last
+ * URL and apply to the merged results of all of the data files.
+ *
+ * \param[in] client The connection to the client.
+ *
+ * \param[in] fetchers The fetchers used to download the data files.
+ *
+ * \param[in] timeout The longest time to wait for the request and for
+ * the data files.
+ */
+void serveSources(std::unique_ptr<boost::asio::ip::tcp::iostream> client,
+                  FetcherPool& fetchers,
+                  const std::chrono::milliseconds timeout) {
+    client->expires_after(timeout);
+    const std::string url = extractURL(*client);
+    if (!client->good() || url.empty()) {
+        return;
+    }
+    auto sources = splitSources(url);
+    const StatsOptions options = parseStatsOptions(sources.back());
+    const std::string data = analyzeSources(sources, options, fetchers,
+                                            timeout);
+    client->expires_after(timeout);
+    *client << boost::str(boost::format(HTTPRespHeader) % data.length())
+            << data << std::flush;
+}
+
+/**
+ * Run the concurrent server mode: accept clients forever, serving each
+ * one on a thread of its own.
+ *
+ * \param[in] port The port to listen on (0 for any).
+ *
+ * \param[in] timeout The longest time to wait for a request and for
+ * the data files it names.
+ */
+void runServer(const unsigned short port,
+               const std::chrono::milliseconds timeout) {
+    using namespace boost::asio;
+    using namespace boost::asio::ip;
+    FetcherPool fetchers(std::max(1u, std::thread::hardware_concurrency()));
+    io_service service;
+    tcp::acceptor server(service, tcp::endpoint(tcp::v4(), port));
+    server.listen();
+    std::cout << "Server is listening on port "
+              << server.local_endpoint().port() << std::endl;
+    while (true) {
+        auto client = std::make_unique<tcp::iostream>();
+        server.accept(*client->rdbuf());
+        std::thread(serveSources, std::move(client), std::ref(fetchers),
+                    timeout).detach();
+    }
+}
+
 //-------------------------------------------------------------------------
 //  STUDY THE CODE BELOW.
 //  BUT DO  NOT  MODIFY  CODE  BELOW  THIS  LINE.
@@ -213,6 +910,9 @@ void serveClient(const int step, std::istream& is = std::cin,
     // Have helper method extract the URL for downloading data from
     // the input HTTP GET request.
     auto url = extractURL(is);
+    // Added to the starter code: remove the parameters that choose
+    // the statistics to be reported (they are passed to process)
+    const StatsOptions options = parseStatsOptions(url);
     std::cout << "URL to be processed is: " << url << std::endl;
 
     if (step > 1) {
@@ -232,7 +932,7 @@ void serveClient(const int step, std::istream& is = std::cin,
                  << "Connection: Close\r\n\r\n";
             // Have the helper method process the file's data and print/send
             // results (in HTTP/HTML format) to a given output stream.
-            process(data, os);
+            process(data, os, options);
         }
     }
 }
@@ -247,6 +947,14 @@ void serveClient(const int step, std::istream& is = std::cin,
  * \param[in] argv The actual command-line arguments.
  */
 int main(int argc, char *argv[]) {
+    // Added to the starter code: run as a concurrent server with
+    // "--serve [port] [timeout ms]" (see runServer).
+    if (argc > 1 && std::string(argv[1]) == "--serve") {
+        const int port = (argc > 2 ? std::stoi(argv[2]) : 34747);
+        const int timeout = (argc > 3 ? std::stoi(argv[3]) : 5000);
+        runServer(port, std::chrono::milliseconds(timeout));
+        return 0;
+    }
     // Check and use a given input data file for testing.
     if (argc > 1) {
         // In this situation, this program processes inputs from a
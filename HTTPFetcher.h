@@ -0,0 +1,778 @@
+/**
+ * Copyright 2021 Michael Glum
+ *
+ * An asynchronous HTTP/1.1 client shared by the programs in this
+ * repository that download their input data (CountWords and
+ * Login_Sentry).  The body of each response is handed to a callback
+ * in blocks, as it is received, instead of being read through an
+ * iostream.  The fetcher
+ *
+ *   - reuses (keep-alive) connections to the same host, with a limit
+ *     on the number of connections opened to each host,
+ *   - decodes "Transfer-Encoding: chunked" bodies,
+ *   - asks for gzip/deflate compressed bodies and inflates them
+ *     (using zlib, so programs using this header link with -lz), and
+ *   - can split a large download into several HTTP Range requests
+ *     that run in parallel (see fetchParts), and
+ *   - can give up on a request that takes too long (Request::timeout).
+ *
+ * All of the work is done by the io_context passed to the fetcher.
+ * The callbacks are called from a thread running that io_context, on
+ * the fetcher's strand (so they never run concurrently with each
+ * other).
+ */
+
+#ifndef HTTP_FETCHER_H
+#define HTTP_FETCHER_H
+
+#include <boost/asio.hpp>
+#include <zlib.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Helper method to break down a URL into hostname, port and path.
+ *
+ * @param url A string containing a valid URL. The port number in URL
+ * is always optional.  The default port number is assumed to be 80.
+ *
+ * @return This method returns a std::tuple with 3 strings. The 3
+ * strings are in the order: hostname, port, and path.
+ */
+inline std::tuple<std::string, std::string, std::string>
+breakDownURL(const std::string& url) {
+    // The values to be returned.
+    std::string hostName, port = "80", path = "/";
+
+    // Extract the substrings from the given url into the above
+    // variables.
+    std::size_t start = url.find("//") + 2;
+    std::size_t end;
+    hostName = url.substr(start);
+    if (hostName.find(':') != std::string::npos) {
+        end = hostName.find(':');
+        port = hostName.substr(end + 1);
+        port = port.substr(0, port.find('/'));
+    } else {
+        end = hostName.find('/');
+    }
+    if (hostName.find('/') != std::string::npos) {
+        path = hostName.substr(hostName.find('/'));
+    }
+    hostName = hostName.substr(0, end);
+
+    // Return 3-values encapsulated into 1-tuple.
+    return { hostName, port, path };
+}
+
+/**
+ * An asynchronous HTTP client with a pool of keep-alive connections
+ * per host.  Objects of this class must outlive the requests started
+ * with them (e.g. by running the io_context until it runs out of work
+ * before the fetcher is destroyed).
+ */
+class HTTPFetcher {
+public:
+    /** Value for Request::rangeEnd meaning "up to the end". */
+    static constexpr uint64_t NoRange = std::numeric_limits<uint64_t>::max();
+
+    /** The status line and headers of a response. */
+    struct Response {
+        int status = 0;
+        std::vector<std::pair<std::string, std::string>> headers;
+
+        /**
+         * \param[in] name The name of a header (case insensitive).
+         *
+         * \return The value of the header, or "" if it was not sent.
+         */
+        std::string header(const std::string_view name) const {
+            for (const auto& hdr : headers) {
+                if (lower(hdr.first) == lower(std::string(name))) {
+                    return hdr.second;
+                }
+            }
+            return "";
+        }
+
+        /** \return A copy of a string converted to lower case. */
+        static std::string lower(std::string str) {
+            std::transform(str.begin(), str.end(), str.begin(),
+                           [](const unsigned char c) {
+                               return std::tolower(c); });
+            return str;
+        }
+    };
+
+    /** Called with each block of the (decoded) body of a response. */
+    using DataHandler = std::function<void(const char* data, size_t len)>;
+
+    /**
+     * Called once a request has finished.  The error code is set if
+     * the request failed (e.g. the host could not be reached).
+     */
+    using DoneHandler = std::function<void(const boost::system::error_code&,
+                                           const Response&)>;
+
+    /** Called with the status line and headers, before any of the body. */
+    using HeadersHandler = std::function<void(const Response&)>;
+
+    /** A request to be sent by the fetcher. */
+    struct Request {
+        std::string url;
+        // Send a HEAD (rather than a GET) request
+        bool head = false;
+        // The (inclusive) range of bytes requested.  Compression is not
+        // requested for range requests, since ranges of a compressed
+        // body cannot be inflated on their own.
+        uint64_t rangeStart = 0, rangeEnd = NoRange;
+        // Receives the body, but only for 2xx responses (the
+        // body of an error response is discarded).
+        DataHandler onData;
+        DoneHandler onDone;
+        // Optional, e.g. to tell a 206 from a 200 before the body arrives
+        HeadersHandler onHeaders;
+        // If not zero, the request fails with error::timed_out (and its
+        // connection is closed) unless it finishes within this time of
+        // being started on a connection.
+        std::chrono::steady_clock::duration timeout{};
+    };
+
+    /**
+     * Create a fetcher.
+     *
+     * \param[in] io The io_context that does the work of the fetcher.
+     *
+     * \param[in] maxConnectionsPerHost The maximum number of
+     * connections that are open to any 1 host (port) at a time.
+     * Requests wait for a connection once this limit is reached.
+     */
+    explicit HTTPFetcher(boost::asio::io_context& io,
+                         const size_t maxConnectionsPerHost = 4) :
+        strand(boost::asio::make_strand(io)), resolver(strand),
+        maxConnectionsPerHost(std::max<size_t>(maxConnectionsPerHost, 1)) {}
+
+    HTTPFetcher(const HTTPFetcher&) = delete;
+    HTTPFetcher& operator=(const HTTPFetcher&) = delete;
+
+    /**
+     * Start a request.  This method can be called from any thread.
+     *
+     * \param[in] request The request to be sent.
+     */
+    void fetch(Request request) {
+        boost::asio::post(strand, [this, request = std::move(request)] {
+            const auto url = breakDownURL(request.url);
+            const std::string hostKey = std::get<0>(url) + ":" +
+                std::get<1>(url);
+            hosts[hostKey].waiting.push_back(std::move(request));
+            startWaiting(hostKey);
+        });
+    }
+
+    /**
+     * Convenience method to start a GET request for a whole URL.
+     *
+     * \param[in] url The URL to be fetched.
+     *
+     * \param[in] onData Receives the body (if the status is 2xx).
+     *
+     * \param[in] onDone Called once the request has finished.
+     */
+    void fetch(const std::string& url, DataHandler onData,
+               DoneHandler onDone) {
+        Request request;
+        request.url = url;
+        request.onData = std::move(onData);
+        request.onDone = std::move(onDone);
+        fetch(std::move(request));
+    }
+
+    /**
+     * Creates the DataHandler for 1 part of a download split by
+     * fetchParts.  It is called with the index of the part and the
+     * number of parts before any data is received.
+     */
+    using PartHandlerMaker = std::function<DataHandler(size_t part,
+                                                       size_t numParts)>;
+
+    /**
+     * Download a URL as several parts using Range requests that run in
+     * parallel.  A HEAD request first checks the size of the body and
+     * whether the server supports ranges.  If it does not (or the body
+     * is smaller than 2 * minPartSize), the URL is fetched as 1 part,
+     * with compression.  The parts are of (nearly) equal size and are
+     * numbered in the order in which they appear in the body.  The other
+     * parts are only started once the first part's 206 response shows
+     * that the server honors ranges.  If the first part is answered with
+     * a 200 instead, its response is the whole body, so the download
+     * continues as 1 part (using makeHandler(0, 1)).
+     *
+     * \param[in] url The URL to be fetched.
+     *
+     * \param[in] maxParts The maximum number of parts.
+     *
+     * \param[in] minPartSize The minimum size (in bytes) of a part.
+     *
+     * \param[in] makeHandler Creates the DataHandler for each part.
+     *
+     * \param[in] onDone Called once all of the parts have finished.  The
+     * response is the first failed one, if any, and otherwise the last
+     * one to finish.
+     */
+    void fetchParts(const std::string& url, const size_t maxParts,
+                    const uint64_t minPartSize, PartHandlerMaker makeHandler,
+                    DoneHandler onDone) {
+        Request head;
+        head.url = url;
+        head.head = true;
+        head.onDone = [=](const boost::system::error_code& ec,
+                          const Response& resp) {
+            const uint64_t size = std::strtoull(
+                resp.header("Content-Length").c_str(), nullptr, 10);
+            const bool ranges = !ec && resp.status == 200 &&
+                resp.header("Accept-Ranges").find("bytes") !=
+                std::string::npos;
+            const size_t parts = !ranges ? 1 : std::max<uint64_t>(1,
+                std::min<uint64_t>(maxParts, size / std::max<uint64_t>(
+                    minPartSize, 1)));
+            if (parts == 1) {
+                fetch(url, makeHandler(0, 1), onDone);
+                return;
+            }
+            // The result of the parts: the first failure, if any
+            struct Result {
+                size_t unfinished;
+                boost::system::error_code ec;
+                Response response;
+                bool failed = false;
+                // Set once the first part's response is a 206
+                bool split = false;
+            };
+            auto result = std::make_shared<Result>(Result{parts, {}, {}});
+            // Creates the request for a part, which is counted in result
+            auto makePart = [=](const size_t i) {
+                Request part;
+                part.url = url;
+                part.rangeStart = size * i / parts;
+                part.rangeEnd = size * (i + 1) / parts - 1;
+                part.onDone = [result, onDone](
+                    const boost::system::error_code& ec,
+                    const Response& resp) {
+                    if (!result->split) {
+                        // The first part's response was not a 206, so
+                        // it was handled as the whole download
+                        onDone(ec, resp);
+                        return;
+                    }
+                    if (!result->failed && (ec || resp.status != 206)) {
+                        // A 200 means that the range was ignored
+                        result->failed = true;
+                        result->ec = (ec || resp.status != 200) ? ec :
+                            boost::asio::error::operation_not_supported;
+                        result->response = resp;
+                    } else if (!result->failed) {
+                        result->response = resp;
+                        result->response.status = 200;
+                    }
+                    if (--result->unfinished == 0) {
+                        onDone(result->ec, result->response);
+                    }
+                };
+                return part;
+            };
+            // The handler for the first part depends on its status
+            auto firstHandler = std::make_shared<DataHandler>();
+            Request first = makePart(0);
+            first.onData = [firstHandler](const char* data, size_t len) {
+                (*firstHandler)(data, len);
+            };
+            first.onHeaders = [=](const Response& resp) {
+                if (resp.status != 206) {
+                    *firstHandler = makeHandler(0, 1);
+                    return;
+                }
+                result->split = true;
+                *firstHandler = makeHandler(0, parts);
+                for (size_t i = 1; i < parts; i++) {
+                    Request part = makePart(i);
+                    part.onData = makeHandler(i, parts);
+                    fetch(std::move(part));
+                }
+            };
+            fetch(std::move(first));
+        };
+        fetch(std::move(head));
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+    using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+    // The connections to 1 host and the requests waiting for one
+    struct Host {
+        std::vector<std::shared_ptr<tcp::socket>> idle;
+        size_t open = 0;
+        std::deque<Request> waiting;
+    };
+
+    class Exchange;
+
+    /**
+     * Start as many of a host's waiting requests as there are (idle or
+     * new) connections for.
+     *
+     * \param[in] hostKey The "host:port" of the host.
+     */
+    void startWaiting(const std::string& hostKey);
+
+    /**
+     * Called (by an Exchange) when a request has finished with its
+     * connection.
+     *
+     * \param[in] hostKey The "host:port" of the host.
+     *
+     * \param[in] socket The connection if it can be reused, or nullptr
+     * if it has been closed.
+     */
+    void release(const std::string& hostKey,
+                 std::shared_ptr<tcp::socket> socket) {
+        Host& h = hosts[hostKey];
+        if (socket != nullptr) {
+            h.idle.push_back(std::move(socket));
+        } else {
+            h.open--;
+        }
+        startWaiting(hostKey);
+    }
+
+    // All of the work of the fetcher is done on this strand
+    Strand strand;
+    // Used to look up the address of hosts
+    tcp::resolver resolver;
+    // The limit on the number of connections to each host
+    const size_t maxConnectionsPerHost;
+    // The hosts, by "host:port"
+    std::unordered_map<std::string, Host> hosts;
+};
+
+/**
+ * One request and its response, sent and received on a (new or reused)
+ * connection.  The exchange keeps itself alive (via shared_from_this)
+ * for as long as an operation is pending on its connection.
+ */
+class HTTPFetcher::Exchange :
+        public std::enable_shared_from_this<HTTPFetcher::Exchange> {
+public:
+    Exchange(HTTPFetcher& fetcher, std::string hostKey, Request request,
+             std::shared_ptr<tcp::socket> socket) :
+        fetcher(fetcher), hostKey(std::move(hostKey)),
+        request(std::move(request)), socket(std::move(socket)),
+        reused(this->socket != nullptr), timer(fetcher.strand) {}
+
+    ~Exchange() {
+        if (inflating) {
+            inflateEnd(&zs);
+        }
+    }
+
+    /** Connect (unless a connection is being reused) and send. */
+    void start() {
+        if (request.timeout.count() > 0 && !timing) {
+            startTimer();
+        }
+        if (socket != nullptr) {
+            send();
+            return;
+        }
+        socket = std::make_shared<tcp::socket>(fetcher.strand);
+        std::tie(host, port, std::ignore) = breakDownURL(request.url);
+        auto self = shared_from_this();
+        fetcher.resolver.async_resolve(host, port, [self](
+            const boost::system::error_code& ec,
+            const tcp::resolver::results_type& endpoints) {
+            if (ec || self->timedOut) {
+                return self->finish(ec, false);
+            }
+            boost::asio::async_connect(*self->socket, endpoints,
+                [self](const boost::system::error_code& ec,
+                       const tcp::endpoint&) {
+                    if (ec) {
+                        return self->finish(ec, false);
+                    }
+                    self->send();
+                });
+        });
+    }
+
+private:
+    // How the end of the body is found
+    enum class Framing { None, Length, Chunked, Close };
+
+    // The states of the chunked transfer decoder
+    enum class ChunkState { Size, Data, DataEnd, Trailer, Done };
+
+    /**
+     * Start the timer for Request::timeout.  When it expires the
+     * connection is closed, which makes the pending operation fail.
+     */
+    void startTimer() {
+        timing = true;
+        timer.expires_after(request.timeout);
+        auto self = shared_from_this();
+        timer.async_wait([self](const boost::system::error_code& ec) {
+            if (!ec && !self->finished) {
+                self->timedOut = true;
+                if (self->socket != nullptr) {
+                    boost::system::error_code ignored;
+                    self->socket->close(ignored);
+                }
+            }
+        });
+    }
+
+    /** Send the request on the connection. */
+    void send() {
+        std::string path;
+        std::tie(host, port, path) = breakDownURL(request.url);
+        requestText = (request.head ? "HEAD " : "GET ") + path +
+            " HTTP/1.1\r\nHost: " + host + "\r\n";
+        if (request.rangeStart != 0 || request.rangeEnd != NoRange) {
+            requestText += "Range: bytes=" +
+                std::to_string(request.rangeStart) + "-" +
+                (request.rangeEnd == NoRange ? std::string() :
+                 std::to_string(request.rangeEnd)) + "\r\n";
+        } else if (!request.head) {
+            requestText += "Accept-Encoding: gzip, deflate\r\n";
+        }
+        requestText += "\r\n";
+        auto self = shared_from_this();
+        boost::asio::async_write(*socket, boost::asio::buffer(requestText),
+            [self](const boost::system::error_code& ec, size_t) {
+                if (ec) {
+                    return self->retryOrFinish(ec);
+                }
+                self->readHeaders();
+            });
+    }
+
+    /** Read and parse the status line and headers of the response. */
+    void readHeaders() {
+        auto self = shared_from_this();
+        boost::asio::async_read_until(*socket, buf, "\r\n\r\n",
+            [self](const boost::system::error_code& ec, const size_t len) {
+                if (ec) {
+                    return self->retryOrFinish(ec);
+                }
+                self->parseHeaders(len);
+            });
+    }
+
+    /**
+     * A reused connection may have been closed by the server while it
+     * was idle.  In that case the request is sent again on a new
+     * connection (once); otherwise the request fails.
+     *
+     * \param[in] ec The error that occurred.
+     */
+    void retryOrFinish(const boost::system::error_code& ec) {
+        if (reused && buf.size() == 0 && !timedOut) {
+            reused = false;
+            socket.reset();
+            start();
+        } else {
+            finish(ec, false);
+        }
+    }
+
+    /**
+     * Parse the status line and headers, and decide how the body is
+     * framed and encoded.
+     *
+     * \param[in] len The number of bytes of status line and headers.
+     */
+    void parseHeaders(const size_t len) {
+        const std::string_view text(static_cast<const char*>(
+            buf.data().data()), len);
+        size_t start = 0;
+        for (bool first = true; start < len; first = false) {
+            size_t end = text.find("\r\n", start);
+            const std::string_view line = text.substr(start, end - start);
+            start = end + 2;
+            if (line.empty()) {
+                break;
+            }
+            if (first) {
+                const size_t sp = line.find(' ');
+                response.status = (sp == std::string_view::npos) ? 0 :
+                    std::atoi(std::string(line.substr(sp + 1, 3)).c_str());
+                continue;
+            }
+            const size_t colon = line.find(':');
+            if (colon != std::string_view::npos) {
+                const size_t value = line.find_first_not_of(" \t", colon + 1);
+                response.headers.emplace_back(line.substr(0, colon),
+                    value == std::string_view::npos ? std::string_view() :
+                    line.substr(value));
+            }
+        }
+        buf.consume(len);
+        keepAlive = Response::lower(response.header("Connection")).find(
+            "close") == std::string::npos;
+        // Work out how the end of the body is found (RFC 7230 3.3.3)
+        const std::string transfer = Response::lower(
+            response.header("Transfer-Encoding"));
+        const std::string length = response.header("Content-Length");
+        if (request.head || response.status / 100 == 1 ||
+            response.status == 204 || response.status == 304) {
+            framing = Framing::None;
+        } else if (transfer.find("chunked") != std::string::npos) {
+            framing = Framing::Chunked;
+        } else if (!length.empty()) {
+            framing = Framing::Length;
+            remaining = std::strtoull(length.c_str(), nullptr, 10);
+        } else {
+            framing = Framing::Close;
+            keepAlive = false;
+        }
+        deliverBody = (response.status / 100 == 2);
+        const std::string encoding = Response::lower(
+            response.header("Content-Encoding"));
+        if (deliverBody && (encoding == "gzip" || encoding == "deflate")) {
+            inflating = true;
+            // 15 + 32 accepts both gzip and zlib (deflate) headers
+            inflateInit2(&zs, 15 + 32);
+        }
+        if (request.onHeaders) {
+            request.onHeaders(response);
+        }
+        // Process the start of the body that was read with the headers
+        const auto data = buf.data();
+        const size_t buffered = data.size();
+        if (!consume(static_cast<const char*>(data.data()), buffered)) {
+            return finish(boost::asio::error::invalid_argument, false);
+        }
+        buf.consume(buffered);
+        readBody();
+    }
+
+    /** Read more of the body until it is complete. */
+    void readBody() {
+        if (bodyComplete()) {
+            return finish({}, keepAlive && buf.size() == 0);
+        }
+        readBuf.resize(64 * 1024);
+        auto self = shared_from_this();
+        socket->async_read_some(boost::asio::buffer(readBuf),
+            [self](const boost::system::error_code& ec, const size_t len) {
+                if (ec == boost::asio::error::eof &&
+                    self->framing == Framing::Close) {
+                    return self->finish({}, false);
+                }
+                if (ec) {
+                    return self->finish(ec, false);
+                }
+                if (!self->consume(self->readBuf.data(), len)) {
+                    return self->finish(boost::asio::error::invalid_argument,
+                                        false);
+                }
+                self->readBody();
+            });
+    }
+
+    /** \return True if all of the body has been received. */
+    bool bodyComplete() const {
+        switch (framing) {
+        case Framing::None:    return true;
+        case Framing::Length:  return remaining == 0;
+        case Framing::Chunked: return chunkState == ChunkState::Done;
+        default:               return false;
+        }
+    }
+
+    /**
+     * Process bytes of the body as received on the connection, removing
+     * the chunked transfer framing (if any).
+     *
+     * \param[in] data The bytes received.
+     *
+     * \param[in] len The number of bytes received.
+     *
+     * \return False if the body is malformed.
+     */
+    bool consume(const char* data, size_t len) {
+        if (framing == Framing::None) {
+            return true;
+        } else if (framing == Framing::Length) {
+            const size_t take = std::min<uint64_t>(len, remaining);
+            remaining -= take;
+            return decode(data, take);
+        } else if (framing == Framing::Close) {
+            return decode(data, len);
+        }
+        while (len > 0 && chunkState != ChunkState::Done) {
+            if (chunkState == ChunkState::Data) {
+                const size_t take = std::min<uint64_t>(len, remaining);
+                if (!decode(data, take)) {
+                    return false;
+                }
+                data += take;
+                len -= take;
+                if ((remaining -= take) == 0) {
+                    chunkState = ChunkState::DataEnd;
+                }
+                continue;
+            }
+            // The other states consume whole lines
+            const char* nl = static_cast<const char*>(
+                std::memchr(data, '\n', len));
+            const size_t take = (nl == nullptr) ? len : nl - data + 1;
+            line.append(data, take);
+            data += take;
+            len -= take;
+            if (nl == nullptr) {
+                continue;
+            }
+            if (chunkState == ChunkState::Size) {
+                char* end;
+                remaining = std::strtoull(line.c_str(), &end, 16);
+                if (end == line.c_str()) {
+                    return false;
+                }
+                chunkState = (remaining == 0) ? ChunkState::Trailer :
+                    ChunkState::Data;
+            } else if (chunkState == ChunkState::DataEnd) {
+                chunkState = ChunkState::Size;
+            } else if (line == "\r\n" || line == "\n") {
+                chunkState = ChunkState::Done;  // End of the trailer
+            }
+            line.clear();
+        }
+        return true;
+    }
+
+    /**
+     * Inflate (if needed) bytes of the body and hand them to the
+     * request's data handler.
+     *
+     * \param[in] data The bytes of the body.
+     *
+     * \param[in] len The number of bytes.
+     *
+     * \return False if the compressed data is invalid.
+     */
+    bool decode(const char* data, const size_t len) {
+        if (!deliverBody || len == 0 || !request.onData) {
+            return true;
+        }
+        if (!inflating) {
+            request.onData(data, len);
+            return true;
+        }
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = len;
+        char out[64 * 1024];
+        while (zs.avail_in > 0) {
+            zs.next_out = reinterpret_cast<Bytef*>(out);
+            zs.avail_out = sizeof(out);
+            const int rc = inflate(&zs, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                return false;
+            }
+            if (sizeof(out) > zs.avail_out) {
+                request.onData(out, sizeof(out) - zs.avail_out);
+            }
+            if (rc == Z_STREAM_END || (rc == Z_BUF_ERROR &&
+                                       zs.avail_out != 0)) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Finish the request: hand the connection back to the fetcher (or
+     * close it) and call the request's done handler.
+     *
+     * \param[in] ec The error, if the request failed.
+     *
+     * \param[in] reusable True if the connection can be reused.
+     */
+    void finish(boost::system::error_code ec, bool reusable) {
+        finished = true;
+        timer.cancel();
+        if (timedOut) {
+            ec = boost::asio::error::timed_out;
+            reusable = false;
+        }
+        if (!reusable && socket != nullptr) {
+            boost::system::error_code ignored;
+            socket->close(ignored);
+        }
+        fetcher.release(hostKey, reusable ? std::move(socket) : nullptr);
+        if (request.onDone) {
+            request.onDone(ec, response);
+        }
+    }
+
+    HTTPFetcher& fetcher;
+    const std::string hostKey;
+    Request request;
+    std::shared_ptr<tcp::socket> socket;
+    // True if the connection was reused from an earlier request
+    bool reused;
+    // Enforces Request::timeout (if any)
+    boost::asio::steady_timer timer;
+    bool timing = false, timedOut = false, finished = false;
+    std::string host, port, requestText;
+    // Holds the response headers (and any body bytes read with them)
+    boost::asio::streambuf buf;
+    // Buffer that the rest of the body is read into
+    std::vector<char> readBuf;
+    Response response;
+    Framing framing = Framing::None;
+    bool keepAlive = true, deliverBody = false;
+    // Bytes left in the body (Length) or the current chunk (Chunked)
+    uint64_t remaining = 0;
+    ChunkState chunkState = ChunkState::Size;
+    // A partial line of the chunked framing
+    std::string line;
+    // The zlib state for compressed bodies
+    z_stream zs = {};
+    bool inflating = false;
+};
+
+// Defined here since it needs the complete Exchange class
+inline void HTTPFetcher::startWaiting(const std::string& hostKey) {
+    Host& h = hosts[hostKey];
+    while (!h.waiting.empty() &&
+           (!h.idle.empty() || h.open < maxConnectionsPerHost)) {
+        std::shared_ptr<tcp::socket> socket;
+        if (!h.idle.empty()) {
+            socket = std::move(h.idle.back());
+            h.idle.pop_back();
+        } else {
+            h.open++;
+        }
+        auto exchange = std::make_shared<Exchange>(*this, hostKey,
+            std::move(h.waiting.front()), std::move(socket));
+        h.waiting.pop_front();
+        exchange->start();
+    }
+}
+
+#endif  // HTTP_FETCHER_H
@@ -0,0 +1,334 @@
+/**
+ * Copyright 2021 Michael Glum
+ *
+ * A small HTTP request parser shared by the web-servers in this
+ * repository.  The request line and headers are copied, without any
+ * heap allocation, into a fixed-size buffer inside the HTTPRequest
+ * object and split into std::string_view fields that refer to that
+ * buffer.  The request can be read from an input stream (such as a
+ * boost tcp::iostream or a file used for testing), or parsed from a
+ * socket buffer that has already been filled by asynchronous I/O.
+ */
+
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <string_view>
+
+/**
+ * Decode URL encoded entities in the form %xx (where 'x' is a
+ * hexadecimal digit) and '+' characters in place.  The string is
+ * decoded in a single pass, so this method is O(n) even for heavily
+ * encoded strings.  Malformed entities are left as is.
+ *
+ * \param[in,out] str The characters to be decoded.
+ *
+ * \param[in] len The number of characters in str.
+ *
+ * \return The length of the decoded string (which is never longer
+ * than the original).
+ */
+inline size_t urlDecode(char* str, const size_t len) {
+    auto hexValue = [](const char c) {
+        return std::isdigit(static_cast<unsigned char>(c)) ? c - '0' :
+            std::tolower(static_cast<unsigned char>(c)) - 'a' + 10;
+    };
+    size_t out = 0;
+    for (size_t in = 0; in < len; in++, out++) {
+        if (str[in] == '+') {
+            str[out] = ' ';
+        } else if (str[in] == '%' && in + 2 < len &&
+                   std::isxdigit(static_cast<unsigned char>(str[in + 1])) &&
+                   std::isxdigit(static_cast<unsigned char>(str[in + 2]))) {
+            str[out] = static_cast<char>(hexValue(str[in + 1]) * 16 +
+                                         hexValue(str[in + 2]));
+            in += 2;
+        } else {
+            str[out] = str[in];
+        }
+    }
+    return out;
+}
+
+/**
+ * An HTTP request line along with its headers.  Objects of this class
+ * cannot be copied because the fields refer to the object's buffer.
+ */
+class HTTPRequest {
+public:
+    /** The maximum number of bytes of request line and headers kept. */
+    static constexpr size_t MaxHeaderSize = 16 * 1024;
+
+    /** The maximum number of headers kept. */
+    static constexpr size_t MaxHeaders = 64;
+
+    /** Value returned by parse() for a request that can never be valid */
+    static constexpr size_t Invalid = std::string_view::npos;
+
+    HTTPRequest() = default;
+    HTTPRequest(const HTTPRequest&) = delete;
+    HTTPRequest& operator=(const HTTPRequest&) = delete;
+
+    /**
+     * Read the request line and headers from an input stream.  Exactly
+     * the request line and headers (up to and including the blank line
+     * that ends them) are consumed, so any body and any pipelined
+     * requests that follow are left in the stream.  Headers that do not
+     * fit into the buffer are read and discarded.
+     *
+     * \param[in,out] is The input stream to read the request from.
+     *
+     * \return True if a request line was read.  If the stream ended
+     * before the blank line the headers received so far are used and
+     * the stream's eofbit is set.
+     */
+    bool read(std::istream& is) {
+        clear();
+        std::streambuf& sb = *is.rdbuf();
+        // The number of characters (excluding '\r') in the current line
+        // and the end of the last line that was stored completely.
+        size_t lineLen = 0, storedEnd = 0;
+        bool truncated = false;
+        using Traits = std::streambuf::traits_type;
+        for (auto c = sb.sbumpc(); c != Traits::eof(); c = sb.sbumpc()) {
+            if (length < MaxHeaderSize) {
+                raw[length++] = Traits::to_char_type(c);
+            } else {
+                truncated = true;
+            }
+            if (c != '\n') {
+                lineLen += (c != '\r');
+            } else if (lineLen > 0) {
+                lineLen = 0;
+                storedEnd = truncated ? storedEnd : length;
+            } else if (storedEnd == 0 && !truncated) {
+                length = 0;  // Ignore blank lines before the request line
+            } else {
+                return tokenize(truncated ? storedEnd : length);
+            }
+        }
+        is.setstate(std::ios::eofbit);
+        if (length == 0) {
+            is.setstate(std::ios::failbit);
+            return false;
+        }
+        return tokenize(truncated ? storedEnd : length);
+    }
+
+    /**
+     * Parse the request line and headers at the start of a buffer of
+     * data received from a client.  The buffer is not modified.
+     *
+     * \param[in] data The data received from the client so far.
+     *
+     * \return The number of bytes of request line and headers
+     * (including the blank line that ends them) at the start of data,
+     * zero if data does not yet hold the complete headers, or Invalid
+     * if the headers are too large or the request line is malformed.
+     */
+    size_t parse(const std::string_view data) {
+        clear();
+        // Skip blank lines before the request line
+        size_t start = data.find_first_not_of("\r\n");
+        if (start == std::string_view::npos) {
+            return 0;
+        }
+        // Find the blank line that ends the headers
+        size_t end = std::string_view::npos;
+        for (size_t nl = data.find('\n', start); nl != std::string_view::npos;
+             nl = data.find('\n', nl + 1)) {
+            const size_t next = nl + 1 + (nl + 1 < data.size() &&
+                                          data[nl + 1] == '\r');
+            if (next < data.size() && data[next] == '\n') {
+                end = next + 1;
+                break;
+            }
+        }
+        if (end == std::string_view::npos || end - start > MaxHeaderSize) {
+            return (data.size() - start > MaxHeaderSize) ? Invalid : 0;
+        }
+        length = end - start;
+        std::memcpy(raw, data.data() + start, length);
+        return tokenize(length) ? end : Invalid;
+    }
+
+    /** \return The method in the request line, e.g. "GET". */
+    std::string_view getMethod() const { return method; }
+
+    /** \return The (undecoded) URL in the request line, e.g. "/a%20b". */
+    std::string_view getURL() const { return url; }
+
+    /** \return The HTTP version in the request line, e.g. "HTTP/1.1". */
+    std::string_view getVersion() const { return version; }
+
+    /**
+     * Decode the URL in place (see urlDecode).  Calling this method
+     * more than once decodes the URL only once.
+     *
+     * \return The decoded URL.
+     */
+    std::string_view decodeURL() {
+        if (!decoded && !url.empty()) {
+            char* start = raw + (url.data() - raw);
+            url = std::string_view(start, urlDecode(start, url.size()));
+            decoded = true;
+        }
+        return url;
+    }
+
+    /**
+     * Find the value of a header.  Header names are case insensitive.
+     *
+     * \param[in] name The name of the header, e.g. "Content-Length".
+     *
+     * \return The value of the header (without surrounding white
+     * space), or an empty string_view if it was not sent.
+     */
+    std::string_view getHeader(const std::string_view name) const {
+        for (size_t i = 0; i < numHeaders; i++) {
+            if (equalsIgnoreCase(headers[i].name, name)) {
+                return headers[i].value;
+            }
+        }
+        return {};
+    }
+
+    /**
+     * \return The value of the Content-Length header, or zero if the
+     * request does not have a (valid) Content-Length header.  A value
+     * too large for a size_t is returned as the largest size_t, so
+     * that callers limiting the size of the body reject it.
+     */
+    size_t getContentLength() const {
+        const std::string_view value = getHeader("Content-Length");
+        size_t contentLength = 0;
+        const auto res = std::from_chars(value.data(), value.data() +
+                                         value.size(), contentLength);
+        if (res.ec == std::errc::result_out_of_range) {
+            return std::numeric_limits<size_t>::max();
+        }
+        return contentLength;
+    }
+
+    /**
+     * \return True if the client wants to keep the connection open
+     * after this request.  That is the default for HTTP/1.1 unless a
+     * "Connection: close" header is sent, while HTTP/1.0 clients must
+     * send "Connection: keep-alive".
+     */
+    bool isKeepAlive() const {
+        const std::string_view connection = getHeader("Connection");
+        if (containsIgnoreCase(connection, "close")) {
+            return false;
+        }
+        return version != "HTTP/1.0" ||
+            containsIgnoreCase(connection, "keep-alive");
+    }
+
+private:
+    // One header in the request
+    struct Header {
+        std::string_view name, value;
+    };
+
+    /** Reset the fields before a new request is read or parsed. */
+    void clear() {
+        length = numHeaders = 0;
+        method = url = version = {};
+        decoded = false;
+    }
+
+    /**
+     * Split the request that has been copied into the buffer into its
+     * request line fields and headers.
+     *
+     * \param[in] end The number of bytes of the buffer to be used.
+     *
+     * \return True if the request line has a method and a URL.
+     */
+    bool tokenize(const size_t end) {
+        const std::string_view text(raw, end);
+        bool requestLine = true;
+        for (size_t start = 0; start < text.size();) {
+            size_t nl = std::min(text.find('\n', start), text.size());
+            std::string_view line = text.substr(start, nl - start);
+            start = nl + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (requestLine) {
+                // Request line in the form "METHOD URL VERSION"
+                requestLine = false;
+                const size_t sp1 = line.find(' ');
+                method = line.substr(0, sp1);
+                if (sp1 != std::string_view::npos) {
+                    line.remove_prefix(sp1 + 1);
+                    const size_t sp2 = line.find(' ');
+                    url = line.substr(0, sp2);
+                    if (sp2 != std::string_view::npos) {
+                        version = trim(line.substr(sp2 + 1));
+                    }
+                }
+            } else if (line.empty()) {
+                break;
+            } else if (numHeaders < MaxHeaders) {
+                // Header line in the form "Name: value"
+                const size_t colon = line.find(':');
+                if (colon != std::string_view::npos) {
+                    headers[numHeaders++] = {trim(line.substr(0, colon)),
+                                             trim(line.substr(colon + 1))};
+                }
+            }
+        }
+        return !method.empty() && !url.empty();
+    }
+
+    /** \return The given string without surrounding spaces and tabs. */
+    static std::string_view trim(std::string_view str) {
+        const size_t start = str.find_first_not_of(" \t");
+        if (start == std::string_view::npos) {
+            return {};
+        }
+        return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+    }
+
+    /** \return True if two strings are equal ignoring case. */
+    static bool equalsIgnoreCase(const std::string_view s1,
+                                 const std::string_view s2) {
+        return s1.size() == s2.size() &&
+            std::equal(s1.begin(), s1.end(), s2.begin(), charEqual);
+    }
+
+    /** \return True if str contains word, ignoring case. */
+    static bool containsIgnoreCase(const std::string_view str,
+                                   const std::string_view word) {
+        return std::search(str.begin(), str.end(), word.begin(), word.end(),
+                           charEqual) != str.end();
+    }
+
+    /** \return True if 2 characters are equal ignoring case. */
+    static bool charEqual(const char c1, const char c2) {
+        return std::tolower(static_cast<unsigned char>(c1)) ==
+            std::tolower(static_cast<unsigned char>(c2));
+    }
+
+    // The request line and headers
+    char raw[MaxHeaderSize];
+    // The number of bytes used in raw
+    size_t length = 0;
+    // The fields in the request line.  These refer to raw.
+    std::string_view method, url, version;
+    // Flag to indicate if the URL has been decoded in place
+    bool decoded = false;
+    // The headers in the request.  These refer to raw.
+    Header headers[MaxHeaders];
+    size_t numHeaders = 0;
+};
+
+#endif  // HTTP_REQUEST_H
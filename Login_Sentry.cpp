@@ -6,21 +6,46 @@
  * detected using the two rules listed further below.
  *
  *   1. If an IP is in the "banned list", then it is flagged as a
- *      break in attempt.
+ *      break in attempt.  The list can hold IPv4 and IPv6 addresses
+ *      and CIDR networks.
  *
  *   2. unless an user is in the "authorized list", if an user has
  *      attempted to login more than 3 times in a span of 20 seconds,
+ *      (both limits can be changed on the command-line).
+ *
+ * Both lists are reloaded if their files change during a scan.
  */
 
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <iomanip>
+#include <iterator>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <boost/asio.hpp>
+#include "HTTPFetcher.h"
 
 // Convenience namespace declarations to streamline the code below
 using namespace boost::asio;
@@ -34,15 +59,118 @@ using namespace std;
 using LookupMap = std::unordered_map<std::string, bool>;
 
 /**
- * An unordered map to track the seconds for each log entry associated
- * with each user. The user ID is the key into this unordered map.
- * The values is a list of timestamps of log entries associated with
- * an user. For example, if a user "bob" has 3 login at "Aug 29 11:01:01",
- * "Aug 29 11:01:02", and "Aug 29 11:01:03" (one second apart each), then
- * logins["bill"] will be a vector with values {1630249261, 1630249262,
- * 1630249263}.
+ * The rule used to detect hacking due to login frequency: a user who is
+ * not authorized is flagged if they attempt to log in more than
+ * maxAttempts times within window seconds.
+ */
+struct LoginRule {
+    size_t maxAttempts = 3;
+    long window = 20;
+};
+
+/**
+ * The most recent login times of 1 user, kept in a ring buffer with
+ * room for just maxAttempts + 1 entries, which is all that the
+ * LoginRule needs.  So the memory used per user is constant no matter
+ * how long the log is.  Whether the user is authorized is looked up
+ * only when the user is first seen and when the watchlists change.
+ */
+class LoginWindow {
+public:
+    /**
+     * Look up whether the user is authorized, unless that has already
+     * been done for this version of the watchlists.  A user that is no
+     * longer authorized starts with an empty window.
+     *
+     * \param[in] authorizedUsers The authorized users.
+     *
+     * \param[in] generation The generation of the watchlists.
+     *
+     * \param[in] userID The user ID of this user.
+     *
+     * \param[in] rule The rule that the window is used for.
+     */
+    void update(const LookupMap& authorizedUsers, const unsigned generation,
+                const std::string& userID, const LoginRule& rule) {
+        if (generation == checkedGeneration) {
+            return;
+        }
+        checkedGeneration = generation;
+        authorized = authorizedUsers.find(userID) != authorizedUsers.end();
+        if (authorized) {
+            times = std::vector<long>();
+            next = count = 0;
+        } else if (times.empty()) {
+            times.resize(rule.maxAttempts + 1);
+        }
+    }
+
+    /**
+     * Record a login attempt and check it against the rule.
+     *
+     * \param[in] seconds The time of the login attempt.  Attempts must
+     * be added in chronological order.
+     *
+     * \param[in] rule The rule that the window was created for.
+     *
+     * \return True if this attempt violates the rule.
+     */
+    bool add(const long seconds, const LoginRule& rule) {
+        if (authorized) {
+            return false;
+        }
+        // After this attempt is stored, next refers to the oldest one
+        times[next] = seconds;
+        next = (next + 1) % times.size();
+        count = std::min(count + 1, times.size());
+        return count == times.size() && seconds - times[next] <= rule.window;
+    }
+
+    /** \return The login times in the window, oldest first. */
+    std::vector<long> recent() const {
+        std::vector<long> result;
+        for (size_t i = 0; i < count; i++) {
+            result.push_back(times[(next + times.size() - count + i) %
+                                   times.size()]);
+        }
+        return result;
+    }
+
+    /**
+     * Restore the login times saved (with recent) by an earlier run.
+     * Whether the user is authorized is looked up again by update.
+     *
+     * \param[in] saved The login times, oldest first.
+     *
+     * \param[in] rule The rule that the window is used for.
+     */
+    void restore(const std::vector<long>& saved, const LoginRule& rule) {
+        times.assign(saved.empty() ? 0 : rule.maxAttempts + 1, 0);
+        next = count = 0;
+        checkedGeneration = 0;
+        const size_t skip = saved.size() - std::min(saved.size(),
+                                                    times.size());
+        for (size_t i = skip; i < saved.size(); i++) {
+            times[next] = saved[i];
+            next = (next + 1) % times.size();
+            count++;
+        }
+    }
+
+private:
+    // The most recent login times, next is where the next one goes
+    std::vector<long> times;
+    size_t next = 0, count = 0;
+    bool authorized = false;
+    // The generation of the watchlists that authorized is from
+    unsigned checkedGeneration = 0;
+};
+
+/**
+ * An unordered map to track the recent login times of each user. The
+ * user ID is the key into this unordered map.
  */
-using LoginTimes = std::unordered_map<std::string, std::vector<long>>;
+using LoginTimes = std::unordered_map<std::string, LoginWindow>;
 
 /**
  * Helper method to load data from a given file into an unordered map.
@@ -69,6 +197,311 @@ LookupMap loadLookup(const std::string& fileName) {
     return lookup;
 }
 
+/**
+ * A set of banned IP addresses and networks.  Each line of the banned
+ * list can be an IPv4 or IPv6 address, or a network in CIDR notation
+ * (e.g. "10.1.0.0/16" or "2001:db8::/32").  The addresses are stored
+ * as 128-bit numbers (IPv4 addresses are mapped into ::ffff:0:0/96) in
+ * a sorted table of non-overlapping ranges, so an address is looked up
+ * with 1 binary search no matter how many entries there are.  Large
+ * lists also get a Bloom filter of the entries' prefixes, which rejects
+ * almost all of the addresses that are not banned without touching
+ * the table.  Entries that are not addresses are matched exactly, as
+ * before.
+ */
+class BannedIPs {
+public:
+    /** The number of entries from which a Bloom filter is used. */
+    static constexpr size_t BloomThreshold = 4096;
+
+    /**
+     * Load the banned list from a file.
+     *
+     * \param[in] fileName The file to be loaded, e.g. "banned_ips.txt".
+     *
+     * \return The banned list.
+     */
+    static BannedIPs load(const std::string& fileName) {
+        std::ifstream is(fileName);
+        if (!is.good()) {
+            throw std::runtime_error("Error opening file " + fileName);
+        }
+        BannedIPs banned;
+        std::vector<Prefix> prefixes;
+        for (std::string entry; is >> entry;) {
+            Prefix prefix;
+            if (parse(entry, prefix)) {
+                prefixes.push_back(prefix);
+            } else {
+                banned.others[entry] = true;
+            }
+        }
+        banned.build(prefixes);
+        return banned;
+    }
+
+    /**
+     * \param[in] ip The IP address (or other text) to be checked.
+     *
+     * \return True if the address is in the banned list.
+     */
+    bool contains(const std::string_view ip) const {
+        Prefix addr;
+        if (!parse(ip, addr) || addr.length != 128) {
+            return !others.empty() && others.find(std::string(ip)) !=
+                others.end();
+        }
+        if (!bloom.empty() && !mayContain(addr.address)) {
+            return false;
+        }
+        // Find the last range that starts at or before the address
+        auto it = std::upper_bound(ranges.begin(), ranges.end(),
+            addr.address, [](const Address a, const Range& r) {
+                return a < r.first; });
+        return it != ranges.begin() && addr.address <= (it - 1)->last;
+    }
+
+private:
+    using Address = unsigned __int128;
+
+    // An address and a prefix length (128 for a single address)
+    struct Prefix {
+        Address address;
+        unsigned length;
+    };
+
+    // An inclusive range of banned addresses
+    struct Range {
+        Address first, last;
+    };
+
+    /**
+     * Parse an IPv4 or IPv6 address with an optional prefix length.
+     * The bits after the prefix are cleared.
+     *
+     * \param[in] text The text to be parsed.
+     *
+     * \param[out] prefix The address and prefix length.
+     *
+     * \return True if text is a valid address or network.
+     */
+    static bool parse(const std::string_view text, Prefix& prefix) {
+        const size_t slash = text.find('/');
+        const std::string_view addr = text.substr(0, slash);
+        char buf[INET6_ADDRSTRLEN];
+        if (addr.empty() || addr.size() >= sizeof(buf)) {
+            return false;
+        }
+        addr.copy(buf, addr.size());
+        buf[addr.size()] = '\0';
+        unsigned char bytes[16] = {};
+        unsigned maxLength = 128;
+        if (inet_pton(AF_INET, buf, bytes + 12) == 1) {
+            bytes[10] = bytes[11] = 0xff;  // An IPv4-mapped address
+            maxLength = 32;
+        } else if (inet_pton(AF_INET6, buf, bytes) != 1) {
+            return false;
+        }
+        prefix.length = maxLength;
+        if (slash != std::string_view::npos) {
+            const std::string_view len = text.substr(slash + 1);
+            if (len.empty() || len.size() > 3 || !std::all_of(len.begin(),
+                    len.end(), [](const char c) { return std::isdigit(
+                        static_cast<unsigned char>(c)); }) ||
+                std::stoul(std::string(len)) > maxLength) {
+                return false;
+            }
+            prefix.length = std::stoul(std::string(len));
+        }
+        prefix.length += 128 - maxLength;
+        prefix.address = 0;
+        for (const unsigned char b : bytes) {
+            prefix.address = (prefix.address << 8) | b;
+        }
+        prefix.address &= mask(prefix.length);
+        return true;
+    }
+
+    /** \return The mask for the first length bits of an address. */
+    static Address mask(const unsigned length) {
+        return length == 0 ? 0 : ~Address(0) << (128 - length);
+    }
+
+    /**
+     * Build the range table (and Bloom filter) for the parsed entries.
+     *
+     * \param[in,out] prefixes The entries of the banned list.
+     */
+    void build(std::vector<Prefix>& prefixes) {
+        std::sort(prefixes.begin(), prefixes.end(),
+                  [](const Prefix& p1, const Prefix& p2) {
+                      return p1.address < p2.address; });
+        for (const Prefix& p : prefixes) {
+            const Range range{p.address, p.address | ~mask(p.length)};
+            if (!ranges.empty() && (ranges.back().last == ~Address(0) ||
+                                    range.first <= ranges.back().last + 1)) {
+                ranges.back().last = std::max(ranges.back().last,
+                                              range.last);
+            } else {
+                ranges.push_back(range);
+            }
+        }
+        if (prefixes.size() < BloomThreshold) {
+            return;
+        }
+        // About 16 bits per entry, rounded up to a power of 2
+        size_t words = 1;
+        while (64 * words < 16 * prefixes.size()) {
+            words *= 2;
+        }
+        bloom.resize(words);
+        for (const Prefix& p : prefixes) {
+            if (std::find(lengths.begin(), lengths.end(), p.length) ==
+                lengths.end()) {
+                lengths.push_back(p.length);
+            }
+            forEachBit(p.address, p.length, [this](const size_t bit) {
+                bloom[bit / 64] |= uint64_t(1) << (bit % 64); });
+        }
+    }
+
+    /**
+     * \return False if no prefix of the address (of any of the lengths
+     * in the list) is in the Bloom filter, i.e., if the address is
+     * certainly not banned.
+     */
+    bool mayContain(const Address address) const {
+        for (const unsigned length : lengths) {
+            bool all = true;
+            forEachBit(address & mask(length), length,
+                       [this, &all](const size_t bit) {
+                           all = all && (bloom[bit / 64] >> (bit % 64)) & 1;
+                       });
+            if (all) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Call a function with the index of each of the Bloom filter's bits
+     * for a prefix.
+     */
+    template <typename Function>
+    void forEachBit(const Address address, const unsigned length,
+                    const Function& fn) const {
+        // Mix the 2 halves of the address and the length (as in
+        // splitmix64) to get 2 hashes, combined for each bit
+        auto mix = [](uint64_t x) {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        };
+        const uint64_t h1 = mix(uint64_t(address >> 64) ^ length),
+            h2 = mix(uint64_t(address) ^ h1) | 1;
+        const uint64_t bits = bloom.size() * 64 - 1;
+        for (uint64_t i = 0; i < 4; i++) {
+            fn((h1 + i * h2) & bits);
+        }
+    }
+
+    // The banned addresses, sorted
+    std::vector<Range> ranges;
+    // The entries that are not addresses
+    LookupMap others;
+    // The Bloom filter (if any) and the prefix lengths in it
+    std::vector<uint64_t> bloom;
+    std::vector<unsigned> lengths;
+};
+
+/**
+ * The banned IPs and authorized users that log entries are checked
+ * against.  The lists are replaced (by a WatchlistLoader) whenever
+ * their files change; the generation tells the versions apart.
+ */
+struct Watchlists {
+    BannedIPs bannedIPs;
+    LookupMap authorizedUsers;
+    unsigned generation;
+};
+
+/**
+ * Loads the watchlists from their files, and reloads them when the
+ * files change, so the lists can be updated while a log is being
+ * scanned.  The files are checked at most once a second.
+ */
+class WatchlistLoader {
+public:
+    /**
+     * Load the watchlists.  An exception is thrown if a file cannot be
+     * read.
+     *
+     * \param[in] bannedFile The file with the banned IPs.
+     *
+     * \param[in] authorizedFile The file with the authorized users.
+     */
+    WatchlistLoader(std::string bannedFile, std::string authorizedFile) :
+        bannedFile(std::move(bannedFile)),
+        authorizedFile(std::move(authorizedFile)) {
+        stamps = fileStamps();
+        lists = load(1);
+    }
+
+    /** \return The current version of the watchlists. */
+    std::shared_ptr<const Watchlists> get() const { return lists; }
+
+    /**
+     * Reload the watchlists if it has been a second since they were last
+     * checked and a file has changed since it was loaded.  If the files
+     * cannot be read the current lists are kept.
+     */
+    void reloadIfChanged() {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastCheck < std::chrono::seconds(1)) {
+            return;
+        }
+        lastCheck = now;
+        const auto current = fileStamps();
+        if (current == stamps) {
+            return;
+        }
+        try {
+            lists = load(lists->generation + 1);
+            stamps = current;
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+private:
+    /** \return The modification times and sizes of the files. */
+    std::vector<long> fileStamps() const {
+        std::vector<long> result;
+        for (const std::string& file : {bannedFile, authorizedFile}) {
+            struct stat info = {};
+            ::stat(file.c_str(), &info);
+            result.insert(result.end(), {info.st_mtim.tv_sec,
+                info.st_mtim.tv_nsec, static_cast<long>(info.st_size)});
+        }
+        return result;
+    }
+
+    /** \return The watchlists loaded from the files. */
+    std::shared_ptr<const Watchlists> load(const unsigned generation) const {
+        return std::make_shared<const Watchlists>(Watchlists{
+            BannedIPs::load(bannedFile), loadLookup(authorizedFile),
+            generation});
+    }
+
+    const std::string bannedFile, authorizedFile;
+    std::shared_ptr<const Watchlists> lists;
+    // The stamps of the files when they were loaded
+    std::vector<long> stamps;
+    std::chrono::steady_clock::time_point lastCheck =
+        std::chrono::steady_clock::now();
+};
+
 /**
  * This method is used to convert a timestamp of the form "Jun 10
  * 03:32:36" to seconds since Epoch (i.e., 1900-01-01 00:00:00). This
@@ -92,175 +525,923 @@ long toSeconds(const std::string& timestamp, const int year = 2021) {
     return mktime(&tstamp);
 }
 
+/**
+ * A faster version of toSeconds for the fixed "Mon DD HH:MM:SS" format
+ * of syslog timestamps, with the 3 fields passed separately.  The
+ * seconds since Epoch at the start of each day are computed (with
+ * mktime) only once and cached, and the time of day is added to them
+ * arithmetically, which avoids the locks that strptime and mktime take
+ * on every call.  Timestamps in any other format are passed on to
+ * toSeconds, so the results are always the same as those of toSeconds.
+ *
+ * \param[in] month The month, e.g. "Jun".
+ *
+ * \param[in] day The day of the month, e.g. "10".
+ *
+ * \param[in] time The time, e.g. "03:32:36".
+ *
+ * \param[in] year An optional year associated with the date. By
+ * default this value is assumed to be 2021.
+ *
+ * \return This method returns the seconds elapsed since Epoch.
+ */
+long toSeconds(const std::string_view month, const std::string_view day,
+               const std::string_view time, const int year = 2021) {
+    static constexpr std::string_view Months =
+        "JanFebMarAprMayJunJulAugSepOctNovDec";
+    auto digit = [](const char c) { return c >= '0' && c <= '9'; };
+    auto twoDigits = [](const std::string_view str, const size_t pos) {
+        return (str[pos] - '0') * 10 + (str[pos + 1] - '0');
+    };
+    const size_t mon = (month.size() == 3) ? Months.find(month) : 0;
+    const int mday = (day.size() == 1 && digit(day[0])) ? day[0] - '0' :
+        (day.size() == 2 && digit(day[0]) && digit(day[1])) ?
+        twoDigits(day, 0) : 0;
+    const bool timeOk = time.size() == 8 && time[2] == ':' &&
+        time[5] == ':' && digit(time[0]) && digit(time[1]) &&
+        digit(time[3]) && digit(time[4]) && digit(time[6]) &&
+        digit(time[7]) && twoDigits(time, 0) <= 23 &&
+        twoDigits(time, 3) <= 59 && twoDigits(time, 6) <= 59;
+    if (month.size() != 3 || mon == std::string_view::npos || mon % 3 != 0 ||
+        mday < 1 || mday > 31 || !timeOk) {
+        return toSeconds(std::string(month) + " " + std::string(day) + " " +
+                         std::string(time), year);
+    }
+    // The seconds at the start of each day of the year being cached.
+    // The cache is per thread, so no locking is needed.
+    static thread_local int cachedYear = 0;
+    static thread_local long dayStart[12][32];
+    if (cachedYear != year) {
+        std::fill(&dayStart[0][0], &dayStart[0][0] + 12 * 32, -1);
+        cachedYear = year;
+    }
+    long& start = dayStart[mon / 3][mday];
+    if (start == -1) {
+        struct tm tstamp = { .tm_year = year - 1900 };
+        tstamp.tm_mon = mon / 3;
+        tstamp.tm_mday = mday;
+        start = mktime(&tstamp);
+    }
+    return start + twoDigits(time, 0) * 3600L + twoDigits(time, 3) * 60 +
+        twoDigits(time, 6);
+}
 
 /**
- * Helper method to detect hacking due to a login time violation.
- * Specifically, this method detects if there are over 3 login attempts
- * by a single user ID within a 20 second period.
+ * Helper method to split a line into fields separated by white space,
+ * just as operator>> would.
  *
- * @param loginTimes Unordered map containing login time records for each user.
- *   authorizedUsers Unordered map containing authorizedUser IDs to be
- *                   referenced.
- *            userID User ID to be checked for a login time violation.
+ * \param[in] line The line to be split.
  *
- * @return True if there is a violation. False if not.
+ * \param[out] fields The fields, which refer to the characters in line.
+ *
+ * \param[in] maxFields The maximum number of fields to be found.
+ *
+ * \return The number of fields found.
  */
-bool isLoginTimeViolation(LoginTimes& loginTimes,
-    const LookupMap& authorizedUsers, const std::string& userID) {
-    bool isViolation = false;
-    // First check if the user is authorized
-    if (authorizedUsers.find(userID) == authorizedUsers.end()) {
-        // If there are less than 4 login attempts by a user,
-        // there cannot be a violation.
-        if (loginTimes[userID].size() > 3) {
-            // If there are at least 4 login attempts within 20 seconds of
-            // each other, there is a violation (login times are listed 
-            // chronologically).
-            size_t i = loginTimes[userID].size() - 1;
-            if (loginTimes[userID][i] - loginTimes[userID][i - 3] <= 20) {
-                isViolation = true;
-            }
+size_t splitFields(const std::string_view line, std::string_view* fields,
+                   const size_t maxFields) {
+    auto space = [](const char c) { return c == ' ' || (c >= '\t' &&
+                                                        c <= '\r'); };
+    size_t count = 0;
+    for (size_t pos = 0; count < maxFields;) {
+        while (pos < line.size() && space(line[pos])) {
+            pos++;
+        }
+        if (pos == line.size()) {
+            break;
         }
+        const size_t start = pos;
+        while (pos < line.size() && !space(line[pos])) {
+            pos++;
+        }
+        fields[count++] = line.substr(start, pos - start);
     }
-    return isViolation;
+    return count;
 }
 
+
 /**
- * Helper method to populate an unordered map with the login time
- * records for each user ID.
- * 
+ * Helper method to record a login attempt and detect hacking due to a
+ * login time violation, i.e., too many login attempts by a single user
+ * ID within a short period (see LoginRule).  The user's entry is found
+ * (or created) with a single hash lookup.
+ *
  * @param month, day, time, userID Strings containing the month,
- *        day, and time of the login, as well as the userID      
+ *        day, and time of the login, as well as the userID
  *        associated with the login attempt.
- *        loginTimes Reference to the unordered map to be populated.
+ *        loginTimes Unordered map containing the recent login times of
+ *                   each user.
+ *        lists The watchlists with the authorized users.
+ *        rule The rule that login attempts are checked against.
+ *
+ * @return True if there is a violation. False if not.
  */
-void processLoginTime(const std::string& month, const std::string& day,
-    const std::string& time, const std::string& userID,
-    LoginTimes& loginTimes) {
-    std::string timeStamp = month + " " + day + " " + time;
-    // Link each userID (key) to a vector containing times of attempted
-    // login (value).
-    long seconds = toSeconds(timeStamp);
-    if (loginTimes.find(userID) == loginTimes.end()) {
-        std::vector<long> vec = {seconds};
-        loginTimes[userID] = vec;
-    } else {
-        loginTimes[userID].push_back(seconds);
-    }
+bool processLoginTime(const std::string_view month,
+    const std::string_view day, const std::string_view time,
+    const std::string& userID, LoginTimes& loginTimes,
+    const Watchlists& lists, const LoginRule& rule) {
+    const long seconds = toSeconds(month, day, time);
+    LoginWindow& window = loginTimes[userID];
+    window.update(lists.authorizedUsers, lists.generation, userID, rule);
+    return window.add(seconds, rule);
 }
+
 /**
  * Process login data obtained from a web-server and detect possible
- * hacking attempts due to login by a banned IP address or 
- * excessive login frequency from a single unauthorized user.
- * 
- * \param[in]   is The input stream from where the data is to
- *                 be read.
- *       bannedIPS Unordered map containing banned IP addresses to be
- *                 referenced.
- * authorizedUsers Unordered map containing authorizedUser IDs to be
- *                 referenced
- * 
- * Print the results of the hack detection
+ * hacking attempts due to login by a banned IP address or
+ * excessive login frequency from a single unauthorized user.  The data
+ * is processed line by line as it is downloaded, in blocks of any size.
  */
-void processData(std::istream& is, const LookupMap& bannedIPs,
-    const LookupMap& authorizedUsers) {
-    std::string line, month, day, time, userID, ip, dummy;
-    int lineCount = 0, hackCount = 0;
-    LoginTimes loginTimes;
-    // Read input from data stream
-    while (std::getline(is, line)) {
-        // Keep track of only the important elements of each line (month, day,
-        // time, userID, and IP).
-        std::istringstream(line) >> month >> day >> time >> dummy >> dummy
-            >> dummy >> dummy >> dummy >> userID >> dummy >> ip;
+class LogProcessor {
+public:
+    /**
+     * \param[in] loader Loads (and reloads) the banned IPs and
+     * authorized users to be referenced.
+     *
+     * \param[in] rule The rule used to detect hacking due to frequency.
+     */
+    LogProcessor(WatchlistLoader& loader, const LoginRule& rule) :
+        loader(loader), rule(rule) {}
+
+    /**
+     * Process a block of the data.  A line that is split between 2
+     * blocks is processed once the rest of it has been added.
+     *
+     * \param[in] data The data to be processed.
+     *
+     * \param[in] len The number of bytes of data.
+     */
+    void addData(const char* data, const size_t len) {
+        loader.reloadIfChanged();
+        lists = loader.get();
+        const char* const end = data + len;
+        for (const char* nl; (nl = std::find(data, end, '\n')) != end;
+             data = nl + 1) {
+            if (partial.empty()) {
+                processLine(std::string_view(data, nl - data));
+            } else {
+                partial.append(data, nl);
+                processLine(partial);
+                partial.clear();
+            }
+        }
+        partial.append(data, end);
+    }
+
+    /**
+     * Process the last line (if it does not end with a newline) and
+     * print the results of the hack detection.
+     */
+    void finish() {
+        if (!partial.empty()) {
+            processLine(partial);
+            partial.clear();
+        }
+        summarize();
+    }
+
+    /** Print the results of the hack detection. */
+    void summarize() const {
+        std::cout << "Processed " << lineCount << " lines. Found "
+            << hackCount << " possible hacking attempts." << '\n';
+    }
+
+    /**
+     * \return The number of bytes at the end of the data added so far
+     * that form a line which has not been processed yet (because it does
+     * not end with a newline).
+     */
+    size_t pendingSize() const { return partial.size(); }
+
+    /** Drop the unprocessed line (e.g. when a log is truncated). */
+    void discardPending() { partial.clear(); }
+
+    /**
+     * Save the state that carries over from 1 line to the next (i.e.,
+     * the last fields and the recent login times of each user), so that
+     * a later run can continue where this one stopped.  User IDs are
+     * quoted, since a user ID may be empty.
+     *
+     * \param[out] os The stream to write the state to.
+     */
+    void save(std::ostream& os) const {
+        for (const std::string* field : {&month, &day, &time, &userID, &ip}) {
+            os << "field " << *field << '\n';
+        }
+        os << "users " << loginTimes.size() << '\n';
+        for (const auto& [user, window] : loginTimes) {
+            const std::vector<long> recent = window.recent();
+            os << std::quoted(user) << ' ' << recent.size();
+            for (const long t : recent) {
+                os << ' ' << t;
+            }
+            os << '\n';
+        }
+    }
+
+    /**
+     * Restore the state saved (by save) in an earlier run.  The state
+     * is left unchanged if it cannot be read completely, or if a user
+     * has more login times than the rule keeps (so the file was not
+     * saved with this rule, or is corrupt).
+     *
+     * \param[in] is The stream to read the state from.
+     *
+     * \return True if the state was restored.
+     */
+    bool load(std::istream& is) {
+        std::string fields[5];
+        for (std::string& field : fields) {
+            if (!std::getline(is, field) || field.compare(0, 6, "field ")) {
+                return false;
+            }
+            field.erase(0, 6);
+        }
+        std::string tag;
+        size_t users = 0;
+        if (!(is >> tag >> users) || tag != "users") {
+            return false;
+        }
+        LoginTimes restored;
+        for (size_t u = 0; u < users; u++) {
+            std::string user;
+            size_t count = 0;
+            if (!(is >> std::quoted(user) >> count) ||
+                count > rule.maxAttempts + 1) {
+                return false;
+            }
+            std::vector<long> recent(count);
+            for (long& t : recent) {
+                is >> t;
+            }
+            if (!is) {
+                return false;
+            }
+            restored[user].restore(recent, rule);
+        }
+        std::string* targets[] = {&month, &day, &time, &userID, &ip};
+        for (size_t i = 0; i < std::size(targets); i++) {
+            targets[i]->swap(fields[i]);
+        }
+        loginTimes.swap(restored);
+        return true;
+    }
+
+private:
+    /**
+     * Check 1 line of the data for hacking attempts.
+     *
+     * \param[in] line The line to be checked (without the newline).
+     */
+    void processLine(const std::string_view line) {
+        // Keep track of only the important elements of each line (month,
+        // day, time, userID, and IP).
+        std::string* const targets[] = {&month, &day, &time, nullptr,
+            nullptr, nullptr, nullptr, nullptr, &userID, nullptr, &ip};
+        std::string_view fields[std::size(targets)];
+        const size_t numFields = splitFields(line, fields,
+                                             std::size(targets));
+        for (size_t i = 0; i < numFields; i++) {
+            if (targets[i] != nullptr) {
+                targets[i]->assign(fields[i]);
+            }
+        }
         // Check for hacking attempts from banned IP addresses.
-        if (bannedIPs.find(ip) != bannedIPs.end()) {
+        if (lists->bannedIPs.contains(ip)) {
             hackCount++;
             std::cout << "Hacking due to banned IP. Line: " << line << '\n';
         } else {
-            // Populate unordered map containing login time information
-            processLoginTime(month, day, time, userID, loginTimes);
-            // Check for hacking attempts due to login time violations
-            if (isLoginTimeViolation(loginTimes, authorizedUsers, userID)) {
+            // Record the login time and check for hacking attempts due
+            // to login time violations
+            if (processLoginTime(month, day, time, userID, loginTimes,
+                                 *lists, rule)) {
                 hackCount++;
-                std::cout << "Hacking due to frequency. Line: " << line << '\n';
+                std::cout << "Hacking due to frequency. Line: " << line
+                    << '\n';
             }
         }
         // Keep track of the number of lines processed
         lineCount++;
     }
-    std::cout << "Processed " << lineCount << " lines. Found " << hackCount
-        << " possible hacking attempts." << '\n';
-}
+
+    WatchlistLoader& loader;
+    // The watchlists that the lines are checked against
+    std::shared_ptr<const Watchlists> lists = loader.get();
+    const LoginRule rule;
+    LoginTimes loginTimes;
+    // The fields of the current line.  As with operator>>, a field
+    // keeps its previous value if a line is too short to have it.
+    std::string month, day, time, userID, ip;
+    // The start of a line that continues in the next block
+    std::string partial;
+    int lineCount = 0, hackCount = 0;
+};
 
 /**
- * Helper method to break down a URL into hostname, port and path.
- *
- * @param url A string containing a valid URL. The port number in URL
- * is always optional.  The default port number is assumed to be 80.
- *
- * @return This method returns a std::tuple with 3 strings. The 3
- * strings are in the order: hostname, port, and path.
+ * A parallel version of LogProcessor that produces exactly the same
+ * output.  The data is cut into chunks of whole lines that are split
+ * into fields by a pool of threads.  The login checks are then sharded
+ * by the hash of the user ID: each shard has its own LoginTimes and
+ * runs on its own strand, and gets the chunks in their original order,
+ * so every user's login attempts are still checked in order.  The
+ * report lines of each chunk are printed (in order) once all of the
+ * shards are done with it.
  */
-std::tuple<std::string, std::string, std::string>
-breakDownURL(const std::string& url) {
-    // The values to be returned.
-    std::string hostName, port = "80", path = "/";
-
-    // Extract the substrings from the given url into the above
-    // variables.
-    std::size_t start = url.find("//") + 2;
-    std::size_t end;
-    hostName = url.substr(start);
-    if (hostName.find(':') != std::string::npos) {
-        end = hostName.find(':');
-        port = hostName.substr(end + 1);
-        port = port.substr(0, port.find('/'));
-    } else {
-        end = hostName.find('/');
+class ParallelLogProcessor {
+public:
+    /** The approximate size of the chunks of data. */
+    static constexpr size_t ChunkSize = 1024 * 1024;
+
+    /**
+     * \param[in] loader Loads (and reloads) the banned IPs and
+     * authorized users to be referenced.
+     *
+     * \param[in] rule The rule used to detect hacking due to frequency.
+     *
+     * \param[in] threads The number of threads to use.
+     */
+    ParallelLogProcessor(WatchlistLoader& loader, const LoginRule& rule,
+                         const size_t threads) :
+        loader(loader), rule(rule), pool(threads), shards(threads) {
+        for (auto& shard : shards) {
+            shard = std::make_unique<Shard>(pool.get_executor());
+        }
+    }
+
+    /**
+     * Add a block of the data.  If too many chunks are being processed
+     * this method waits for some of them to finish, so that the data
+     * does not pile up in memory.
+     *
+     * \param[in] data The data to be processed.
+     *
+     * \param[in] len The number of bytes of data.
+     */
+    void addData(const char* data, const size_t len) {
+        pending.append(data, len);
+        if (pending.size() >= ChunkSize) {
+            const size_t end = pending.rfind('\n');
+            if (end != std::string::npos) {
+                std::string rest(pending, end + 1);
+                pending.erase(end + 1);
+                submit(std::move(pending));
+                pending.swap(rest);
+            }
+        }
     }
-    path = hostName.substr(hostName.find('/'));
-    hostName = hostName.substr(0, end);
 
-    // Return 3-values encapsulated into 1-tuple.
-    return { hostName, port, path };
+    /**
+     * Process the rest of the data, wait for all of the chunks to be
+     * done, and print the results of the hack detection.
+     */
+    void finish() {
+        if (!pending.empty()) {
+            submit(std::move(pending));
+            pending.clear();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        chunkDone.wait(lock, [this] { return chunks.empty(); });
+        lock.unlock();
+        pool.join();
+        std::cout << "Processed " << lineCount << " lines. Found "
+            << hackCount << " possible hacking attempts." << '\n';
+    }
+
+private:
+    using Strand = boost::asio::strand<boost::asio::thread_pool::executor_type>;
+
+    // The fields of a line that are used.  A field that the line is
+    // too short to have refers to an earlier line, or has a null data()
+    // if it must be carried over from an earlier chunk.
+    enum Field { Month, Day, Time, UserID, IP, NumFields };
+
+    // 1 line of a chunk
+    struct Event {
+        std::string_view line;
+        std::string_view fields[NumFields];
+        // The shard that checks this line
+        size_t shard;
+    };
+
+    // What was found for a line
+    enum Result : uint8_t { NoHack, BannedIP, Frequency };
+
+    // A chunk of whole lines and the results of the checks
+    struct Chunk {
+        std::string data;
+        std::vector<Event> events;
+        std::vector<Result> results;
+        // The fields carried over from the chunks before this one
+        std::string carried[NumFields];
+        // The last value of each field in this chunk
+        std::string_view last[NumFields];
+        // The watchlists that the lines are checked against
+        std::shared_ptr<const Watchlists> lists;
+        bool parsed = false;
+        // The number of shards not done with this chunk
+        std::atomic<size_t> unfinished{0};
+    };
+
+    // The state of 1 shard of the users
+    struct Shard {
+        explicit Shard(const boost::asio::thread_pool::executor_type& ex) :
+            strand(ex) {}
+        Strand strand;
+        LoginTimes loginTimes;
+        // Reused to look up keys without allocating
+        std::string userID;
+    };
+
+    /**
+     * Queue a chunk of data to be split into lines and fields.
+     *
+     * \param[in] data The lines in the chunk.
+     */
+    void submit(std::string data) {
+        auto chunk = std::make_shared<Chunk>();
+        chunk->data = std::move(data);
+        loader.reloadIfChanged();
+        chunk->lists = loader.get();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            chunkDone.wait(lock, [this] {
+                return chunks.size() < 4 * shards.size(); });
+            chunks.push_back(chunk);
+        }
+        boost::asio::post(pool, [this, chunk] { parse(*chunk); });
+    }
+
+    /**
+     * Split the lines of a chunk into fields (on a thread of the pool).
+     *
+     * \param[in,out] chunk The chunk to be parsed.
+     */
+    void parse(Chunk& chunk) {
+        // The positions of the used fields in a line (see LogProcessor)
+        static constexpr int Targets[] = {Month, Day, Time, -1, -1, -1, -1,
+                                          -1, UserID, -1, IP};
+        std::string_view text = chunk.data;
+        while (!text.empty()) {
+            const size_t nl = std::min(text.find('\n'), text.size());
+            Event event{text.substr(0, nl), {}, shards.size()};
+            text.remove_prefix(std::min(nl + 1, text.size()));
+            std::string_view fields[std::size(Targets)];
+            const size_t numFields = splitFields(event.line, fields,
+                                                 std::size(Targets));
+            for (size_t i = 0; i < numFields; i++) {
+                if (Targets[i] != -1) {
+                    chunk.last[Targets[i]] = fields[i];
+                }
+            }
+            std::copy_n(chunk.last, NumFields, event.fields);
+            if (event.fields[UserID].data() != nullptr) {
+                event.shard = shardOf(event.fields[UserID]);
+            }
+            chunk.events.push_back(event);
+        }
+        chunk.results.resize(chunk.events.size(), NoHack);
+        std::unique_lock<std::mutex> lock(mutex);
+        chunk.parsed = true;
+        // Pass the chunks that are ready on to the shards, in order
+        for (; nextResolve < chunks.size() && chunks[nextResolve]->parsed;
+             nextResolve++) {
+            resolve(chunks[nextResolve]);
+        }
+    }
+
+    /**
+     * Fill in the fields that a chunk carries over from the chunks
+     * before it, and hand the chunk to all of the shards.  This method
+     * is called (with the mutex locked) for each chunk in order.
+     *
+     * \param[in] chunk The chunk whose earlier chunks are all resolved.
+     */
+    void resolve(const std::shared_ptr<Chunk>& chunk) {
+        for (int f = 0; f < NumFields; f++) {
+            chunk->carried[f] = carried[f];
+            if (chunk->last[f].data() != nullptr) {
+                carried[f] = chunk->last[f];
+            }
+        }
+        for (Event& event : chunk->events) {
+            if (event.shard != shards.size()) {
+                break;  // The rest of the chunk has its own user IDs
+            }
+            event.shard = shardOf(chunk->carried[UserID]);
+        }
+        chunk->unfinished = shards.size();
+        for (size_t s = 0; s < shards.size(); s++) {
+            boost::asio::post(shards[s]->strand, [this, chunk, s] {
+                check(*chunk, s); });
+        }
+    }
+
+    /**
+     * Check the lines of a chunk that belong to a shard for hacking
+     * attempts (on the shard's strand).
+     *
+     * \param[in,out] chunk The chunk to be checked.
+     *
+     * \param[in] s The index of the shard.
+     */
+    void check(Chunk& chunk, const size_t s) {
+        Shard& shard = *shards[s];
+        for (size_t i = 0; i < chunk.events.size(); i++) {
+            const Event& event = chunk.events[i];
+            if (event.shard != s) {
+                continue;
+            }
+            auto field = [&](const Field f) {
+                return event.fields[f].data() != nullptr ? event.fields[f] :
+                    std::string_view(chunk.carried[f]);
+            };
+            if (chunk.lists->bannedIPs.contains(field(IP))) {
+                chunk.results[i] = BannedIP;
+            } else {
+                shard.userID.assign(field(UserID));
+                if (processLoginTime(field(Month), field(Day), field(Time),
+                                     shard.userID, shard.loginTimes,
+                                     *chunk.lists, rule)) {
+                    chunk.results[i] = Frequency;
+                }
+            }
+        }
+        if (--chunk.unfinished == 0) {
+            report();
+        }
+    }
+
+    /**
+     * Print the report lines of the chunks that all of the shards are
+     * done with, in order, and release them.
+     */
+    void report() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (; !chunks.empty() && nextResolve > 0 &&
+                 chunks.front()->unfinished == 0; nextResolve--) {
+            const Chunk& chunk = *chunks.front();
+            for (size_t i = 0; i < chunk.events.size(); i++) {
+                if (chunk.results[i] == BannedIP) {
+                    hackCount++;
+                    std::cout << "Hacking due to banned IP. Line: "
+                              << chunk.events[i].line << '\n';
+                } else if (chunk.results[i] == Frequency) {
+                    hackCount++;
+                    std::cout << "Hacking due to frequency. Line: "
+                              << chunk.events[i].line << '\n';
+                }
+            }
+            lineCount += chunk.events.size();
+            chunks.pop_front();
+        }
+        lock.unlock();
+        chunkDone.notify_all();
+    }
+
+    /** \return The index of the shard that checks a user's logins. */
+    size_t shardOf(const std::string_view userID) const {
+        return std::hash<std::string_view>()(userID) % shards.size();
+    }
+
+    WatchlistLoader& loader;
+    const LoginRule rule;
+    boost::asio::thread_pool pool;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // Data that has not been cut into a chunk yet
+    std::string pending;
+    // Mutex guarding the values below
+    std::mutex mutex;
+    std::condition_variable chunkDone;
+    // The chunks not yet reported, in order, and the index (in chunks)
+    // of the first one not yet resolved
+    std::deque<std::shared_ptr<Chunk>> chunks;
+    size_t nextResolve = 0;
+    // The last value of each field in the chunks resolved so far
+    std::string carried[NumFields];
+    long lineCount = 0, hackCount = 0;
+};
+
+/**
+ * Helper method that downloads the file from the URL (using an
+ * HTTPFetcher) and processes the data as it arrives.
+ *
+ * @param url A string containing a valid URL.
+ *
+ * @param args The arguments for the Processor (after the loader).
+ */
+template <typename Processor, typename... Args>
+void fetchAndProcess(const std::string& url, const Args&... args) {
+    boost::asio::io_context io;
+    HTTPFetcher fetcher(io);
+    std::unique_ptr<WatchlistLoader> loader;
+    std::unique_ptr<Processor> processor;
+    // Load banned IP and authorized user data once the response is
+    // known to be good.
+    auto makeProcessor = [&] {
+        if (processor == nullptr) {
+            loader = std::make_unique<WatchlistLoader>("banned_ips.txt",
+                                                       "authorized_users.txt");
+            processor = std::make_unique<Processor>(*loader, args...);
+        }
+    };
+    fetcher.fetch(url,
+        [&](const char* data, const size_t len) {
+            makeProcessor();
+            processor->addData(data, len);
+        },
+        [&](const boost::system::error_code& ec,
+            const HTTPFetcher::Response& resp) {
+            // Only a 200 OK response indicates that the data is good.
+            if (!ec && resp.status == 200) {
+                makeProcessor();
+                processor->finish();
+            }
+        });
+    io.run();
 }
 
  /**
-  * Helper method that uses the breakDownURL method to obtain the host, port,
-  * and path of the data file to be processed. It then creates a GET request
-  * to download the file from the URL, and performs the initial steps of
-  * processing the data stream. Ultimately calls helper method to process data.
+  * Helper method that downloads the file from the URL and processes
+  * it, using 1 thread or a pool of threads.
   *
   * @param url A string containing a valid URL.
-  * 
+  *
+  * @param rule The rule used to detect hacking due to frequency.
+  *
+  * @param threads The number of threads used to process the data.
   */
-void serveClient(const std::string& url) {
-    std::string hostname, port, path;
-    // Extract URL components
-    std::tie(hostname, port, path) = breakDownURL(url);
-    // Start the download of the file (that the user wants to be
-    // processed) at the specified URL.
-    boost::asio::ip::tcp::iostream data(hostname, port);
-    data << "GET " << path << " HTTP/1.1\r\n"
-        << "Host: " << hostname << "\r\n"
-        << "Connection: Close\r\n\r\n";
-    // Get the first HTTP response line and ensure it has 200 OK in it
-    // to indicate that the data stream is good.
-    std::string line;
-    std::getline(data, line);
-    if (line.find("200 OK") == std::string::npos) {
+void serveClient(const std::string& url, const LoginRule& rule,
+                 const size_t threads) {
+    if (threads > 1) {
+        fetchAndProcess<ParallelLogProcessor>(url, rule, threads);
+    } else {
+        fetchAndProcess<LogProcessor>(url, rule);
+    }
+}
+
+// Set by the signal handler to stop following a log
+volatile std::sig_atomic_t stopFollowing = 0;
+
+/**
+ * Where an incremental scan of a log continues from: the byte offset
+ * just after the last complete line that was processed (and, for a
+ * local file, the inode of the file), along with the state of the
+ * LogProcessor.  It is saved to a checkpoint file after every scan.
+ */
+struct Checkpoint {
+    // The checkpoint file ("" if the state is not saved)
+    std::string file;
+    // The URL or path of the log
+    std::string source;
+    uint64_t offset = 0, inode = 0;
+};
+
+/**
+ * Load a checkpoint file, if it exists and is for the same log.
+ *
+ * \param[in,out] cp The checkpoint with the file and source set.  The
+ * offset and inode are loaded.
+ *
+ * \param[out] processor The processor whose state is restored.
+ */
+void loadCheckpoint(Checkpoint& cp, LogProcessor& processor) {
+    std::ifstream is(cp.file);
+    if (!is.good()) {
+        return;  // First run
+    }
+    std::string magic, tag, source;
+    std::getline(is, magic);
+    is >> tag >> source >> tag >> cp.inode >> tag >> cp.offset;
+    is.ignore(1);
+    if (magic != "LoginSentry checkpoint 2" || source != cp.source ||
+        !processor.load(is)) {
+        std::cerr << "Ignoring checkpoint " << cp.file << std::endl;
+        cp.offset = cp.inode = 0;
+    }
+}
+
+/**
+ * Save a checkpoint file.  The file is replaced atomically, so a crash
+ * while saving leaves the previous checkpoint behind.
+ *
+ * \param[in] cp The checkpoint to be saved.
+ *
+ * \param[in] processor The processor whose state is saved.
+ */
+void saveCheckpoint(const Checkpoint& cp, const LogProcessor& processor) {
+    if (cp.file.empty()) {
         return;
     }
-    // Skip over HTTP response headers.
-    for (std::string hdr; std::getline(data, hdr) && !hdr.empty()
-            && hdr != "\r";) {
+    const std::string tmpFile = cp.file + ".tmp";
+    {
+        std::ofstream os(tmpFile);
+        os << "LoginSentry checkpoint 2\n" << "source " << cp.source
+           << "\ninode " << cp.inode << "\noffset " << cp.offset << '\n';
+        processor.save(os);
     }
-    // Load banned IP and authorized user data into two unordered maps.
-    LookupMap bannedIPs = loadLookup("banned_ips.txt");
-    LookupMap authorizedUsers = loadLookup("authorized_users.txt");
-    // Process data from the file to detect possible hacking attempts.
-    processData(data, bannedIPs, authorizedUsers);
+    std::rename(tmpFile.c_str(), cp.file.c_str());
+}
+
+/**
+ * Incrementally scan a log served over HTTP.  Only the bytes after the
+ * checkpoint are requested (with a Range request); if the server
+ * ignores the range, the bytes already processed are skipped.  If the
+ * log has become shorter than the checkpoint (e.g. it was rotated) it
+ * is scanned from the start.
+ *
+ * \param[in] url The URL of the log.
+ *
+ * \param[in,out] cp The checkpoint to continue from.
+ *
+ * \param[in,out] processor The processor for the new lines.
+ *
+ * \param[in] follow If true, poll the log for new lines (a few times a
+ * second) until a signal stops the program.
+ */
+void followURL(const std::string& url, Checkpoint& cp,
+               LogProcessor& processor, const bool follow) {
+    boost::asio::io_context io;
+    HTTPFetcher fetcher(io);
+    boost::asio::steady_timer timer(io);
+    // The offset of the next byte of the log to be requested
+    uint64_t received = cp.offset;
+    auto restart = [&] {
+        received = 0;
+        processor.discardPending();
+    };
+    std::function<void()> poll = [&] {
+        HTTPFetcher::Request request;
+        request.url = url;
+        request.rangeStart = received;
+        auto skip = std::make_shared<uint64_t>(0);
+        request.onHeaders = [&, skip](const HTTPFetcher::Response& resp) {
+            const std::string length = resp.header("Content-Length");
+            if (resp.status != 200) {
+                return;
+            } else if (!length.empty() &&
+                       std::strtoull(length.c_str(), nullptr, 10) < received) {
+                restart();
+            } else {
+                *skip = received;  // The range was ignored
+            }
+        };
+        request.onData = [&, skip](const char* data, const size_t len) {
+            const size_t skipped = std::min<uint64_t>(*skip, len);
+            *skip -= skipped;
+            processor.addData(data + skipped, len - skipped);
+            received += len - skipped;
+        };
+        request.onDone = [&](const boost::system::error_code& ec,
+                             const HTTPFetcher::Response& resp) {
+            // "416 Range Not Satisfiable" means there is nothing new,
+            // unless the log is now shorter than what was processed.
+            const std::string range = resp.header("Content-Range");
+            if (!ec && resp.status == 416 && range.find('/') !=
+                std::string::npos && std::strtoull(range.c_str() +
+                    range.find('/') + 1, nullptr, 10) < received) {
+                // Rescan the log from the start now, even if not
+                // following it
+                restart();
+                return poll();
+            }
+            cp.offset = received - processor.pendingSize();
+            saveCheckpoint(cp, processor);
+            std::cout.flush();
+            if (follow && !stopFollowing) {
+                timer.expires_after(std::chrono::milliseconds(250));
+                timer.async_wait([&](const boost::system::error_code&) {
+                    poll(); });
+            }
+        };
+        fetcher.fetch(std::move(request));
+    };
+    poll();
+    io.run();
+}
+
+/**
+ * Incrementally scan a local log file.  The bytes after the checkpoint
+ * are memory-mapped and processed.  When following, inotify wakes the
+ * scan up as soon as the file changes.  If the file is replaced (e.g.
+ * rotated) the rest of the old file is processed and then the new file
+ * is scanned from the start; if it is truncated it is scanned from the
+ * start.
+ *
+ * \param[in] path The path to the log.
+ *
+ * \param[in,out] cp The checkpoint to continue from.
+ *
+ * \param[in,out] processor The processor for the new lines.
+ *
+ * \param[in] follow If true, keep watching the log for new lines until
+ * a signal stops the program.
+ */
+void followFile(const std::string& path, Checkpoint& cp,
+                LogProcessor& processor, const bool follow) {
+    const int watcher = follow ? inotify_init1(IN_CLOEXEC | IN_NONBLOCK) :
+        -1;
+    int fd = -1, watch = -1;
+    // The offset of the next byte of the log to be processed
+    uint64_t offset = cp.offset;
+    // Process the bytes added to the open file since the last scan
+    auto scan = [&] {
+        struct stat info;
+        if (fd == -1 || fstat(fd, &info) != 0) {
+            return;
+        }
+        const uint64_t size = info.st_size;
+        if (size < offset) {
+            offset = 0;
+            processor.discardPending();
+        }
+        if (size > offset) {
+            const uint64_t start = offset - offset % sysconf(_SC_PAGESIZE);
+            void* addr = mmap(nullptr, size - start, PROT_READ, MAP_PRIVATE,
+                              fd, start);
+            if (addr == MAP_FAILED) {
+                return;
+            }
+            processor.addData(static_cast<const char*>(addr) + offset -
+                              start, size - offset);
+            munmap(addr, size - start);
+            offset = size;
+        }
+        cp.offset = offset - processor.pendingSize();
+        saveCheckpoint(cp, processor);
+        std::cout.flush();
+    };
+    do {
+        // (Re)open the log when it is first seen or has been replaced
+        struct stat info;
+        if (::stat(path.c_str(), &info) == 0 && (fd == -1 ||
+                                                 info.st_ino != cp.inode)) {
+            scan();
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (info.st_ino != cp.inode) {
+                offset = 0;
+                processor.discardPending();
+                cp.inode = info.st_ino;
+            }
+            if (watcher != -1) {
+                inotify_rm_watch(watcher, watch);
+                watch = inotify_add_watch(watcher, path.c_str(), IN_MODIFY |
+                    IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+            }
+        }
+        scan();
+        if (watcher != -1 && !stopFollowing) {
+            // Wait for the file to change (or check for a new file a
+            // few times a second) and drain the events
+            pollfd pfd = {watcher, POLLIN, 0};
+            ::poll(&pfd, 1, 250);
+            char events[4096];
+            while (read(watcher, events, sizeof(events)) > 0) {}
+        }
+    } while (follow && !stopFollowing);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (watcher != -1) {
+        close(watcher);
+    }
+}
+
+/**
+ * Incrementally scan (and optionally follow) a log, continuing from a
+ * checkpoint.  Only complete lines are processed; a line that does not
+ * end with a newline yet is left for the next scan.
+ *
+ * \param[in] source The URL of the log, or the path of a local file.
+ *
+ * \param[in] rule The rule used to detect hacking due to frequency.
+ *
+ * \param[in] checkpointFile The checkpoint file ("" for none).
+ *
+ * \param[in] follow If true, keep watching the log for new lines.
+ */
+void scanIncrementally(const std::string& source, const LoginRule& rule,
+                       const std::string& checkpointFile, const bool follow) {
+    WatchlistLoader loader("banned_ips.txt", "authorized_users.txt");
+    LogProcessor processor(loader, rule);
+    Checkpoint cp{checkpointFile, source};
+    if (!cp.file.empty()) {
+        loadCheckpoint(cp, processor);
+    }
+    if (follow) {
+        auto stop = [](int) { stopFollowing = 1; };
+        std::signal(SIGINT, stop);
+        std::signal(SIGTERM, stop);
+    }
+    if (source.compare(0, 7, "http://") == 0) {
+        followURL(source, cp, processor, follow);
+    } else {
+        followFile(source.compare(0, 7, "file://") == 0 ? source.substr(7) :
+                   source, cp, processor, follow);
+    }
+    processor.summarize();
 }
 
 /**
@@ -268,18 +1449,63 @@ void serveClient(const std::string& url) {
  * log entries from the given URL and detecting potential hacking attempts.
  *
  * \param[in] argc The number of command-line arguments.  This program
- * requires exactly one command-line argument.
+ * requires one to three command-line arguments (after the options).
  *
- * \param[in] argv The actual command-line argument. This should be an URL.
+ * \param[in] argv The actual command-line arguments. The first should be
+ * an URL.  The optional second and third are the number of login
+ * attempts permitted and the period (in seconds) that they are
+ * permitted in (3 and 20 by default, see LoginRule).  The options
+ * before the URL are:
+ *   --threads N        Process the data on N threads (or on all of the
+ *                      cores if N is 0).
+ *   --checkpoint FILE  Continue from (and save) the position in the
+ *                      log and the per-user state in FILE, so that
+ *                      each run processes only the new lines.
+ *   --follow           Keep watching the log for new lines until the
+ *                      program is interrupted.
+ * With --checkpoint or --follow the URL can also be the path of a local
+ * file, and the data is processed on 1 thread.
  */
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    size_t threads = 1;
+    std::string checkpointFile;
+    bool follow = false;
+    while (argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0) {
+        const std::string opt = argv[1];
+        if (opt == "--follow") {
+            follow = true;
+        } else if (opt == "--threads" && argc > 2) {
+            threads = std::stoul(argv[2]);
+            if (threads == 0) {
+                threads = std::max(std::thread::hardware_concurrency(), 1u);
+            }
+        } else if (opt == "--checkpoint" && argc > 2) {
+            checkpointFile = argv[2];
+        } else {
+            break;
+        }
+        const int used = (opt == "--follow") ? 1 : 2;
+        argv += used;
+        argc -= used;
+    }
+    if (argc < 2 || argc > 4) {
         std::cout << "URL not specified. See video on setting command-line "
                   << "arguments in NetBeans on Canvas.\n";
         return 1;
     }
     const std::string url = argv[1];
+    LoginRule rule;
+    if (argc > 2) {
+        rule.maxAttempts = std::stoul(argv[2]);
+    }
+    if (argc > 3) {
+        rule.window = std::stol(argv[3]);
+    }
+    if (follow || !checkpointFile.empty()) {
+        scanIncrementally(url, rule, checkpointFile, follow);
+        return 0;
+    }
     // Download file with login records from url and call helper methods to
     // process data.
-    serveClient(url);
+    serveClient(url, rule, threads);
 }
@@ -4,8 +4,19 @@
  * A simple online stock exchange web-server.  
  * 
  * This multithreaded web-server performs simple stock trading
- * transactions. Stocks are maintained in an
- * unordered_map.
+ * transactions. Stocks are maintained in a
+ * sharded directory of unordered_maps.
+ *
+ * Clients can be served either by a fixed pool of threads running
+ * blocking I/O (runServer), or by an asynchronous engine running on a
+ * small number of io_context threads (runAsyncServer).
+ *
+ * Optionally (see enableDurability, or set STOCK_LOG_DIR to a directory)
+ * stock balances survive restarts via a write-ahead transaction log
+ * with group commit and periodic binary snapshots.
+ *
+ * A GET of "/metrics" reports request counts, buyer wait times, lock
+ * hold times and accept-queue wait times (see Metrics).
  *
  */
 
@@ -15,11 +26,35 @@
 #include <sstream>
 #include <thread>
 #include <memory>
+#include <string_view>
 #include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
 #include <iomanip>
 #include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <charconv>
+#include <condition_variable>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "Stock.h"
+#include "HTTPRequest.h"
 
 // Setup a server socket to accept connections on the socket
 using namespace boost::asio;
@@ -28,39 +63,784 @@ using namespace boost::asio::ip;
 // Shortcut to smart pointer with TcpStream
 using TcpStreamPtr = std::shared_ptr<tcp::iostream>;
 
-// Prototype for helper method defined in main.cpp
-std::string url_decode(std::string);
-
 // unique_lock to help with multithreading
 using Lock = std::unique_lock<std::mutex>;
 
+/**
+ * An append-only, write-ahead log of the changes made to stocks.  Each
+ * record is identified by a log sequence number (LSN) and records the
+ * balance of a stock after a change (rather than the change itself),
+ * so replaying a record more than once is harmless.
+ *
+ * Records are appended to an in-memory buffer by the threads running
+ * transactions.  A dedicated flusher thread waits a short batch window
+ * after the first record of a batch arrives and then writes the whole
+ * batch with a single write and fdatasync (group commit).  A
+ * transaction calls waitDurable() to wait until its record is on disk
+ * before responding to the client, or whenDurable() to have the
+ * flusher call it back once the record is on disk.
+ *
+ * The log is split into segment files named "stocks.<first LSN>.wal",
+ * so that segments covered by a snapshot can simply be deleted.  Each
+ * record has the format [checksum:4][type:1][name length:2][balance:4]
+ * followed by the stock's name.
+ */
+class StockLog {
+public:
+    /** The types of records in the log. */
+    enum RecordType : uint8_t { CreateRecord = 1, BalanceRecord = 2,
+                                ResetRecord = 3 };
+
+    /** The size of the fixed part of a record before the stock name. */
+    static constexpr size_t HeaderSize = 11;
+
+    ~StockLog() {
+        if (!enabled) {
+            return;
+        }
+        // Stop the periodic task first, because it may still use the log
+        {
+            Lock lock(mutex);
+            stoppingTask = true;
+        }
+        taskCond.notify_one();
+        if (periodic.joinable()) {
+            periodic.join();
+        }
+        {
+            Lock lock(mutex);
+            stopping = true;
+        }
+        flushCond.notify_one();
+        flusher.join();
+        ::close(fd);
+    }
+
+    /**
+     * Start a new log segment and the flusher thread.  Until this
+     * method is called, append() does nothing and returns zero.
+     *
+     * \param[in] dir The directory in which the log segments are created.
+     *
+     * \param[in] firstLsn The LSN of the first record to be appended.
+     *
+     * \param[in] window How long the flusher waits after the first
+     * record of a batch, for more records to join the batch.
+     */
+    void open(const std::string& dir, const uint64_t firstLsn,
+              const std::chrono::microseconds window) {
+        this->dir = dir;
+        this->window = window;
+        lastLsn = durableLsn = firstLsn - 1;
+        openSegment(firstLsn);
+        flusher = std::thread([this] { flushMain(); });
+        enabled = true;
+    }
+
+    /**
+     * Add a record to the log.  The caller must hold the stock's mutex
+     * (or, for a reset, all of the directory's locks) so that the order
+     * of records in the log matches the order of the changes.
+     *
+     * \param[in] type The type of record.
+     *
+     * \param[in] name The name of the stock (empty for a reset).
+     *
+     * \param[in] balance The balance of the stock after the change.
+     *
+     * \return The LSN of the appended record, or zero if the log has
+     * not been opened.
+     */
+    uint64_t append(const RecordType type, const std::string& name,
+                    const unsigned int balance) {
+        if (!enabled) {
+            return 0;
+        }
+        char header[HeaderSize];
+        const uint16_t nameLen = static_cast<uint16_t>(
+            std::min<size_t>(name.size(), UINT16_MAX));
+        header[4] = type;
+        std::memcpy(header + 5, &nameLen, sizeof(nameLen));
+        std::memcpy(header + 7, &balance, sizeof(balance));
+        const uint32_t sum = checksum(header + 4, HeaderSize - 4,
+                                      name.data(), nameLen);
+        std::memcpy(header, &sum, sizeof(sum));
+        Lock lock(mutex);
+        const bool wasEmpty = pending.empty();
+        pending.append(header, HeaderSize).append(name.data(), nameLen);
+        const uint64_t lsn = ++lastLsn;
+        lock.unlock();
+        if (wasEmpty) {
+            flushCond.notify_one();  // First record of a new batch
+        }
+        return lsn;
+    }
+
+    /**
+     * Wait until a record (and all the records before it) have been
+     * written to disk.
+     *
+     * \param[in] lsn The LSN returned by append().  Zero returns
+     * immediately.
+     */
+    void waitDurable(const uint64_t lsn) {
+        if (lsn == 0) {
+            return;
+        }
+        Lock lock(mutex);
+        durableCond.wait(lock, [this, lsn] { return durableLsn >= lsn; });
+    }
+
+    /**
+     * Call a function once a record (and all the records before it)
+     * have been written to disk, without waiting for it.
+     *
+     * \param[in] lsn The LSN returned by append().
+     *
+     * \param[in] callback The function to be called.  It is called
+     * right away (by the calling thread) if lsn is zero or the record is
+     * already on disk, and otherwise by the flusher thread, so it must
+     * not block.
+     */
+    void whenDurable(const uint64_t lsn, std::function<void()> callback) {
+        Lock lock(mutex);
+        if (lsn == 0 || durableLsn >= lsn) {
+            lock.unlock();
+            callback();
+        } else {
+            callbacks.emplace(lsn, std::move(callback));
+        }
+    }
+
+    /**
+     * Start a thread that calls a task every interval (e.g. to write a
+     * snapshot) until the log is destroyed.  The log is only destroyed
+     * after the thread has stopped, so the task may use the log.
+     *
+     * \param[in] interval How long to wait before each call of task.
+     *
+     * \param[in] task The function to be called.
+     */
+    void startPeriodic(const std::chrono::seconds interval,
+                       std::function<void()> task) {
+        periodic = std::thread([this, interval, task] {
+            Lock lock(mutex);
+            while (!taskCond.wait_for(lock, interval,
+                                      [this] { return stoppingTask; })) {
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        });
+    }
+
+    /**
+     * Have the flusher start a new segment.  Every record with an LSN
+     * up to the returned value is in an older segment.
+     *
+     * \return The LSN of the last record before the new segment.
+     */
+    uint64_t rotate() {
+        Lock lock(mutex);
+        rotateRequested = true;
+        flushCond.notify_one();
+        durableCond.wait(lock, [this] { return !rotateRequested; });
+        return segmentStart - 1;
+    }
+
+    /** \return True if open() has been called. */
+    bool isOpen() const { return enabled; }
+
+    /** \return The LSN of the last record appended to the log. */
+    uint64_t lastAppended() const {
+        Lock lock(mutex);
+        return lastLsn;
+    }
+
+    /** \return The directory in which the log segments are created. */
+    const std::string& getDir() const { return dir; }
+
+    /**
+     * Compute the checksum stored with each record.  This is the FNV-1a
+     * hash of the record (excluding the checksum) and the stock name.
+     */
+    static uint32_t checksum(const char* header, const size_t headerLen,
+                             const char* name, const size_t nameLen) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < headerLen + nameLen; i++) {
+            hash ^= static_cast<uint8_t>(i < headerLen ? header[i] :
+                                         name[i - headerLen]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    /** \return The path to the segment whose first LSN is given. */
+    static std::string segmentPath(const std::string& dir,
+                                   const uint64_t firstLsn) {
+        char name[64];
+        snprintf(name, sizeof(name), "stocks.%020llu.wal",
+                 static_cast<unsigned long long>(firstLsn));
+        return dir + "/" + name;
+    }
+
+private:
+    /**
+     * Create a new segment file.  Only called before the flusher
+     * starts or from the flusher thread.
+     *
+     * \param[in] firstLsn The LSN of the first record in the segment.
+     */
+    void openSegment(const uint64_t firstLsn) {
+        const std::string path = segmentPath(dir, firstLsn);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Error opening log " + path);
+        }
+        segmentStart = firstLsn;
+    }
+
+    /**
+     * The method run by the flusher thread.  It writes out batches of
+     * records (and starts new segments when asked to) until the log is
+     * destroyed.
+     */
+    void flushMain() {
+        Lock lock(mutex);
+        while (true) {
+            flushCond.wait(lock, [this] {
+                return stopping || rotateRequested || !pending.empty(); });
+            if (!pending.empty()) {
+                // Give other transactions a chance to join this batch
+                flushCond.wait_for(lock, window, [this] { return stopping; });
+                std::string batch;
+                batch.swap(pending);
+                const uint64_t batchLsn = lastLsn;
+                lock.unlock();
+                writeBatch(batch);
+                lock.lock();
+                durableLsn = batchLsn;
+                durableCond.notify_all();
+                runCallbacks(lock);
+            }
+            if (rotateRequested) {
+                // Records still pending go into the new segment
+                ::close(fd);
+                openSegment(durableLsn + 1);
+                rotateRequested = false;
+                durableCond.notify_all();
+            }
+            if (stopping && pending.empty()) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * Call (and remove) the callbacks registered by whenDurable() for
+     * the records that are now on disk.  They are called without the
+     * mutex held.
+     *
+     * \param[in,out] lock The lock on the mutex, held on entry and exit.
+     */
+    void runCallbacks(Lock& lock) {
+        std::vector<std::function<void()>> ready;
+        const auto end = callbacks.upper_bound(durableLsn);
+        for (auto it = callbacks.begin(); it != end; ++it) {
+            ready.push_back(std::move(it->second));
+        }
+        callbacks.erase(callbacks.begin(), end);
+        lock.unlock();
+        for (const auto& callback : ready) {
+            callback();
+        }
+        lock.lock();
+    }
+
+    /**
+     * Write a batch of records to the current segment and make sure
+     * they are on disk.  The server cannot honor durability if this
+     * fails, so it is treated as a fatal error.
+     *
+     * \param[in] batch The encoded records to be written.
+     */
+    void writeBatch(const std::string& batch) {
+        for (size_t done = 0; done < batch.size();) {
+            const ssize_t n = ::write(fd, batch.data() + done,
+                                      batch.size() - done);
+            if (n < 0 && errno != EINTR) {
+                perror("Error writing stock log");
+                std::abort();
+            }
+            done += std::max<ssize_t>(n, 0);
+        }
+        if (::fdatasync(fd) != 0) {
+            perror("Error syncing stock log");
+            std::abort();
+        }
+    }
+
+    // Flag set once the log has been opened
+    std::atomic<bool> enabled{false};
+    // The directory holding the segments and the current segment's fd
+    std::string dir;
+    int fd = -1;
+    // How long the flusher waits for a batch to fill up
+    std::chrono::microseconds window{0};
+    // Mutex guarding all of the fields below
+    mutable std::mutex mutex;
+    // Signals the flusher, and the threads waiting for records to be
+    // written (or a segment to be rotated), respectively
+    std::condition_variable flushCond, durableCond;
+    // Records appended but not yet handed to the flusher
+    std::string pending;
+    // The last LSN appended, the last LSN written to disk, and the
+    // first LSN of the current segment
+    uint64_t lastLsn = 0, durableLsn = 0, segmentStart = 0;
+    // Flags used to ask the flusher to rotate segments or to stop
+    bool rotateRequested = false, stopping = false;
+    // The callbacks waiting for records to be written, by LSN
+    std::multimap<uint64_t, std::function<void()>> callbacks;
+    // The thread that writes records to disk
+    std::thread flusher;
+    // Signals the periodic task to stop, and the flag it waits for
+    std::condition_variable taskCond;
+    bool stoppingTask = false;
+    // The thread running the task passed to startPeriodic()
+    std::thread periodic;
+};
+
+/**
+ * Counters for the hot path of the server, reported by the /metrics
+ * request.  Every thread updates its own block of counters (with
+ * plain relaxed loads and stores rather than locks or atomic
+ * read-modify-writes), and the blocks are only added together when
+ * the counters are read, so counting never makes threads contend with
+ * each other.  When a thread exits, its counts are folded into a
+ * total kept for threads that have exited.
+ */
+class Metrics {
+public:
+    /** The counters that are kept. */
+    enum Counter {
+        ResetCount, CreateCount, BuyCount, SellCount, StatusCount,
+        BatchCount, BuyWaits, BuyWaitNanos, SpuriousWakeups,
+        AcceptedConnections, AcceptWaitNanos, NumCounters
+    };
+
+    /** The transactions counted by ResetCount through BatchCount. */
+    static constexpr const char* TransNames[] = {"reset", "create", "buy",
+                                                 "sell", "status", "batch"};
+
+    /**
+     * Add to one of the calling thread's counters.
+     *
+     * \param[in] counter The counter to be incremented.
+     *
+     * \param[in] value The value to be added to the counter.
+     */
+    static void add(const Counter counter, const uint64_t value = 1) {
+        std::atomic<uint64_t>& count = local().counts[counter];
+        count.store(count.load(std::memory_order_relaxed) + value,
+                    std::memory_order_relaxed);
+    }
+
+    /**
+     * \return The value of each counter, summed over all threads.
+     */
+    static std::vector<uint64_t> read() {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        std::vector<uint64_t> totals(reg.retired, reg.retired + NumCounters);
+        for (const Block* block : reg.blocks) {
+            for (int i = 0; i < NumCounters; i++) {
+                totals[i] += block->counts[i].load(std::memory_order_relaxed);
+            }
+        }
+        return totals;
+    }
+
+private:
+    // The counters of 1 thread, on their own cache lines
+    struct alignas(64) Block {
+        std::atomic<uint64_t> counts[NumCounters] = {};
+        Block();
+        ~Block();
+    };
+
+    // All of the blocks of the running threads and the totals of the
+    // threads that have exited.  The mutex is taken only when a thread
+    // starts or exits and when the counters are read.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<Block*> blocks;
+        uint64_t retired[NumCounters] = {};
+    };
+
+    /**
+     * \return The registry (never destroyed, so exiting threads can
+     * always use it).
+     */
+    static Registry& registry() {
+        static Registry* const reg = new Registry();
+        return *reg;
+    }
+
+    /** \return The calling thread's block of counters. */
+    static Block& local() {
+        thread_local Block block;
+        return block;
+    }
+};
+
+inline Metrics::Block::Block() {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.blocks.push_back(this);
+}
+
+inline Metrics::Block::~Block() {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (int i = 0; i < NumCounters; i++) {
+        reg.retired[i] += counts[i].load(std::memory_order_relaxed);
+    }
+    reg.blocks.erase(std::find(reg.blocks.begin(), reg.blocks.end(), this));
+}
+
+/**
+ * A "buy" transaction that is waiting for a stock's balance to become
+ * large enough.  Each waiter has its own conditional variable so that
+ * a "sell" can wake exactly the buyers that it can satisfy.  The seller
+ * takes the amount from the balance on the buyer's behalf before waking
+ * it, so no other buyer can take the stock in between.  A buyer that
+ * does not have a thread waiting for it (see AsyncSession) is woken
+ * by calling its onWake callback instead.
+ */
+struct BuyWaiter {
+    /**
+     * \param[in] amount The amount of stock the buyer wants.
+     *
+     * \param[in] onWake Optional callback to be called (instead of
+     * notifying cond) with the stock's mutex held when the buyer is
+     * woken.  It is passed the value of granted, and must not block.
+     */
+    explicit BuyWaiter(const unsigned int amount,
+                       std::function<void(bool)> onWake = nullptr) :
+        amount(amount), onWake(std::move(onWake)) {}
+
+    /**
+     * Wake the buyer.  The stock's mutex must be held.
+     *
+     * \param[in] granted True if the amount was handed to the buyer.
+     */
+    void wake(const bool granted) {
+        this->granted = granted;
+        notified = true;
+        if (onWake) {
+            onWake(granted);
+        } else {
+            cond.notify_one();
+        }
+    }
+
+    // The amount of stock the waiting buyer wants
+    const unsigned int amount;
+    // Callback used to wake a buyer without a waiting thread
+    const std::function<void(bool)> onWake;
+    // Set (with the stock's mutex held) when a seller wakes this buyer
+    bool notified = false;
+    // Set along with notified if the seller handed the amount to this
+    // buyer (rather than the stock being removed by a reset)
+    bool granted = false;
+    // Conditional variable the buyer sleeps on
+    std::condition_variable cond;
+};
+
+/**
+ * A Stock along with the queue of buyers waiting on it, in the order
+ * in which they started waiting.  The queue is protected by the
+ * stock's mutex.
+ */
+struct StockEntry : public Stock {
+    std::list<std::shared_ptr<BuyWaiter>> buyers;
+    // Copy of the balance that is updated (with the mutex held) each
+    // time the balance changes, so it can be read without the mutex.
+    std::atomic<unsigned int> published = ATOMIC_VAR_INIT(0);
+    // Set (with the mutex held) when the stock is removed by a reset
+    bool removed = false;
+    // The LSN of the last log record for this stock (with the mutex held)
+    uint64_t lastLsn = 0;
+    // The number of times the mutex was locked and the total time (in
+    // nanoseconds) it was held.  Updated by StockLock with the mutex
+    // held, so no other lock is needed; atomic only so /metrics can
+    // read them without the mutex.
+    std::atomic<uint64_t> lockCount{0}, holdNanos{0};
+
+    /**
+     * Change the balance of this stock.  The stock's mutex must be held.
+     *
+     * \param[in] newBalance The new balance for the stock.
+     */
+    void setBalance(const unsigned int newBalance) {
+        balance = newBalance;
+        published.store(newBalance, std::memory_order_release);
+    }
+};
+
+// Shortcut to a shared pointer to a stock entry.  Transactions hold on
+// to the entry via this pointer, so a concurrent reset cannot free an
+// entry that is still in use.
+using StockEntryPtr = std::shared_ptr<StockEntry>;
+
+/**
+ * A unique_lock on a stock's mutex that adds the time for which the
+ * mutex is held to the stock's lock statistics.  Time spent waiting on
+ * a condition variable (via wait) is not counted as holding the mutex.
+ */
+class StockLock {
+public:
+    // Clock used to measure how long the mutex is held
+    using Clock = std::chrono::steady_clock;
+
+    StockLock() = default;
+
+    /**
+     * Lock the mutex of a stock.
+     *
+     * \param[in,out] entry The stock whose mutex is to be locked.
+     */
+    explicit StockLock(StockEntry& entry) : entry(&entry),
+        lock(entry.mutex), acquired(Clock::now()) {}
+
+    StockLock(StockLock&& other) = default;
+
+    StockLock& operator=(StockLock&& other) {
+        unlock();
+        entry = other.entry;
+        lock = std::move(other.lock);
+        acquired = other.acquired;
+        return *this;
+    }
+
+    ~StockLock() { unlock(); }
+
+    /** Unlock the mutex (if it is locked) and record the hold time. */
+    void unlock() {
+        if (lock.owns_lock()) {
+            record();
+            lock.unlock();
+        }
+    }
+
+    /**
+     * Release the mutex and wait for a condition variable to be
+     * notified, reacquiring the mutex before returning.
+     *
+     * \param[in,out] cond The condition variable to wait on.
+     */
+    void wait(std::condition_variable& cond) {
+        record();
+        cond.wait(lock);
+        acquired = Clock::now();
+    }
+
+private:
+    /** Add the time since the mutex was acquired to the statistics. */
+    void record() {
+        const uint64_t nanos = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(Clock::now() - acquired).count();
+        entry->lockCount.store(entry->lockCount.load(
+            std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        entry->holdNanos.store(entry->holdNanos.load(
+            std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+    }
+
+    // The stock whose mutex is locked
+    StockEntry* entry = nullptr;
+    // The lock on the stock's mutex
+    Lock lock;
+    // When the mutex was (re)acquired
+    Clock::time_point acquired;
+};
+
+/**
+ * The directory of stocks, split into a fixed number of shards that
+ * are selected by the hash of the stock's name.  Each shard has its
+ * own reader-writer lock that is held only while the shard's map is
+ * searched or modified, so transactions on different stocks do not
+ * contend with each other and only create/reset take a lock
+ * exclusively.
+ */
+class StockDirectory {
+public:
+    /**
+     * Find a stock in the directory.
+     *
+     * \param[in] name The name of the stock to find.
+     *
+     * \return The entry for the stock, or nullptr if it does not exist.
+     */
+    StockEntryPtr find(const std::string& name) const {
+        const Shard& shard = shardFor(name);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        const auto entry = shard.stocks.find(name);
+        return (entry == shard.stocks.end()) ? nullptr : entry->second;
+    }
+
+    /**
+     * Add a stock to the directory if it does not already exist.  The
+     * new entry's mutex is locked before the entry becomes visible, so
+     * the caller can finish initializing (and logging) the stock
+     * before any other transaction can use it.
+     *
+     * \param[in] name The name of the stock to add.
+     *
+     * \param[in] balance The initial balance of the stock.
+     *
+     * \param[out] entryLock Set to a lock on the new entry's mutex.
+     *
+     * \return The new entry, or nullptr if the stock already existed.
+     */
+    StockEntryPtr insert(const std::string& name, const unsigned int balance,
+                         StockLock& entryLock) {
+        Shard& shard = shardFor(name);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto& entry = shard.stocks[name];
+        if (entry != nullptr) {
+            return nullptr;
+        }
+        entry = std::make_shared<StockEntry>();
+        entryLock = StockLock(*entry);
+        entry->name = name;
+        entry->setBalance(balance);
+        return entry;
+    }
+
+    /**
+     * Remove all the stocks from the directory.  Buyers waiting on a
+     * removed stock are woken up so that their transactions can finish.
+     *
+     * \param[in] whileLocked A callback that is called while no stock
+     * can be found or added (e.g. to log the reset).
+     */
+    template <typename Callback>
+    void clear(const Callback& whileLocked) {
+        std::vector<std::unordered_map<std::string, StockEntryPtr>>
+            removed(NumShards);
+        {
+            std::vector<std::unique_lock<std::shared_mutex>> locks;
+            for (Shard& shard : shards) {
+                locks.emplace_back(shard.mutex);
+            }
+            whileLocked();
+            for (size_t i = 0; i < NumShards; i++) {
+                removed[i].swap(shards[i].stocks);
+            }
+        }
+        for (auto& stocks : removed) {
+            for (auto& stock : stocks) {
+                StockEntry& entry = *stock.second;
+                StockLock lock(entry);
+                entry.removed = true;
+                for (const auto& waiter : entry.buyers) {
+                    waiter->wake(false);
+                }
+                entry.buyers.clear();
+            }
+        }
+    }
+
+    /**
+     * Call a function for each stock in the directory.  Stocks may be
+     * added or changed (but not removed) while this method runs.
+     *
+     * \param[in] fn The function to call with each StockEntry.
+     */
+    template <typename Callback>
+    void forEach(const Callback& fn) const {
+        for (const Shard& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& stock : shard.stocks) {
+                fn(*stock.second);
+            }
+        }
+    }
+
+private:
+    // The number of shards.  A power of 2 to make shard selection cheap
+    static constexpr size_t NumShards = 64;
+
+    // One shard of the directory, aligned to its own cache line so
+    // that locking one shard does not slow down its neighbours
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, StockEntryPtr> stocks;
+    };
+
+    Shard& shardFor(const std::string& name) {
+        return shards[std::hash<std::string>()(name) & (NumShards - 1)];
+    }
+
+    const Shard& shardFor(const std::string& name) const {
+        return shards[std::hash<std::string>()(name) & (NumShards - 1)];
+    }
+
+    Shard shards[NumShards];
+};
+
 // The name space to hold all of the information that is shared
 // between multiple threads.
 namespace sm {
-    // Unordered map including stock's name as the key (std::string)
+    // Sharded directory including stock's name as the key (std::string)
     // and the actual Stock entry as the value.
-    std::unordered_map<std::string, Stock> stockMap;
+    StockDirectory stockMap;
+
+    // Shared variable to keep track of the number of worker threads
+    // currently processing a transaction
+    std::atomic<int> threadCount = ATOMIC_VAR_INIT(0);
 
-    // Conditional variables for use in sleep wait approach for multithreading
-    std::condition_variable buyCond;
-    std::condition_variable countCond;
+    // The number of accepted connections waiting for a worker thread
+    // (see ConnectionPool)
+    std::atomic<size_t> acceptQueueDepth = ATOMIC_VAR_INIT(0);
 
-    // Mutex to control number of threads produced by the server
-    std::mutex serverMutex;
+    // How long a persistent connection may stay idle, waiting for the
+    // next request, before the server closes it
+    std::chrono::milliseconds idleTimeout = std::chrono::seconds(5);
 
-    // Shared variable to keep track of the number of detached threads
-    std::atomic<int> threadCount = ATOMIC_VAR_INIT(0);
+    // The maximum number of requests served on 1 persistent connection
+    // before the server closes it
+    int maxRequestsPerConnection = 100;
+
+    // The largest request body (e.g. of a batch) that the server reads.
+    // A request with a larger body is rejected and its connection closed.
+    size_t maxBodySize = 1 << 20;
+
+    // The write-ahead log of stock changes (see enableDurability)
+    StockLog stockLog;
+
+    // How long the log waits for more transactions to join a batch
+    std::chrono::microseconds groupCommitWindow(2000);
+
+    // How often a snapshot of all the stocks is written
+    std::chrono::seconds snapshotInterval(60);
 
 }  // namespace sm
 
 /**
  * This method is called from clientThread to process a "reset" transaction.
- * It deletes all stocks in the unordered map.
+ * It deletes all stocks in the stock directory.
+ *
+ * \param[out] lsn Set to the LSN of the log record that must be on
+ * disk before the response is sent (unchanged if nothing was logged).
  *
  * \return Message response regarding the transaction
  */
-std::string reset() {
-    sm::stockMap.clear();
+std::string reset(uint64_t& lsn) {
+    // Log the reset while no stock can be found or created, so that it
+    // is ordered correctly with respect to the other records.
+    sm::stockMap.clear([&lsn] {
+        lsn = sm::stockLog.append(StockLog::ResetRecord, "", 0); });
     return "Stocks reset";
 }
 
@@ -73,15 +853,18 @@ std::string reset() {
  *
  * \param[in] amount The balance of the stock to be created
  *
+ * \param[out] lsn Set to the LSN of the log record that must be on
+ * disk before the response is sent (unchanged if nothing was logged).
+ *
  * \return Message response regarding the transaction
  */
-std::string create(std::string stock, unsigned int amount) {
+std::string create(std::string stock, unsigned int amount, uint64_t& lsn) {
     std::string msg;
-    // Check if stock exists
-    if (sm::stockMap.find(stock) == sm::stockMap.end()) {
-        // Create stock
-        sm::stockMap[stock].name = stock;
-        sm::stockMap[stock].balance = amount;
+    // Create the stock unless it already exists
+    StockLock lock;
+    if (StockEntryPtr entry = sm::stockMap.insert(stock, amount, lock)) {
+        lsn = entry->lastLsn = sm::stockLog.append(StockLog::CreateRecord,
+                                                   stock, amount);
         msg = "Stock " + stock + " created with balance = "
             + std::to_string(amount);
     } else {
@@ -91,6 +874,94 @@ std::string create(std::string stock, unsigned int amount) {
     return msg;
 }
 
+/**
+ * Helper method to change the balance of a stock and log the change.
+ * The entry's mutex must be held.
+ *
+ * \param[in,out] entry The entry whose balance is to be changed.
+ *
+ * \param[in] newBalance The new balance for the stock.
+ */
+void updateBalance(StockEntry& entry, const unsigned int newBalance) {
+    entry.setBalance(newBalance);
+    entry.lastLsn = sm::stockLog.append(StockLog::BalanceRecord, entry.name,
+                                        newBalance);
+}
+
+/**
+ * Helper method to remove stock from an entry, waiting (using a sleep
+ * wait approach) until the balance of the stock is large enough.
+ *
+ * \param[in,out] entry The entry for the stock to be bought.
+ *
+ * \param[in,out] lock A lock on the entry's mutex.  The lock is
+ * released while this method waits for stock to become available.
+ *
+ * \param[in] amount The amount of the stock to be bought.
+ *
+ * \return True if the balance was updated, false if the stock was
+ * removed (by a reset) before the balance could be updated.
+ */
+bool buyLocked(StockEntry& entry, StockLock& lock,
+               const unsigned int amount) {
+    if (entry.removed) {
+        return false;
+    } else if (amount <= entry.balance) {
+        // Every waiting buyer wants more than the balance (see
+        // sellLocked), so only the surplus is taken here
+        updateBalance(entry, entry.balance - amount);
+        return true;
+    }
+    // Join the stock's queue of buyers and sleep until a seller hands
+    // this buyer the stock (or a reset removes the stock).
+    Metrics::add(Metrics::BuyWaits);
+    const auto waitStart = std::chrono::steady_clock::now();
+    auto waiter = std::make_shared<BuyWaiter>(amount);
+    entry.buyers.push_back(waiter);
+    lock.wait(waiter->cond);
+    while (!waiter->notified) {
+        Metrics::add(Metrics::SpuriousWakeups);
+        lock.wait(waiter->cond);
+    }
+    Metrics::add(Metrics::BuyWaitNanos, std::chrono::duration_cast<
+        std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                  waitStart).count());
+    return waiter->granted;
+}
+
+/**
+ * Helper method to add stock to an entry and wake the waiting buyers
+ * that can now complete their purchase.  The entry's mutex must be held.
+ *
+ * \param[in,out] entry The entry for the stock to be sold.
+ *
+ * \param[in] amount The amount of the stock to be sold.
+ *
+ * \return True if the balance was updated, false if the stock was
+ * removed (by a reset) after it was found.
+ */
+bool sellLocked(StockEntry& entry, const unsigned int amount) {
+    if (entry.removed) {
+        return false;
+    }
+    // Update the balance
+    updateBalance(entry, entry.balance + amount);
+    // Hand the stock to the waiting buyers (oldest first) whose
+    // purchases can be satisfied by the new balance, and wake them.
+    // Afterwards every buyer still waiting wants more than the balance.
+    for (auto it = entry.buyers.begin(); it != entry.buyers.end();) {
+        const std::shared_ptr<BuyWaiter> waiter = *it;
+        if (waiter->amount <= entry.balance) {
+            updateBalance(entry, entry.balance - waiter->amount);
+            it = entry.buyers.erase(it);
+            waiter->wake(true);
+        } else {
+            ++it;
+        }
+    }
+    return true;
+}
+
 /**
  * This method is called from clientThread to process a "buy" transaction.
  * It reduces the balance associated with the stock and returns a message with
@@ -100,26 +971,25 @@ std::string create(std::string stock, unsigned int amount) {
  *
  * \param[in] amount The amount of the stock to be sold
  *
+ * \param[out] lsn Set to the LSN of the log record that must be on
+ * disk before the response is sent (unchanged if nothing was logged).
+ *
  * \return Message response regarding the transaction
  */
-std::string buy(std::string stock, unsigned int amount) {
-    std::string msg;
+std::string buy(std::string stock, unsigned int amount, uint64_t& lsn) {
+    std::string msg = "Stock not found";
     // Check if stock exists
-    if (sm::stockMap.find(stock) != sm::stockMap.end()) {
+    if (StockEntryPtr entry = sm::stockMap.find(stock)) {
         // Use a mutex unique_lock to create a critical section where the
         // balance of the stock can be changed without creating a race
         // condition when multithreading.
         // This also ensures that a stock can not be bought more times
         // than it is available using a sleep wait approach.
-        Lock lock(sm::stockMap[stock].mutex);
-        sm::buyCond.wait(lock,
-            [stock, amount] {return amount <= 
-            sm::stockMap.at(stock).balance; });
-        // Update the balance
-        sm::stockMap[stock].balance -= amount;
-        msg = "Stock " + stock + "'s balance updated";
-    } else {
-        msg = "Stock not found";
+        StockLock lock(*entry);
+        if (buyLocked(*entry, lock, amount)) {
+            lsn = entry->lastLsn;
+            msg = "Stock " + stock + "'s balance updated";
+        }
     }
     // Return result of transaction
     return msg;
@@ -134,24 +1004,23 @@ std::string buy(std::string stock, unsigned int amount) {
  * 
  * \param[in] amount The amount of the stock to be sold
  *
+ * \param[out] lsn Set to the LSN of the log record that must be on
+ * disk before the response is sent (unchanged if nothing was logged).
+ *
  * \return Message response regarding the transaction
  */
-std::string sell(std::string stock, unsigned int amount) {
-    std::string msg;
+std::string sell(std::string stock, unsigned int amount, uint64_t& lsn) {
+    std::string msg = "Stock not found";
     // Check if the stock exists
-    if (sm::stockMap.find(stock) != sm::stockMap.end()) {
+    if (StockEntryPtr entry = sm::stockMap.find(stock)) {
         // Use a mutex unique_lock to create a critical section where the
         // balance of the stock can be changed without creating a race
         // condition when multithreading
-        Lock lock(sm::stockMap[stock].mutex);
-        // Update the balance
-        sm::stockMap[stock].balance += amount;
-        // Notify the threads waiting to process a buy transaction that
-        // more stock is available
-        sm::buyCond.notify_all();
-        msg = "Stock " + stock + "'s balance updated";
-    } else {
-        msg = "Stock not found";
+        StockLock lock(*entry);
+        if (sellLocked(*entry, amount)) {
+            lsn = entry->lastLsn;
+            msg = "Stock " + stock + "'s balance updated";
+        }
     }
     // Return result of transaction
     return msg;
@@ -166,22 +1035,343 @@ std::string sell(std::string stock, unsigned int amount) {
  * \return Message response regarding the transaction
  */
 std::string status(std::string stock) {
-    std::string msg;
-    if (sm::stockMap.find(stock) != sm::stockMap.end()) {
-        // Use a mutex unique_lock to create a critical section where the
-        // balance of the stock can be accessed without creating a race
-        // condition when multithreading
-        Lock lock(sm::stockMap[stock].mutex);
-        // Retrieve balance
-        auto balance = sm::stockMap[stock].balance;
+    std::string msg = "Stock not found";
+    if (StockEntryPtr entry = sm::stockMap.find(stock)) {
+        // The published balance is an atomic copy of the balance, so it
+        // can be read without taking the stock's mutex.
+        const auto balance = entry->published.load(std::memory_order_acquire);
         msg = "Balance for stock " + stock + " = " + std::to_string(balance);
-    } else {
-        msg = "Stock not found";
     }
     // Return result of transaction
     return msg;
 }
 
+/**
+ * Helper method to escape a label value in the Prometheus text format,
+ * so that a stock name cannot end the label or the line early.
+ *
+ * \param[in] value The label value to be escaped.
+ *
+ * \return The value with backslashes, quotes, and newlines escaped.
+ */
+std::string escapeLabel(const std::string& value) {
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (const char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * This method is called to process a "/metrics" request.  It merges
+ * the per-thread counters and formats them, along with the lock
+ * statistics of each stock, in the Prometheus text format.
+ *
+ * \return The metrics, 1 per line.
+ */
+std::string metrics() {
+    const std::vector<uint64_t> counts = Metrics::read();
+    std::ostringstream os;
+    for (int i = Metrics::ResetCount; i <= Metrics::BatchCount; i++) {
+        os << "stock_requests_total{trans=\"" << Metrics::TransNames[i]
+           << "\"} " << counts[i] << "\n";
+    }
+    os << "stock_buy_waits_total " << counts[Metrics::BuyWaits] << "\n"
+       << "stock_buy_wait_seconds_total "
+       << counts[Metrics::BuyWaitNanos] / 1e9 << "\n"
+       << "stock_spurious_wakeups_total "
+       << counts[Metrics::SpuriousWakeups] << "\n"
+       << "stock_accepted_connections_total "
+       << counts[Metrics::AcceptedConnections] << "\n"
+       << "stock_accept_queue_wait_seconds_total "
+       << counts[Metrics::AcceptWaitNanos] / 1e9 << "\n"
+       << "stock_accept_queue_depth " << sm::acceptQueueDepth << "\n"
+       << "stock_busy_threads " << sm::threadCount << "\n";
+    sm::stockMap.forEach([&os](const StockEntry& entry) {
+        const std::string name = escapeLabel(entry.name);
+        os << "stock_lock_acquisitions_total{stock=\"" << name << "\"} "
+           << entry.lockCount.load(std::memory_order_relaxed) << "\n"
+           << "stock_lock_hold_seconds_total{stock=\"" << name << "\"} "
+           << entry.holdNanos.load(std::memory_order_relaxed) / 1e9 << "\n";
+    });
+    return os.str();
+}
+
+/**
+ * Helper method used when recovering stocks at startup to set the
+ * balance of a stock, optionally creating it.
+ *
+ * \param[in] name The name of the stock.
+ *
+ * \param[in] balance The balance of the stock.
+ *
+ * \param[in] create If true the stock is created if it does not exist.
+ */
+void restoreStock(const std::string& name, const unsigned int balance,
+                  const bool create) {
+    StockLock lock;
+    if (create && sm::stockMap.insert(name, balance, lock) != nullptr) {
+        return;
+    }
+    if (StockEntryPtr entry = sm::stockMap.find(name)) {
+        lock = StockLock(*entry);
+        entry->setBalance(balance);
+    }
+}
+
+/**
+ * Helper method to memory-map a file for reading.
+ *
+ * \param[in] path The path to the file.
+ *
+ * \param[out] size Set to the size of the file.
+ *
+ * \return The start of the mapping, or nullptr if the file does not
+ * exist or is empty.  The caller must munmap a non-null result.
+ */
+const char* mapFile(const std::string& path, size_t& size) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size = info.st_size) > 0) {
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    return (data == MAP_FAILED) ? nullptr : static_cast<const char*>(data);
+}
+
+// The first 8 bytes of a snapshot file
+const char SnapshotMagic[8] = {'S', 'T', 'K', 'S', 'N', 'A', 'P', '1'};
+
+/**
+ * Load the stocks from a snapshot file.  The file is memory-mapped and
+ * decoded in place.  Its format is the 8 byte magic, the LSN of the
+ * last log record reflected in the snapshot (8 bytes), the number of
+ * stocks (8 bytes), and then for each stock [balance:4][name length:2]
+ * followed by the name.
+ *
+ * \param[in] path The path to the snapshot file.
+ *
+ * \return The LSN stored in the snapshot, or zero if there is no
+ * snapshot.
+ */
+uint64_t loadSnapshot(const std::string& path) {
+    size_t size;
+    const char* data = mapFile(path, size);
+    if (data == nullptr) {
+        return 0;
+    }
+    uint64_t lsn = 0, count = 0;
+    if (size < 24 || std::memcmp(data, SnapshotMagic, 8) != 0) {
+        munmap(const_cast<char*>(data), size);
+        throw std::runtime_error("Invalid snapshot " + path);
+    }
+    std::memcpy(&lsn, data + 8, 8);
+    std::memcpy(&count, data + 16, 8);
+    size_t pos = 24;
+    for (uint64_t i = 0; i < count && pos + 6 <= size; i++) {
+        unsigned int balance;
+        uint16_t nameLen;
+        std::memcpy(&balance, data + pos, 4);
+        std::memcpy(&nameLen, data + pos + 4, 2);
+        pos += 6;
+        if (pos + nameLen > size) {
+            break;
+        }
+        restoreStock(std::string(data + pos, nameLen), balance, true);
+        pos += nameLen;
+    }
+    munmap(const_cast<char*>(data), size);
+    return lsn;
+}
+
+/**
+ * Replay the records in a log segment that come after a given LSN.
+ * Replay stops at the first record that is incomplete or whose
+ * checksum does not match (e.g. a record that was being written when
+ * the server stopped).  The segment is truncated there, so that
+ * records appended to it later are not hidden behind the torn record.
+ *
+ * \param[in] path The path to the log segment.
+ *
+ * \param[in] firstLsn The LSN of the first record in the segment.
+ *
+ * \param[in] afterLsn Only records with a larger LSN are replayed.
+ *
+ * \return The LSN of the last valid record in the segment.
+ */
+uint64_t replaySegment(const std::string& path, const uint64_t firstLsn,
+                       const uint64_t afterLsn) {
+    size_t size;
+    const char* data = mapFile(path, size);
+    uint64_t lsn = firstLsn - 1;
+    size_t pos = 0;
+    for (; data != nullptr && pos + StockLog::HeaderSize <= size; lsn++) {
+        uint32_t sum;
+        uint16_t nameLen;
+        unsigned int balance;
+        std::memcpy(&sum, data + pos, 4);
+        std::memcpy(&nameLen, data + pos + 5, 2);
+        std::memcpy(&balance, data + pos + 7, 4);
+        const char* name = data + pos + StockLog::HeaderSize;
+        if (pos + StockLog::HeaderSize + nameLen > size ||
+            sum != StockLog::checksum(data + pos + 4,
+                                      StockLog::HeaderSize - 4,
+                                      name, nameLen)) {
+            break;
+        }
+        if (lsn + 1 > afterLsn) {
+            switch (data[pos + 4]) {
+            case StockLog::CreateRecord:
+                restoreStock(std::string(name, nameLen), balance, true);
+                break;
+            case StockLog::BalanceRecord:
+                restoreStock(std::string(name, nameLen), balance, false);
+                break;
+            case StockLog::ResetRecord:
+                sm::stockMap.clear([] {});
+                break;
+            }
+        }
+        pos += StockLog::HeaderSize + nameLen;
+    }
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), size);
+        if (pos < size) {
+            const int fd = ::open(path.c_str(), O_WRONLY);
+            if (fd == -1 || ::ftruncate(fd, pos) != 0 || ::fsync(fd) != 0) {
+                perror(("Error truncating log " + path).c_str());
+                std::abort();
+            }
+            ::close(fd);
+        }
+    }
+    return lsn;
+}
+
+/**
+ * Write a snapshot of all stocks to "stocks.snap" in the log's
+ * directory and delete the log segments that it makes redundant.
+ * The log is rotated first, so every record in the older segments has
+ * already been applied to the stocks that are saved.  Transactions
+ * continue while the snapshot is written; any change saved in the
+ * snapshot that is also in the newer segments is replayed harmlessly.
+ *
+ * \return The LSN of the last log record reflected in the snapshot.
+ */
+uint64_t writeSnapshot() {
+    const uint64_t lsn = sm::stockLog.rotate();
+    std::string data(SnapshotMagic, 8);
+    data.append(16, '\0');
+    uint64_t count = 0;
+    sm::stockMap.forEach([&data, &count](const StockEntry& entry) {
+        const unsigned int balance = entry.published.load(
+            std::memory_order_acquire);
+        const uint16_t nameLen = static_cast<uint16_t>(
+            std::min<size_t>(entry.name.size(), UINT16_MAX));
+        data.append(reinterpret_cast<const char*>(&balance), 4);
+        data.append(reinterpret_cast<const char*>(&nameLen), 2);
+        data.append(entry.name.data(), nameLen);
+        count++;
+    });
+    std::memcpy(&data[8], &lsn, 8);
+    std::memcpy(&data[16], &count, 8);
+    // Write to a temporary file and rename it, so that a crash never
+    // leaves a partially written snapshot behind.
+    const std::string& dir = sm::stockLog.getDir();
+    const std::string tmpPath = dir + "/stocks.snap.tmp";
+    const int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                          0644);
+    if (fd == -1 || ::write(fd, data.data(), data.size()) !=
+        static_cast<ssize_t>(data.size()) || ::fsync(fd) != 0) {
+        perror("Error writing stock snapshot");
+        ::close(fd);
+        return 0;
+    }
+    ::close(fd);
+    std::filesystem::rename(tmpPath, dir + "/stocks.snap");
+    const int dirFd = ::open(dir.c_str(), O_RDONLY);
+    ::fsync(dirFd);
+    ::close(dirFd);
+    // Every segment before the current one is now redundant
+    for (const auto& file : std::filesystem::directory_iterator(dir)) {
+        const std::string name = file.path().filename().string();
+        unsigned long long firstLsn;
+        if (sscanf(name.c_str(), "stocks.%llu.wal", &firstLsn) == 1 &&
+            firstLsn <= lsn) {
+            std::filesystem::remove(file.path());
+        }
+    }
+    return lsn;
+}
+
+/**
+ * Make the stocks durable.  This method is meant to be called (by
+ * main, or by enableDurabilityOption) before the server starts.  It
+ * loads the latest snapshot in the given directory (via mmap), replays
+ * the log records written after the snapshot, opens the log for new
+ * records, and has the log run a background thread that writes a new
+ * snapshot every sm::snapshotInterval if any stock has changed.
+ *
+ * \param[in] dir The directory for the snapshot and log files.  It is
+ * created if it does not exist.
+ */
+void enableDurability(const std::string& dir) {
+    std::filesystem::create_directories(dir);
+    const uint64_t snapshotLsn = loadSnapshot(dir + "/stocks.snap");
+    // Replay the log segments in LSN order
+    std::vector<std::pair<uint64_t, std::string>> segments;
+    for (const auto& file : std::filesystem::directory_iterator(dir)) {
+        const std::string name = file.path().filename().string();
+        unsigned long long firstLsn;
+        if (sscanf(name.c_str(), "stocks.%llu.wal", &firstLsn) == 1) {
+            segments.emplace_back(firstLsn, file.path().string());
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+    uint64_t lastLsn = snapshotLsn;
+    for (const auto& segment : segments) {
+        lastLsn = std::max(lastLsn, replaySegment(segment.second,
+                                                  segment.first,
+                                                  snapshotLsn));
+    }
+    sm::stockLog.open(dir, lastLsn + 1, sm::groupCommitWindow);
+    // Periodically write snapshots to bound the work done at startup
+    sm::stockLog.startPeriodic(sm::snapshotInterval,
+                               [savedLsn = lastLsn]() mutable {
+        if (sm::stockLog.lastAppended() > savedLsn) {
+            savedLsn = std::max(savedLsn, writeSnapshot());
+        }
+    });
+}
+
+/**
+ * Helper method called by runServer and runAsyncServer to enable
+ * durability (see enableDurability) in the directory named by the
+ * STOCK_LOG_DIR environment variable, unless it is not set or main has
+ * already enabled durability.
+ */
+void enableDurabilityOption() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        const char* const dir = std::getenv("STOCK_LOG_DIR");
+        if (dir != nullptr && *dir != '\0' && !sm::stockLog.isOpen()) {
+            enableDurability(dir);
+        }
+    });
+}
+
 /**
  * This method is called from clientThread to format and output an HTTP
  * response based on transaction processed in clientThread.
@@ -190,50 +1380,353 @@ std::string status(std::string stock) {
  *
  * \param[out] os The output stream to where the HTTP response is to
  * be written.
+ *
+ * \param[in] keepAlive If true the response tells the client that the
+ * connection stays open for further requests.
  */
-void HTTPResponse(std::ostream& os, const std::string& msg) {
+void HTTPResponse(std::ostream& os, const std::string& msg,
+                  const bool keepAlive = false) {
     os << "HTTP/1.1 200 OK\r\n" <<
         "Server: StockServer\r\nContent-Length: "
         << std::to_string(msg.length()) << "\r\n" <<
-        "Connection: Close\r\n" <<
+        (keepAlive ? "Connection: keep-alive\r\n" : "Connection: Close\r\n") <<
         "Content - Type: text / plain\r\n\r\n" << msg;
 }
 
 /**
- * This method assumes the input stream is an HTTP GET request
- * and extracts the URL to be processed from the 1st
- * line of the input stream.
+ * The elements of a transaction request extracted from the URL of a
+ * GET request, e.g. "trans=buy&stock=MSFT&amount=10".  For a
+ * "trans=batch" request the list of transactions is in the body.
+ */
+struct Transaction {
+    std::string trans, stock;
+    unsigned int amount = 0;
+    std::string body;
+    // Set if the body was larger than sm::maxBodySize (and not read)
+    bool tooLarge = false;
+};
+
+/**
+ * Helper method to parse the (decoded) URL from a GET request into the
+ * elements of a transaction.  The values are the 2nd, 4th, and 6th
+ * words in the URL when '&', '=', and white space are treated as
+ * separators.  For example, "/trans=buy&stock=MSFT&amount=10" is a
+ * "buy" of 10 "MSFT" stocks.  The URL "/metrics" is a "metrics"
+ * transaction.
+ *
+ * \param[in] request The decoded URL from the request line.
+ *
+ * \return The transaction type, stock name, and amount in the request.
+ */
+Transaction parseTransaction(std::string_view request) {
+    // Skip the leading '/' in the URL
+    if (!request.empty() && request.front() == '/') {
+        request.remove_prefix(1);
+    }
+    Transaction t;
+    if (request == "metrics") {
+        t.trans = "metrics";
+        return t;
+    }
+    // Split the first 6 words out of the URL without copying them
+    const char* const Separators = "&= \t\r\n";
+    std::string_view words[6];
+    size_t numWords = 0;
+    for (size_t start = request.find_first_not_of(Separators);
+         start != std::string_view::npos && numWords < 6;
+         start = request.find_first_not_of(Separators, start)) {
+        const size_t end = std::min(request.find_first_of(Separators, start),
+                                    request.size());
+        words[numWords++] = request.substr(start, end - start);
+        start = end;
+    }
+    // Read the important elements of the request into the transaction
+    t.trans = words[1];
+    t.stock = words[3];
+    std::from_chars(words[5].data(), words[5].data() + words[5].size(),
+                    t.amount);
+    return t;
+}
+
+/**
+ * Helper method to count 1 transaction in the calling thread's metrics.
+ *
+ * \param[in] trans The type of the transaction, e.g. "buy".
+ */
+void countTransaction(const std::string& trans) {
+    for (int i = Metrics::ResetCount; i <= Metrics::BatchCount; i++) {
+        if (trans == Metrics::TransNames[i]) {
+            Metrics::add(static_cast<Metrics::Counter>(i));
+            return;
+        }
+    }
+}
+
+/**
+ * Helper method to apply the transactions in a batch that are for 1
+ * stock, in the order in which they appear in the batch.  The
+ * stock's mutex is acquired only once for the whole group (a buy may
+ * still release it while waiting for stock to become available).
+ *
+ * \param[in] stock The stock that the transactions are for.
+ *
+ * \param[in] lines The indexes of the stock's transactions in batch.
+ *
+ * \param[in] batch All of the transactions in the batch.
+ *
+ * \param[out] results The messages for each transaction in the batch.
+ *
+ * \return The LSN of the last log record for this stock's transactions
+ * (zero if none were logged).
+ */
+uint64_t runStockBatch(const std::string& stock,
+                       const std::vector<size_t>& lines,
+                       const std::vector<Transaction>& batch,
+                       std::vector<std::string>& results) {
+    StockEntryPtr entry = sm::stockMap.find(stock);
+    StockLock lock;
+    if (entry != nullptr) {
+        lock = StockLock(*entry);
+    }
+    uint64_t lastLsn = 0;
+    for (const size_t i : lines) {
+        const Transaction& t = batch[i];
+        countTransaction(t.trans);
+        if (entry != nullptr && entry->removed) {
+            // The stock was removed by a concurrent reset
+            lock.unlock();
+            entry = nullptr;
+        }
+        if (t.trans == "create") {
+            if (entry == nullptr &&
+                (entry = sm::stockMap.insert(stock, t.amount, lock))) {
+                entry->lastLsn = sm::stockLog.append(StockLog::CreateRecord,
+                                                     stock, t.amount);
+                results[i] = "Stock " + stock + " created with balance = "
+                    + std::to_string(t.amount);
+            } else {
+                results[i] = "Stock " + stock + " already exists";
+            }
+            if (entry == nullptr && (entry = sm::stockMap.find(stock))) {
+                lock = StockLock(*entry);
+            }
+        } else if (entry == nullptr) {
+            results[i] = "Stock not found";
+        } else if (t.trans == "buy" || t.trans == "sell") {
+            // As in buy() and sell(), a stock removed by a concurrent
+            // reset is not found
+            const bool updated = (t.trans == "buy") ?
+                buyLocked(*entry, lock, t.amount) :
+                sellLocked(*entry, t.amount);
+            results[i] = updated ? "Stock " + stock + "'s balance updated" :
+                "Stock not found";
+        } else if (t.trans == "status") {
+            results[i] = "Balance for stock " + stock + " = "
+                + std::to_string(entry->balance);
+        }
+        if (entry != nullptr) {
+            lastLsn = std::max(lastLsn, entry->lastLsn);
+        }
+    }
+    return lastLsn;
+}
+
+/**
+ * Helper method to parse the body of a "batch" transaction.  The body
+ * has 1 transaction per line in the form "trans,stock,amount", where
+ * trans is one of create, buy, sell, or status (e.g. "buy,MSFT,10").
  *
- * For example, if the 1st line of input is
- * "GET /http://localhost:8080/~user HTTP/1.1" then this method returns
- * "http://localhost:8080/~user"
+ * \param[in] body The body of the batch request.
  *
- * @return This method returns the path specified in the GET
- * request.
+ * \return The transaction on each non-empty line of the body.  A line
+ * whose amount is not a valid number has an empty trans.
  */
-std::string extractURL(std::istream& is) {
-    std::string line, url;
-    // Extract the GET request line from the input
-    std::getline(is, line);
-    // Read and skip HTTP headers, allowing for the
-    // program to work correctly with
-    // web-browsers.
-    for (std::string hdr; std::getline(is, hdr)
-        && !hdr.empty() && hdr != "\r";) {
+std::vector<Transaction> parseBatch(const std::string& body) {
+    std::vector<Transaction> batch;
+    for (size_t start = 0; start < body.size();) {
+        size_t end = std::min(body.find('\n', start), body.size());
+        std::string line = body.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        Transaction t;
+        const size_t comma1 = line.find(','), comma2 = line.find(',',
+            comma1 == std::string::npos ? comma1 : comma1 + 1);
+        t.trans = line.substr(0, comma1);
+        if (comma1 != std::string::npos) {
+            t.stock = line.substr(comma1 + 1, comma2 - comma1 - 1);
+        }
+        if (comma2 != std::string::npos) {
+            // The whole amount must be a number that fits, otherwise the
+            // line is left as an invalid request
+            const char* const last = line.data() + line.size();
+            const auto parsed = std::from_chars(line.data() + comma2 + 1,
+                                                last, t.amount);
+            if (parsed.ec != std::errc() || parsed.ptr != last) {
+                t.trans.clear();
+            }
+        }
+        batch.push_back(std::move(t));
     }
-    // Do basic substring operation to extract the URL that is
-    // delimited by space from the first line of input.
-    line = line.substr(line.find('/') + 1);
-    url = line.substr(0, line.find(' '));
-    return url;
+    return batch;
 }
 
 /**
- * This method is called from a separate detached/background thread
- * from the runServer() method.  This method processes 1 transaction
- * from a client.  This method extracts the transaction information
- * and processes the transaction by calling helper
- * methods.
+ * This method is called to process a "batch" transaction parsed by
+ * parseBatch().  The transactions are grouped by stock, so that each
+ * stock's mutex is acquired only once.  The transactions for a stock
+ * are applied in the order in which they appear in the batch.
+ *
+ * \param[in] batch The transactions in the batch.
+ *
+ * \param[out] lsn Set to the LSN of the last log record for the batch
+ * (unchanged if nothing was logged).
+ *
+ * \return The message for each transaction, 1 per line, in the same
+ * order as the transactions in the batch.
+ */
+std::string runBatch(const std::vector<Transaction>& batch, uint64_t& lsn) {
+    // Group the transactions by stock, preserving their order
+    std::unordered_map<std::string, std::vector<size_t>> byStock;
+    for (size_t i = 0; i < batch.size(); i++) {
+        byStock[batch[i].stock].push_back(i);
+    }
+    // Apply the transactions with 1 lock acquisition per stock.
+    // Anything that is not handled stays an invalid request.
+    std::vector<std::string> results(batch.size(), "Invalid request");
+    for (const auto& group : byStock) {
+        lsn = std::max(lsn, runStockBatch(group.first, group.second, batch,
+                                          results));
+    }
+    std::string msg;
+    for (const auto& result : results) {
+        msg += result + "\n";
+    }
+    return msg;
+}
+
+/**
+ * Helper method to process a parsed transaction by calling the
+ * appropriate helper method.  It does not wait for the transaction's
+ * changes to be written to the log.
+ *
+ * \param[in] t The transaction to be processed.
+ *
+ * \param[out] lsn Set to the LSN of the log record that must be on
+ * disk before the response is sent (unchanged if nothing was logged).
+ *
+ * \return Message response regarding the transaction
+ */
+std::string runTransaction(const Transaction& t, uint64_t& lsn) {
+    // Request is considered invalid by defualt
+    std::string msg = "Invalid request";
+    if (t.tooLarge) {
+        return "Request body too large";
+    }
+    // Process transaction if request is valid and retrieve the message
+    countTransaction(t.trans);
+    if (t.trans == "reset") {
+        msg = reset(lsn);
+    } else if (t.trans == "create") {
+        msg = create(t.stock, t.amount, lsn);
+    } else if (t.trans == "buy") {
+        msg = buy(t.stock, t.amount, lsn);
+    } else if (t.trans == "sell") {
+        msg = sell(t.stock, t.amount, lsn);
+    } else if (t.trans == "status") {
+        msg = status(t.stock);
+    } else if (t.trans == "batch") {
+        msg = runBatch(parseBatch(t.body), lsn);
+    } else if (t.trans == "metrics") {
+        msg = metrics();
+    }
+    return msg;
+}
+
+/**
+ * Helper method to process a parsed transaction and wait until its
+ * changes have been written to the log.
+ *
+ * \param[in] t The transaction to be processed.
+ *
+ * \return Message response regarding the transaction
+ */
+std::string runTransaction(const Transaction& t) {
+    uint64_t lsn = 0;
+    const std::string msg = runTransaction(t, lsn);
+    sm::stockLog.waitDurable(lsn);
+    return msg;
+}
+
+/**
+ * Helper method to read an HTTP request from a stream and extract the
+ * transaction in it.  Any request body is read into the transaction.
+ *
+ * \param[in] is The input stream from where the HTTP request is to be
+ * read.
+ *
+ * \param[out] keepAlive Set to true if the client wants to keep the
+ * connection open after this request.
+ *
+ * \return The transaction in the request.  If its body is too large
+ * the body is not read and keepAlive is set to false.
+ */
+Transaction readTransaction(std::istream& is, bool& keepAlive) {
+    HTTPRequest request;
+    if (!request.read(is)) {
+        keepAlive = false;
+        return Transaction();
+    }
+    keepAlive = request.isKeepAlive();
+    Transaction t = parseTransaction(request.decodeURL());
+    if (request.getContentLength() > sm::maxBodySize) {
+        // The body is not read, so the connection cannot be reused
+        t.tooLarge = true;
+        keepAlive = false;
+        return t;
+    }
+    t.body.resize(request.getContentLength());
+    is.read(&t.body[0], t.body.size());
+    return t;
+}
+
+/**
+ * Helper method to read 1 HTTP request, process its transaction, and
+ * write the HTTP response.  The response is not flushed, so that the
+ * responses to pipelined requests can be sent together.
+ *
+ * \param[in] is The input stream from where the HTTP request is to be
+ * read and processed.
+ *
+ * \param[out] os The output stream to where the HTTP response is to
+ * be written.
+ *
+ * \param[in] allowKeepAlive If false the connection is closed after
+ * this request, even if the client asked to keep it open.
+ *
+ * \return True if the connection stays open for another request.
+ */
+bool serveRequest(std::istream& is, std::ostream& os,
+                  const bool allowKeepAlive) {
+    bool keepAlive;
+    // Call helper methods to extract the transaction from the HTTP
+    // request and process it
+    const Transaction t = readTransaction(is, keepAlive);
+    keepAlive = keepAlive && allowKeepAlive && is.good();
+    const std::string msg = runTransaction(t);
+    // Call helper method to output the HTTP response
+    HTTPResponse(os, msg, keepAlive);
+    return keepAlive;
+}
+
+/**
+ * This method is called to process 1 transaction from a client.  This
+ * method extracts the transaction information and processes the
+ * transaction by calling helper methods.
  * 
  * \param[in] is The input stream from where the HTTP request is to be
  * read and processed.
@@ -242,44 +1735,280 @@ std::string extractURL(std::istream& is) {
  * be written.
  */
 void clientThread(std::istream& is, std::ostream& os) {
-    // Increment thread count for this detached thread
+    // Increment thread count for this busy worker thread
     sm::threadCount++;
-    std::string request, trans, stock, message, dummy, msg;
-    // Call helper method to extract URL from the GET request
-    request = extractURL(is);
-    // Call helper method to decode the URL
-    request = url_decode(request);
-    // Replace '&' and '=' characters in the request to make it
-    // easier to parse out the data.
-    std::replace(request.begin(), request.end(), '&', ' ');
-    std::replace(request.begin(), request.end(), '=', ' ');
-    // Create a string input stream to read words out.
-    unsigned int amount = 0;
-    // Read the important elements of the request into the desired variables
-    std::istringstream(request) >> dummy >> trans >> dummy >> stock
-        >> dummy >> amount;
-    // Request is considered invalid by defualt
-    msg = "Invalid request";
-    // Process transaction if request is valid and retrieve the message
-    if (trans == "reset") {
-        msg = reset();
-    } else if (trans == "create") {
-        msg = create(stock, amount);
-    } else if (trans == "buy") {
-        msg = buy(stock, amount);
-    } else if (trans == "sell") {
-        msg = sell(stock, amount);
-    } else if (trans == "status") {
-        msg = status(stock);
+    serveRequest(is, os, false);
+    // Decrement threadCount as this worker thread finishes
+    sm::threadCount--;
+}
+
+/**
+ * This method is called from a worker thread in the ConnectionPool
+ * used by the runServer() method, when a persistent connection has
+ * data for the next request.  It processes the transactions that the
+ * client has already sent (pipelined) and flushes their responses
+ * with a single write.  The worker does not wait for the client's
+ * next request: the pool waits for it without holding a thread.
+ *
+ * \param[in,out] client The connection to the client.
+ *
+ * \param[in,out] served The number of requests served on the
+ * connection so far.  Once it reaches sm::maxRequestsPerConnection the
+ * connection is closed.
+ *
+ * \return True if the connection stays open for another request,
+ * false if the client closed it or asked to close it.
+ */
+bool serveConnection(tcp::iostream& client, int& served) {
+    // Increment thread count for this busy worker thread
+    sm::threadCount++;
+    // tcp::iostream flushes after every << by default (unitbuf), which
+    // sends each response in several small segments that then wait on
+    // the client's delayed ACKs.  Flush explicitly below instead.
+    client.unsetf(std::ios_base::unitbuf);
+    // The client may have closed the connection (or, for a new
+    // connection, sent nothing within the idle timeout)
+    client.expires_after(sm::idleTimeout);
+    bool keepAlive = client.peek() != std::char_traits<char>::eof();
+    while (keepAlive) {
+        client.expires_after(sm::idleTimeout);
+        keepAlive = serveRequest(client, client,
+                                 ++served < sm::maxRequestsPerConnection);
+        if (client.rdbuf()->in_avail() <= 0) {
+            break;  // Every request received so far has been answered
+        }
     }
-    // Call helper method to output the HTTP response
-    HTTPResponse(os, msg);
-    // Decrement threadCount as this detached thread finishes
+    client.flush();
+    // Decrement threadCount as this worker thread finishes
     sm::threadCount--;
-    // Allow another thread to be created as this thread terminates
-    sm::countCond.notify_one();
+    return keepAlive && client.good();
 }
 
+/**
+ * A fixed-size pool of worker threads that is fed accepted client
+ * connections through a bounded queue.  The workers are created once
+ * (when the pool is constructed) and reused for every connection, so
+ * the per-request cost of creating and tearing down a thread is
+ * avoided.  When the queue is full the accept loop in runServer()
+ * waits for a worker to drain an entry, which keeps the number of
+ * pending connections bounded.
+ *
+ * A worker only holds a connection while it has requests to process.
+ * An idle persistent connection is parked with a poller thread, which
+ * puts it back on the queue (regardless of the queue's capacity) when
+ * the client sends its next request, or closes it once it has been
+ * idle for sm::idleTimeout.
+ */
+class ConnectionPool {
+public:
+    // Clock used to measure how long connections wait in the queue
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Create the worker threads for the pool.
+     *
+     * \param[in] numWorkers The number of worker threads to create.
+     *
+     * \param[in] capacity The maximum number of accepted connections
+     * that can be waiting for a worker at any given time.
+     */
+    ConnectionPool(const int numWorkers, const size_t capacity) :
+        capacity(std::max<size_t>(capacity, 1)) {
+        // The self-pipe used to wake up the poller
+        if (::pipe2(wakeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+            throw std::runtime_error("Error creating pipe for poller");
+        }
+        poller = std::thread([this] { pollerMain(); });
+        for (int i = 0; i < std::max(numWorkers, 1); i++) {
+            workers.emplace_back([this] { workerMain(); });
+        }
+    }
+
+    /**
+     * Stop accepting new work, let the workers drain the queue and
+     * wait for all of the worker threads to finish.
+     */
+    ~ConnectionPool() {
+        {
+            Lock lock(queueMutex);
+            stopping = true;
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+        wakePoller();
+        poller.join();
+        ::close(wakeFds[0]);
+        ::close(wakeFds[1]);
+    }
+
+    /**
+     * Add a connection to the queue, waiting if the queue is full.
+     *
+     * \param[in] client The connection to be processed by a worker.
+     */
+    void submit(TcpStreamPtr client) {
+        Lock lock(queueMutex);
+        notFull.wait(lock, [this] {
+            return stopping || queue.size() < capacity; });
+        if (stopping) {
+            return;
+        }
+        queue.push_back({std::move(client), Clock::now()});
+        sm::acceptQueueDepth = queue.size();
+        lock.unlock();
+        notEmpty.notify_one();
+    }
+
+private:
+    // A connection waiting in the queue (or parked with the poller)
+    // along with the time it was enqueued (or parked) and the number
+    // of requests served on it so far
+    struct Entry {
+        TcpStreamPtr client;
+        Clock::time_point enqueued;
+        int served = 0;
+    };
+
+    /**
+     * The method run by each worker thread.  It repeatedly takes the
+     * oldest connection off the queue and processes it via
+     * serveConnection() until the pool is destroyed.
+     */
+    void workerMain() {
+        while (true) {
+            Lock lock(queueMutex);
+            notEmpty.wait(lock, [this] {
+                return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;  // Pool is stopping and all work is done
+            }
+            Entry entry = std::move(queue.front());
+            queue.pop_front();
+            sm::acceptQueueDepth = queue.size();
+            lock.unlock();
+            notFull.notify_one();
+            if (entry.served == 0) {
+                // Record the time the new connection spent in the
+                // queue in this worker's own counters
+                Metrics::add(Metrics::AcceptedConnections);
+                Metrics::add(Metrics::AcceptWaitNanos,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Clock::now() - entry.enqueued).count());
+            }
+            if (serveConnection(*entry.client, entry.served)) {
+                park(std::move(entry));
+            }
+        }
+    }
+
+    /**
+     * Hand an idle connection to the poller until the client sends its
+     * next request.
+     *
+     * \param[in] entry The connection to be parked.
+     */
+    void park(Entry entry) {
+        entry.enqueued = Clock::now();
+        {
+            Lock lock(parkedMutex);
+            parked.push_back(std::move(entry));
+        }
+        wakePoller();
+    }
+
+    /** Wake up the poller to have it look at the parked connections. */
+    void wakePoller() {
+        const char c = 0;
+        // If the pipe is full the poller is already due to wake up
+        ssize_t ignored = ::write(wakeFds[1], &c, 1);
+        (void) ignored;
+    }
+
+    /**
+     * The method run by the poller thread.  It waits (with poll) for
+     * any parked connection to become readable, and moves readable
+     * connections back to the queue.  Connections that have been idle
+     * for sm::idleTimeout are closed.
+     */
+    void pollerMain() {
+        std::vector<Entry> idle;
+        std::vector<pollfd> fds;
+        while (true) {
+            // Pick up the connections parked since the last poll
+            {
+                Lock lock(parkedMutex);
+                std::move(parked.begin(), parked.end(),
+                          std::back_inserter(idle));
+                parked.clear();
+            }
+            {
+                Lock lock(queueMutex);
+                if (stopping) {
+                    return;
+                }
+            }
+            // Sleep until a client sends data, a connection times out,
+            // or a connection is parked
+            fds.assign(1, {wakeFds[0], POLLIN, 0});
+            auto deadline = Clock::now() + sm::idleTimeout;
+            for (const Entry& entry : idle) {
+                fds.push_back({entry.client->socket().native_handle(),
+                               POLLIN, 0});
+                deadline = std::min(deadline,
+                                    entry.enqueued + sm::idleTimeout);
+            }
+            const auto wait = std::chrono::duration_cast<
+                std::chrono::milliseconds>(deadline - Clock::now());
+            ::poll(fds.data(), fds.size(),
+                   std::max<int>(wait.count(), 0) + 1);
+            char drain[64];
+            while (::read(wakeFds[0], drain, sizeof(drain)) > 0) {}
+            // Requeue the readable connections and drop the idle ones
+            const auto now = Clock::now();
+            std::vector<Entry> ready, stillIdle;
+            for (size_t i = 0; i < idle.size(); i++) {
+                if (fds[i + 1].revents != 0) {
+                    idle[i].enqueued = now;
+                    ready.push_back(std::move(idle[i]));
+                } else if (now - idle[i].enqueued < sm::idleTimeout) {
+                    stillIdle.push_back(std::move(idle[i]));
+                }
+            }
+            idle.swap(stillIdle);
+            if (!ready.empty()) {
+                Lock lock(queueMutex);
+                std::move(ready.begin(), ready.end(),
+                          std::back_inserter(queue));
+                sm::acceptQueueDepth = queue.size();
+                lock.unlock();
+                notEmpty.notify_all();
+            }
+        }
+    }
+
+    // The maximum number of entries permitted in the queue
+    const size_t capacity;
+    // The connections waiting to be processed, oldest first
+    std::deque<Entry> queue;
+    // Mutex and conditional variables guarding the queue
+    std::mutex queueMutex;
+    std::condition_variable notEmpty, notFull;
+    // Flag set by the destructor to shut down the workers
+    bool stopping = false;
+    // The fixed set of worker threads
+    std::vector<std::thread> workers;
+    // Idle connections handed to the poller, and the mutex guarding them
+    std::vector<Entry> parked;
+    std::mutex parkedMutex;
+    // The self-pipe used to wake up the poller (read end, write end)
+    int wakeFds[2];
+    // The thread waiting for parked connections to become readable
+    std::thread poller;
+};
+
 /**
  * Top-level method to run a custom HTTP server to process stock trade
  * requests.
@@ -291,23 +2020,340 @@ void clientThread(std::istream& is, std::ostream& os) {
  * should use at any given time.
  */
 void runServer(tcp::acceptor& server, const int maxThreads) {
+    enableDurabilityOption();
+    // Create a fixed pool of maxThreads workers up front. The queue
+    // holds a few accepted connections per worker so that the accept
+    // loop can keep accepting while all the workers are busy.
+    ConnectionPool pool(maxThreads, 4 * std::max(maxThreads, 1));
     // Process client connections one-by-one...forever
     while (true) {
         // Creates garbage-collected connection on heap 
         TcpStreamPtr client = std::make_shared<tcp::iostream>();
         server.accept(*client->rdbuf());  // wait for client to connect
-        // Now we have a I/O stream to talk to the client. Have a
-        // conversation using the protocol.
-        // Use sleep wait multithreading to prevent more detached threads from
-        // being created than maxThreads allows
-        Lock lock(sm::serverMutex);
-        // Use conditional_variable to wait for threadCount to be
-        // decremented as a detached thread terminates.
-        sm::countCond.wait(lock,
-            [maxThreads] {return sm::threadCount < maxThreads; });
-        std::thread thr([client] { clientThread(*client, *client); });
-        thr.detach();  // Process transaction independently
+        // Now we have a I/O stream to talk to the client. Hand it off
+        // to the pool to have a conversation using the protocol.
+        pool.submit(client);
+    }
+}
+
+/**
+ * One client connection served by the asynchronous engine used by
+ * runAsyncServer().  Instead of parking a thread on std::getline, the
+ * session reads with async_read_some until a complete request has
+ * been received, processes the transaction, and sends the response
+ * with async_write.  Connections are kept open for further requests,
+ * and all complete requests already in the buffer (pipelined
+ * requests) are processed before their responses are sent with a
+ * single write.  The session
+ * keeps itself alive (via shared_from_this) for as long as an
+ * operation is pending on its socket.
+ */
+class AsyncSession : public std::enable_shared_from_this<AsyncSession> {
+public:
+    /**
+     * \param[in] socket The connected socket for the client.  Its
+     * executor must be a strand, because the idle timer and the
+     * socket's handlers share the session's state.
+     *
+     * \param[in] blockingPool The thread pool used to run "batch"
+     * transactions with buys, which may wait for stock to become
+     * available.
+     */
+    AsyncSession(tcp::socket socket, thread_pool& blockingPool) :
+        socket(std::move(socket)), idleTimer(this->socket.get_executor()),
+        blockingPool(blockingPool) {}
+
+    /** Start processing requests from the client. */
+    void start() { processPipeline(); }
+
+private:
+    /**
+     * Process the complete requests that are in the buffer.  Once the
+     * buffer has no more complete requests the accumulated responses
+     * are written out, or the next request is read if there are no
+     * responses to send.
+     */
+    void processPipeline() {
+        while (keepAlive) {
+            // Parse the next request directly from the socket buffer
+            const auto data = buf.data();
+            const std::string_view text(static_cast<const char*>(data.data()),
+                                        data.size());
+            HTTPRequest request;
+            const size_t hdrLen = request.parse(text);
+            if (hdrLen == HTTPRequest::Invalid) {
+                keepAlive = false;
+                addResponse("Invalid request");
+                break;
+            }
+            const size_t bodyLen = request.getContentLength();
+            if (hdrLen != 0 && bodyLen > sm::maxBodySize) {
+                keepAlive = false;
+                addResponse("Request body too large");
+                break;
+            }
+            if (hdrLen == 0 || text.size() - hdrLen < bodyLen) {
+                break;  // The request has not been completely received
+            }
+            Transaction t = parseTransaction(request.decodeURL());
+            t.body = text.substr(hdrLen, bodyLen);
+            buf.consume(hdrLen + bodyLen);
+            keepAlive = request.isKeepAlive() &&
+                (++served < sm::maxRequestsPerConnection);
+            if (t.trans == "buy") {
+                if (!processBuy(t)) {
+                    return;
+                }
+            } else if (t.trans == "batch") {
+                if (!processBatch(t)) {
+                    return;
+                }
+            } else {
+                uint64_t lsn = 0;
+                const std::string msg = runTransaction(t, lsn);
+                addResponse(msg, lsn);
+            }
+        }
+        if (!pending.empty()) {
+            writeResponses();
+        } else if (keepAlive) {
+            readRequest();
+        }
+    }
+
+    /**
+     * Process a "buy" transaction without blocking the I/O thread.  If
+     * there is not enough stock, the buy joins the stock's queue of
+     * buyers (like buyLocked) without a thread waiting on it.  The
+     * seller (or reset) that wakes it posts the response back to the
+     * session, and the rest of the pipeline is processed then.
+     *
+     * \param[in] t The buy transaction to be processed.
+     *
+     * \return True if the response has been added, false if the buy
+     * is waiting for stock to become available.
+     */
+    bool processBuy(const Transaction& t) {
+        countTransaction(t.trans);
+        StockEntryPtr entry = sm::stockMap.find(t.stock);
+        StockLock lock;
+        if (entry != nullptr) {
+            lock = StockLock(*entry);
+        }
+        if (entry == nullptr || entry->removed) {
+            addResponse("Stock not found");
+            return true;
+        }
+        const std::string updated = "Stock " + t.stock + "'s balance updated";
+        if (t.amount <= entry->balance) {
+            updateBalance(*entry, entry->balance - t.amount);
+            addResponse(updated, entry->lastLsn);
+            return true;
+        }
+        Metrics::add(Metrics::BuyWaits);
+        const auto waitStart = std::chrono::steady_clock::now();
+        auto self = shared_from_this();
+        StockEntry* const stock = entry.get();
+        entry->buyers.push_back(std::make_shared<BuyWaiter>(t.amount,
+            [self, stock, updated, waitStart](const bool granted) {
+                // Runs in the waking thread with the stock's mutex held
+                Metrics::add(Metrics::BuyWaitNanos, std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                                              - waitStart).count());
+                const uint64_t lsn = granted ? stock->lastLsn : 0;
+                const std::string msg = granted ? updated : "Stock not found";
+                post(self->socket.get_executor(), [self, lsn, msg] {
+                    self->addResponse(msg, lsn);
+                    self->processPipeline();
+                });
+            }));
+        return false;
+    }
+
+    /**
+     * Process a "batch" transaction.  A batch without any buys cannot
+     * wait, so it is run on the I/O thread.  A batch with buys may wait
+     * for stock to become available while holding other stocks'
+     * transactions, so it is handed to the blocking pool to keep the I/O
+     * threads free to process the "sell" transactions that it waits on.
+     * The rest of the pipeline is processed once the batch finishes.
+     *
+     * \param[in] t The batch transaction to be processed.
+     *
+     * \return True if the response has been added, false if the batch
+     * is running in the blocking pool.
+     */
+    bool processBatch(const Transaction& t) {
+        countTransaction(t.trans);
+        auto batch = std::make_shared<std::vector<Transaction>>(
+            parseBatch(t.body));
+        if (std::none_of(batch->begin(), batch->end(),
+                         [](const Transaction& bt) {
+                             return bt.trans == "buy"; })) {
+            uint64_t lsn = 0;
+            const std::string msg = runBatch(*batch, lsn);
+            addResponse(msg, lsn);
+            return true;
+        }
+        auto self = shared_from_this();
+        post(blockingPool, [self, batch] {
+            uint64_t lsn = 0;
+            const std::string msg = runBatch(*batch, lsn);
+            post(self->socket.get_executor(), [self, msg, lsn] {
+                self->addResponse(msg, lsn);
+                self->processPipeline();
+            });
+        });
+        return false;
+    }
+
+    /**
+     * Read more data from the client, giving up if the connection
+     * stays idle for longer than sm::idleTimeout.  Data is read as it
+     * arrives (rather than up to the end of the headers) because a
+     * request with a body is not complete at the end of its headers.
+     */
+    void readRequest() {
+        auto self = shared_from_this();
+        idleTimer.expires_after(sm::idleTimeout);
+        idleTimer.async_wait([self](const boost::system::error_code& ec) {
+            if (!ec) {
+                boost::system::error_code ignored;
+                self->socket.close(ignored);
+            }
+        });
+        socket.async_read_some(buf.prepare(4096),
+            [self](const boost::system::error_code& ec, size_t bytes) {
+                self->idleTimer.cancel();
+                self->buf.commit(bytes);
+                if (!ec) {
+                    self->processPipeline();
+                }
+            });
+    }
+
+    /**
+     * Send all of the accumulated responses to the client in 1 write,
+     * once the changes made by their transactions have been written to
+     * the log.  The I/O thread does not wait for the log.
+     */
+    void writeResponses() {
+        response.swap(pending);
+        pending.clear();
+        auto self = shared_from_this();
+        sm::stockLog.whenDurable(std::exchange(pendingLsn, 0), [self] {
+            dispatch(self->socket.get_executor(),
+                     [self] { self->startWrite(); });
+        });
+    }
+
+    /**
+     * Write out the responses swapped in by writeResponses().
+     */
+    void startWrite() {
+        auto self = shared_from_this();
+        async_write(socket, buffer(response),
+            [self](const boost::system::error_code& ec, size_t) {
+                if (!ec && self->keepAlive) {
+                    self->processPipeline();
+                } else {
+                    boost::system::error_code ignored;
+                    self->socket.shutdown(tcp::socket::shutdown_both,
+                                          ignored);
+                }
+            });
+    }
+
+    /**
+     * Format the HTTP response for a transaction and add it to the
+     * responses to be sent to the client.
+     *
+     * \param[in] msg The message created when processing the transaction
+     *
+     * \param[in] lsn The LSN of the log record that must be on disk
+     * before the response is sent (zero if none).
+     */
+    void addResponse(const std::string& msg, const uint64_t lsn = 0) {
+        std::ostringstream os;
+        HTTPResponse(os, msg, keepAlive);
+        pending += os.str();
+        pendingLsn = std::max(pendingLsn, lsn);
+    }
+
+    // The socket connected to the client
+    tcp::socket socket;
+    // Timer to close the connection if it stays idle for too long
+    steady_timer idleTimer;
+    // Pool for batches that may block the calling thread
+    thread_pool& blockingPool;
+    // Buffer holding the HTTP requests read from the client
+    streambuf buf;
+    // Responses waiting to be sent and the responses being written
+    std::string pending, response;
+    // The LSN of the last log record that the pending responses need
+    uint64_t pendingLsn = 0;
+    // The number of requests served on this connection so far
+    int served = 0;
+    // Flag to indicate if the connection stays open after the responses
+    bool keepAlive = true;
+};
+
+/**
+ * Helper method to asynchronously accept the next client connection
+ * and start an AsyncSession for it.  It calls itself to accept the
+ * connection after that, so the acceptor always has 1 pending accept.
+ *
+ * \param[in] server The acceptor to accept connections on.
+ *
+ * \param[in] blockingPool The thread pool passed to each AsyncSession.
+ */
+void asyncAccept(tcp::acceptor& server, thread_pool& blockingPool) {
+    // Each connection gets its own strand so that its handlers never
+    // run concurrently on different io_context threads.
+    server.async_accept(make_strand(server.get_executor()),
+        [&server, &blockingPool](const boost::system::error_code& ec,
+                                 tcp::socket socket) {
+            if (!ec) {
+                std::make_shared<AsyncSession>(std::move(socket),
+                    blockingPool)->start();
+            }
+            asyncAccept(server, blockingPool);
+        });
+}
+
+/**
+ * Top-level method to run the stock trade server using asynchronous
+ * I/O.  Unlike runServer(), the number of threads does not grow with
+ * the number of connected clients: ioThreads threads run the
+ * acceptor's io_context and service every connection.
+ *
+ * \param[in] server The boost::tcp::acceptor object to be used to accept
+ * connections from various clients.
+ *
+ * \param[in] ioThreads The number of threads that run the io_context.
+ *
+ * \param[in] blockingThreads The number of threads available for
+ * "batch" transactions with buys, which may wait for stock to become
+ * available.  A single "buy" waits without holding a thread.
+ */
+void runAsyncServer(tcp::acceptor& server, const int ioThreads,
+                    const int blockingThreads = 64) {
+    enableDurabilityOption();
+    auto& service = static_cast<io_context&>(
+        query(server.get_executor(), execution::context));
+    thread_pool blockingPool(std::max(blockingThreads, 1));
+    asyncAccept(server, blockingPool);
+    // Run the io_context on the requested number of threads (including
+    // the calling thread) until it runs out of work.
+    std::vector<std::thread> threads;
+    for (int i = 1; i < ioThreads; i++) {
+        threads.emplace_back([&service] { service.run(); });
+    }
+    service.run();
+    for (auto& t : threads) {
+        t.join();
     }
+    blockingPool.join();
 }
 
 // End of source code
@@ -0,0 +1,519 @@
+/**
+ * Copyright 2021 Michael Glum
+ *
+ * A process launcher shared by the shell and the web-server in this
+ * repository.  Copying the page tables of a large (multithreaded)
+ * process for every fork() makes launching commands slow, so by
+ * default commands are started with posix_spawn, which uses vfork
+ * semantics and does not copy the parent's address space.  A launcher
+ * can also start a pool of small helper processes that spawn commands
+ * on behalf of the parent, and it records how long each launch takes.
+ */
+
+#ifndef PROCESS_LAUNCHER_H
+#define PROCESS_LAUNCHER_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The environment passed on to launched commands
+extern char **environ;
+
+/**
+ * Starts commands (with execvp-style lookup of the program) and waits
+ * for them to finish.  A launcher may be shared by several threads.
+ */
+class ProcessLauncher {
+public:
+    /** A vector of strings: a command and its arguments. */
+    using StrVec = std::vector<std::string>;
+
+    /** The ways in which a command can be started. */
+    enum class Mode {
+        Fork,   ///< fork() and execvp(), for comparison
+        Spawn,  ///< posix_spawnp() from this process
+        Helpers ///< posix_spawnp() from a pre-forked helper process
+    };
+
+    /** The raw wait status reported for a command that could not start */
+    static constexpr int LaunchFailed = 127 << 8;
+
+    /** A command that has been launched. */
+    struct Process {
+        /** The process ID, or -1 if the command could not be started. */
+        pid_t pid = -1;
+        /** The read end of a pipe from the command's standard output if
+            it was captured, otherwise -1.  The caller closes it. */
+        int output = -1;
+        /** When the command was launched. */
+        std::chrono::steady_clock::time_point started;
+        /** How long it took for the command to be started. */
+        std::chrono::microseconds launchTime{0};
+        /** The helper that started the command, or -1. */
+        int helper = -1;
+    };
+
+    /**
+     * Create a launcher.
+     *
+     * \param[in] mode The way commands are started.
+     */
+    explicit ProcessLauncher(const Mode mode = Mode::Spawn) : mode(mode) {}
+
+    /**
+     * Change the way commands are started.  This method is not thread
+     * safe: call it before commands are launched.
+     *
+     * \param[in] newMode The way commands are started from now on.
+     */
+    void setMode(const Mode newMode) { mode = newMode; }
+
+    ProcessLauncher(const ProcessLauncher&) = delete;
+    ProcessLauncher& operator=(const ProcessLauncher&) = delete;
+
+    /** Stop the helper processes (if any). */
+    ~ProcessLauncher() {
+        for (const int sock : helpers) {
+            close(sock);  // The helper exits when its socket is closed
+        }
+        for (const pid_t pid : helperPids) {
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    /**
+     * Start a pool of helper processes and use them to launch commands.
+     * Call this early, before the process becomes large or starts
+     * threads, so that each helper is a small copy of it.  When all of
+     * the helpers are busy commands are spawned directly.
+     *
+     * \param[in] count The number of helper processes.
+     */
+    void startHelpers(const size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            int socks[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+                           socks) != 0) {
+                break;
+            }
+            const pid_t pid = fork();
+            if (pid == 0) {
+                for (const int sock : helpers) {
+                    close(sock);
+                }
+                close(socks[0]);
+                helperMain(socks[1]);
+                _exit(0);
+            }
+            close(socks[1]);
+            if (pid == -1) {
+                close(socks[0]);
+                break;
+            }
+            helpers.push_back(socks[0]);
+            helperPids.push_back(pid);
+            idleHelpers.push_back(helpers.size() - 1);
+        }
+        mode = helpers.empty() ? mode : Mode::Helpers;
+    }
+
+    /**
+     * Start a command.
+     *
+     * \param[in] args The command and its arguments.
+     *
+     * \param[in] captureOutput If true the command's standard output is
+     * sent to a pipe (see Process::output), otherwise it is inherited.
+     *
+     * \return The launched command.
+     */
+    Process launch(const StrVec& args, const bool captureOutput = false) {
+        int pipeFds[2] = {-1, -1};
+        if (captureOutput && pipe2(pipeFds, O_CLOEXEC) != 0) {
+            return Process();
+        }
+        Process proc = launch(args, -1, pipeFds[1]);
+        if (captureOutput) {
+            close(pipeFds[1]);
+            if (proc.pid == -1) {
+                close(pipeFds[0]);
+            } else {
+                proc.output = pipeFds[0];
+            }
+        }
+        return proc;
+    }
+
+    /**
+     * Start a command with the given standard input and output (e.g. a
+     * stage of a pipeline).  The descriptors are not closed.
+     *
+     * \param[in] args The command and its arguments.
+     *
+     * \param[in] inFd The descriptor to use as the command's standard
+     * input, or -1 to inherit it.
+     *
+     * \param[in] outFd The descriptor to use as the command's standard
+     * output, or -1 to inherit it.
+     *
+     * \return The launched command.
+     */
+    Process launch(const StrVec& args, const int inFd, const int outFd) {
+        const auto start = std::chrono::steady_clock::now();
+        Process proc;
+        proc.started = start;
+        if (args.empty()) {
+            return proc;
+        }
+        const Redirects fds = {inFd, outFd};
+        if (mode == Mode::Helpers && (proc.helper = getHelper()) != -1) {
+            proc.pid = helperSpawn(helpers[proc.helper], args, fds);
+            if (proc.pid == -1) {
+                releaseHelper(proc.helper);
+                proc.helper = -1;
+            }
+        } else if (mode == Mode::Fork) {
+            proc.pid = forkExec(args, fds);
+        } else {
+            proc.pid = spawn(args, fds);
+        }
+        proc.launchTime = std::chrono::duration_cast<
+            std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                       start);
+        launches++;
+        totalLaunchTime += proc.launchTime.count();
+        for (auto max = maxLaunchTime.load(); max < proc.launchTime.count() &&
+                 !maxLaunchTime.compare_exchange_weak(max,
+                     proc.launchTime.count());) {}
+        return proc;
+    }
+
+    /**
+     * Wait for a command to finish.
+     *
+     * \param[in,out] proc The command to wait for.
+     *
+     * \param[out] usage If not nullptr, the resources (CPU time etc.)
+     * used by the command.
+     *
+     * \return The raw wait status of the command (as from waitpid), or
+     * LaunchFailed if it could not be started.
+     */
+    int wait(Process& proc, rusage* usage = nullptr) {
+        Exit exit;
+        if (proc.helper != -1) {
+            exit = helperExit(proc);
+        } else if (proc.pid != -1) {
+            while (wait4(proc.pid, &exit.status, 0, &exit.usage) == -1 &&
+                   errno == EINTR) {}
+        }
+        proc.pid = -1;
+        if (usage != nullptr) {
+            *usage = exit.usage;
+        }
+        return exit.status;
+    }
+
+    /**
+     * Wait for whichever of several commands finishes first.  Commands
+     * started directly are reaped with wait4(-1), so no other children
+     * (apart from helpers) may be waited for elsewhere meanwhile.
+     *
+     * \param[in,out] procs The commands to wait for.  They must not be
+     * empty.
+     *
+     * \param[out] status The raw wait status of the command that
+     * finished (see wait).
+     *
+     * \param[out] usage If not nullptr, the resources used by it.
+     *
+     * \return The index in procs of the command that finished.
+     */
+    size_t waitAny(const std::vector<Process*>& procs, int& status,
+                   rusage* usage = nullptr) {
+        std::vector<pollfd> pfds;
+        std::vector<size_t> polled;
+        bool direct = false;
+        for (size_t i = 0; i < procs.size(); i++) {
+            if (procs[i]->pid == -1) {
+                return finish(*procs[i], Exit(), i, status, usage);
+            } else if (procs[i]->helper != -1) {
+                pfds.push_back({helpers[procs[i]->helper], POLLIN, 0});
+                polled.push_back(i);
+            } else {
+                direct = true;
+            }
+        }
+        while (true) {
+            if (!pfds.empty()) {
+                // Poll the helpers, checking on direct children every 10 ms
+                if (::poll(pfds.data(), pfds.size(), direct ? 10 : -1) > 0) {
+                    for (size_t i = 0; i < pfds.size(); i++) {
+                        if (pfds[i].revents != 0) {
+                            Process& proc = *procs[polled[i]];
+                            return finish(proc, helperExit(proc), polled[i],
+                                          status, usage);
+                        }
+                    }
+                }
+            }
+            if (direct) {
+                Exit exit;
+                const pid_t pid = wait4(-1, &exit.status, pfds.empty() ? 0 :
+                                        WNOHANG, &exit.usage);
+                for (size_t i = 0; pid > 0 && i < procs.size(); i++) {
+                    if (procs[i]->pid == pid && procs[i]->helper == -1) {
+                        return finish(*procs[i], exit, i, status, usage);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Print the number of commands launched and how long launching them
+     * took.
+     *
+     * \param[out] os The output stream to print to.
+     */
+    void printStats(std::ostream& os) const {
+        const size_t count = launches;
+        os << "launches: " << count << "\nmean launch us: "
+           << (count == 0 ? 0 : totalLaunchTime / count)
+           << "\nmax launch us: " << maxLaunchTime << '\n';
+    }
+
+private:
+    // The descriptors for a command's standard input and output
+    using Redirects = std::array<int, 2>;
+
+    // How a command finished, as reported by wait4 (or a helper)
+    struct Exit {
+        int status = LaunchFailed;
+        rusage usage = {};
+    };
+
+    /**
+     * Receive how a command started by a helper finished and return the
+     * helper to the pool of idle ones.
+     */
+    Exit helperExit(Process& proc) {
+        Exit exit;
+        if (recv(helpers[proc.helper], &exit, sizeof(exit), 0) !=
+            sizeof(exit)) {
+            exit = Exit();
+        }
+        releaseHelper(proc.helper);
+        proc.helper = -1;
+        return exit;
+    }
+
+    /** Helper method for waitAny to report a command that finished. */
+    static size_t finish(Process& proc, const Exit& exit, const size_t index,
+                         int& status, rusage* usage) {
+        proc.pid = -1;
+        status = exit.status;
+        if (usage != nullptr) {
+            *usage = exit.usage;
+        }
+        return index;
+    }
+
+    /** \return A null-terminated array of pointers to the arguments. */
+    static std::vector<char*> makeArgv(const StrVec& args) {
+        std::vector<char*> argv;
+        for (const std::string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        return argv;
+    }
+
+    /**
+     * Start a command with posix_spawnp.
+     *
+     * \param[in] args The command and its arguments.
+     *
+     * \param[in] fds The descriptors to use as the command's standard
+     * input and output (-1 to inherit them).
+     *
+     * \return The process ID, or -1 if the command could not be started.
+     */
+    static pid_t spawn(const StrVec& args, const Redirects& fds) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        for (int i = 0; i < 2; i++) {
+            if (fds[i] != -1) {
+                posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+            }
+        }
+        std::vector<char*> argv = makeArgv(args);
+        pid_t pid = -1;
+        const int err = posix_spawnp(&pid, argv[0], &actions, nullptr,
+                                     argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        return (err == 0) ? pid : -1;
+    }
+
+    /** Start a command with fork and execvp (see spawn). */
+    static pid_t forkExec(const StrVec& args, const Redirects& fds) {
+        std::vector<char*> argv = makeArgv(args);
+        const pid_t pid = fork();
+        if (pid == 0) {
+            for (int i = 0; i < 2; i++) {
+                if (fds[i] != -1) {
+                    dup2(fds[i], i);
+                }
+            }
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        return pid;
+    }
+
+    /**
+     * Have a helper start a command.  The arguments are sent as one
+     * message (separated by '\0' characters), after a byte whose bits
+     * say which of the command's standard input and output descriptors
+     * are sent along with the message.
+     *
+     * \return The process ID, or -1 if the command could not be started.
+     */
+    static pid_t helperSpawn(const int sock, const StrVec& args,
+                             const Redirects& fds) {
+        std::string msg(1, '\0');
+        int sent[2], numSent = 0;
+        for (int i = 0; i < 2; i++) {
+            if (fds[i] != -1) {
+                msg[0] |= 1 << i;
+                sent[numSent++] = fds[i];
+            }
+        }
+        for (const std::string& arg : args) {
+            msg.append(arg.c_str(), arg.size() + 1);
+        }
+        iovec iov = {msg.data(), msg.size()};
+        msghdr hdr = {};
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sent))];
+        if (numSent > 0) {
+            hdr.msg_control = control;
+            hdr.msg_controllen = CMSG_SPACE(numSent * sizeof(int));
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(numSent * sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), sent, numSent * sizeof(int));
+        }
+        pid_t pid = -1;
+        if (msg.size() > MaxMessage || sendmsg(sock, &hdr, 0) == -1 ||
+            recv(sock, &pid, sizeof(pid), 0) != sizeof(pid)) {
+            return -1;
+        }
+        return pid;
+    }
+
+    /**
+     * The loop run by each helper process: spawn the commands it is
+     * sent, reporting each one's process ID and then how it finished,
+     * until the parent closes the socket.
+     *
+     * \param[in] sock The helper's end of the socket to the parent.
+     */
+    static void helperMain(const int sock) {
+        std::vector<char> buf(MaxMessage);
+        while (true) {
+            iovec iov = {buf.data(), buf.size()};
+            alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+            msghdr hdr = {};
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = sizeof(control);
+            const ssize_t len = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+            if (len <= 0) {
+                return;
+            }
+            int received[2] = {-1, -1};
+            if (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr &&
+                cmsg->cmsg_type == SCM_RIGHTS) {
+                std::memcpy(received, CMSG_DATA(cmsg), std::min(
+                    sizeof(received), cmsg->cmsg_len - CMSG_LEN(0)));
+            }
+            Redirects fds = {-1, -1};
+            for (int i = 0, next = 0; i < 2; i++) {
+                if (buf[0] & (1 << i)) {
+                    fds[i] = received[next++];
+                }
+            }
+            StrVec args;
+            for (const char *arg = buf.data() + 1, *end = buf.data() + len;
+                 arg < end; arg += args.back().size() + 1) {
+                args.emplace_back(arg, strnlen(arg, end - arg));
+            }
+            const pid_t pid = args.empty() ? -1 : spawn(args, fds);
+            for (const int fd : received) {
+                if (fd != -1) {
+                    close(fd);
+                }
+            }
+            send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+            if (pid != -1) {
+                Exit exit;
+                while (wait4(pid, &exit.status, 0, &exit.usage) == -1 &&
+                       errno == EINTR) {}
+                send(sock, &exit, sizeof(exit), MSG_NOSIGNAL);
+            }
+        }
+    }
+
+    /** \return The index of an idle helper, or -1 if all are busy. */
+    int getHelper() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idleHelpers.empty()) {
+            return -1;
+        }
+        const int helper = idleHelpers.back();
+        idleHelpers.pop_back();
+        return helper;
+    }
+
+    /** Return a helper to the pool of idle ones. */
+    void releaseHelper(const int helper) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idleHelpers.push_back(helper);
+    }
+
+    // The largest command (including '\0' separators) a helper accepts
+    static constexpr size_t MaxMessage = 64 * 1024;
+
+    // The way commands are started
+    Mode mode;
+    // The sockets to the helper processes and their process IDs
+    std::vector<int> helpers;
+    std::vector<pid_t> helperPids;
+    // The helpers that are not starting (or waiting for) a command
+    std::vector<int> idleHelpers;
+    std::mutex mutex;
+    // The number of launches and their total and maximum durations (us)
+    std::atomic<size_t> launches{0};
+    std::atomic<int64_t> totalLaunchTime{0}, maxLaunchTime{0};
+};
+
+#endif  // PROCESS_LAUNCHER_H
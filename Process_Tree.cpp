@@ -1,12 +1,27 @@
 /**
  * Copyright 2021 Michael Glum
+ *
+ * Prints the process hierarchies (ancestors) or subtrees (descendants)
+ * of processes listed in the output of "ps -ef".
  */
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 #include "hw4.h"
 
 /** Helper method to load process information into 2 given unordered
@@ -81,31 +96,463 @@ ProcTree::printProcessTree(const int pid, bool printHeader) const {
             << pidCmd.at(pid) << "\n";
 }
 
+/**
+ * A table of processes for answering many process tree queries.  The
+ * processes are kept as a structure of arrays in which each process is
+ * linked (by index) to its parent, its first child, and its next
+ * sibling, so that queries walk the tree iteratively without any
+ * hashing.  The printed ancestor path of each process that has been
+ * queried is cached and shared by later queries for it or any of its
+ * descendants.
+ */
+class ProcessTable {
+public:
+    /** The index used for "no process". */
+    static constexpr uint32_t None = UINT32_MAX;
+
+    ProcessTable() = default;
+    ProcessTable(const ProcessTable&) = delete;
+    ProcessTable& operator=(const ProcessTable&) = delete;
+
+    /** Unmap the file that the commands refer to. */
+    ~ProcessTable() {
+        if (mapping != nullptr) {
+            munmap(mapping, mappingSize);
+        }
+    }
+
+    /** Load the processes listed by "ps -ef" in a file (see
+        loadProcessList).  The file is memory mapped and the commands
+        refer to the mapping instead of being copied.  A large file is
+        split into chunks (at line boundaries) that are parsed in
+        parallel.  If the file cannot be mapped (e.g. it is a pipe) it
+        is read into memory instead.
+
+        \param[in] path The file from where process information is to
+        be loaded.
+
+        \param[in] threads The number of threads to parse with.
+
+        \return False if the file could not be read.
+    */
+    bool load(const std::string& path, size_t threads) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd == -1) {
+            return false;
+        } else if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+                   info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE,
+                              fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, info.st_size, MADV_SEQUENTIAL);
+                mapping = data;
+                mappingSize = info.st_size;
+            }
+        }
+        if (mapping == nullptr) {
+            char buf[65536];
+            for (ssize_t len; (len = read(fd, buf, sizeof(buf))) > 0;) {
+                text.append(buf, len);
+            }
+        }
+        close(fd);
+        const std::string_view data = (mapping != nullptr) ?
+            std::string_view(static_cast<const char*>(mapping), mappingSize)
+            : std::string_view(text);
+        // Skip header line
+        const size_t start = std::min(data.find('\n'), data.size() - 1) + 1;
+        parse(data.substr(std::min(start, data.size())), threads);
+        return true;
+    }
+
+    /** Load the processes running on this machine straight from /proc,
+        with their commands in the form printed by "ps -ef".
+    */
+    void loadFromProc() {
+        std::vector<Entry> entries;
+        std::vector<size_t> offsets;
+        DIR* dir = opendir("/proc");
+        for (dirent* ent; dir != nullptr && (ent = readdir(dir)) != nullptr;) {
+            int pid = 0;
+            const char* name = ent->d_name;
+            const auto res = std::from_chars(name, name + strlen(name), pid);
+            if (res.ec != std::errc() || *res.ptr != '\0') {
+                continue;
+            }
+            // The stat file is "pid (comm) state ppid ...", where comm
+            // may itself contain spaces and parentheses
+            const std::string proc = "/proc/" + std::string(name);
+            const std::string stat = readFile(proc + "/stat");
+            const size_t open = stat.find('('), close = stat.rfind(')');
+            int ppid = 0;
+            if (open == std::string::npos || close == std::string::npos ||
+                close + 4 >= stat.size() ||
+                std::from_chars(stat.data() + close + 4, stat.data() +
+                                stat.size(), ppid).ec != std::errc()) {
+                continue;  // The process has exited
+            }
+            // The arguments are separated by '\0' characters.  Kernel
+            // threads have none, so ps shows their name in brackets.
+            std::string cmd = readFile(proc + "/cmdline");
+            std::replace(cmd.begin(), cmd.end(), '\0', ' ');
+            while (!cmd.empty() && cmd.back() == ' ') {
+                cmd.pop_back();
+            }
+            if (cmd.empty()) {
+                cmd = "[" + stat.substr(open + 1, close - open - 1) + "]";
+            }
+            offsets.push_back(text.size());
+            text += cmd;
+            entries.push_back({pid, ppid, {nullptr, cmd.size()}});
+        }
+        if (dir != nullptr) {
+            closedir(dir);
+        }
+        // The text is complete, so the commands can now refer to it
+        for (size_t i = 0; i < entries.size(); i++) {
+            entries[i].cmd = std::string_view(text.data() + offsets[i],
+                                              entries[i].cmd.size());
+        }
+        add(entries);
+        link();
+    }
+
+    /** Print the process hierarchy (from the root down) for a process,
+        in the same format as ProcTree::printProcessTree.
+
+        \param[in] pid The PID whose ancestors are to be printed.
+
+        \param[out] os The output stream to print to.
+
+        \return False if the PID is not in the table.
+    */
+    bool printAncestors(const int pid, std::ostream& os) const {
+        os << "Process tree for PID: " << pid << "\nPID\tPPID\tCMD\n";
+        const uint32_t i = find(pid);
+        if (i != None) {
+            os << ancestorPath(i);
+        }
+        return i != None || pid == 0;
+    }
+
+    /** Print a process and all of its descendants (depth first, with
+        children in the order they were listed).
+
+        \param[in] pid The PID whose subtree is to be printed.
+
+        \param[out] os The output stream to print to.
+
+        \return False if the PID is not in the table.
+    */
+    bool printDescendants(const int pid, std::ostream& os) const {
+        os << "Descendants of PID: " << pid << "\nPID\tPPID\tCMD\n";
+        const uint32_t root = find(pid);
+        if (root == None) {
+            return false;
+        }
+        std::string rows;
+        // If the parent links form a cycle, the root is also 1 of its
+        // own descendants.  It is skipped there, so that the walk ends.
+        auto skipRoot = [this, root](const uint32_t i) {
+            return (i == root) ? nextSibling[i] : i; };
+        // Walk the subtree without recursion, using the sibling links
+        for (uint32_t i = root; i != None;) {
+            appendRow(i, rows);
+            const uint32_t child = skipRoot(firstChild[i]);
+            if (child != None) {
+                i = child;
+                continue;
+            }
+            while (i != root && skipRoot(nextSibling[i]) == None) {
+                i = parent[i];
+            }
+            i = (i == root) ? None : skipRoot(nextSibling[i]);
+        }
+        os << rows;
+        return true;
+    }
+
+private:
+    // One process read from a listing
+    struct Entry {
+        int pid, ppid;
+        std::string_view cmd;
+    };
+
+    /** \return The contents of a (small) file, or "" if it cannot be
+        read. */
+    static std::string readFile(const std::string& path) {
+        std::string contents;
+        const int fd = open(path.c_str(), O_RDONLY);
+        char buf[4096];
+        for (ssize_t len; fd != -1 && (len = read(fd, buf, sizeof(buf))) > 0;) {
+            contents.append(buf, len);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        return contents;
+    }
+
+    /** Parse the lines of "ps -ef" output (after the header line) in
+        chunks, in parallel, and add the processes in the order listed.
+    */
+    void parse(const std::string_view lines, size_t threads) {
+        // Use about 1 thread per MB, so small files are parsed serially
+        threads = std::max<size_t>(1, std::min(threads, lines.size() >> 20));
+        const size_t chunkSize = lines.size() / threads;
+        std::vector<std::string_view> chunks;
+        for (size_t start = 0; start < lines.size();) {
+            // Each chunk ends at the first newline after its share
+            const size_t nl = (chunks.size() + 1 == threads) ?
+                std::string_view::npos : lines.find('\n', start + chunkSize);
+            const size_t end = std::min(nl, lines.size() - 1) + 1;
+            chunks.push_back(lines.substr(start, end - start));
+            start = end;
+        }
+        std::vector<std::vector<Entry>> entries(chunks.size());
+        std::vector<std::thread> parsers;
+        for (size_t i = 1; i < chunks.size(); i++) {
+            parsers.emplace_back(parseChunk, chunks[i], std::ref(entries[i]));
+        }
+        if (!chunks.empty()) {
+            parseChunk(chunks[0], entries[0]);
+        }
+        for (std::thread& parser : parsers) {
+            parser.join();
+        }
+        size_t count = 0;
+        for (const auto& chunk : entries) {
+            count += chunk.size();
+        }
+        pids.reserve(count);
+        ppids.reserve(count);
+        cmds.reserve(count);
+        index.reserve(count);
+        for (const auto& chunk : entries) {
+            add(chunk);
+        }
+        link();
+    }
+
+    /** Parse complete lines of "ps -ef" output.  The fields are found
+        with memchr, and each command is what follows the space after the
+        TIME field (as in loadProcessList).  Lines without a PID, PPID,
+        and command are skipped.
+
+        \param[in] chunk The lines to be parsed.
+
+        \param[out] entries The processes that were listed.
+    */
+    static void parseChunk(const std::string_view chunk,
+                           std::vector<Entry>& entries) {
+        const char* pos = chunk.data();
+        const char* const end = pos + chunk.size();
+        while (pos < end) {
+            const char* nl = static_cast<const char*>(
+                memchr(pos, '\n', end - pos));
+            const char* const eol = (nl != nullptr) ? nl : end;
+            // Find the first 7 fields: UID PID PPID C STIME TTY TIME
+            std::string_view fields[7];
+            int numFields = 0;
+            for (const char* p = pos; numFields < 7 && p < eol;) {
+                while (p < eol && (*p == ' ' || *p == '\t')) {
+                    p++;
+                }
+                const char* space = static_cast<const char*>(
+                    memchr(p, ' ', eol - p));
+                const char* fieldEnd = (space != nullptr) ? space : eol;
+                if (fieldEnd > p) {
+                    fields[numFields++] = std::string_view(p, fieldEnd - p);
+                }
+                p = fieldEnd;
+            }
+            const char* cmd = (numFields == 7) ? fields[6].data() +
+                fields[6].size() + 1 : eol;
+            Entry entry;
+            if (cmd < eol && number(fields[1], entry.pid) &&
+                number(fields[2], entry.ppid)) {
+                entry.cmd = std::string_view(cmd, eol - cmd);
+                entries.push_back(entry);
+            }
+            pos = eol + 1;
+        }
+    }
+
+    /** \return True if a field is a number (which is stored in value). */
+    static bool number(const std::string_view field, int& value) {
+        const auto res = std::from_chars(field.data(), field.data() +
+                                         field.size(), value);
+        return res.ec == std::errc() && res.ptr == field.data() + field.size();
+    }
+
+    /** Add processes to the arrays.  A PID that is listed again
+        replaces the earlier entry.
+    */
+    void add(const std::vector<Entry>& entries) {
+        for (const Entry& entry : entries) {
+            const uint32_t i = index.emplace(entry.pid, pids.size())
+                .first->second;
+            if (i == pids.size()) {
+                pids.push_back(entry.pid);
+                ppids.emplace_back();
+                cmds.emplace_back();
+            }
+            ppids[i] = entry.ppid;
+            cmds[i] = entry.cmd;
+        }
+    }
+
+    /** \return The index of a process, or None if it is not listed. */
+    uint32_t find(const int pid) const {
+        const auto it = index.find(pid);
+        return (it == index.end()) ? None : it->second;
+    }
+
+    /** Link each process to its parent, first child, and next sibling.
+        PID 0 (the parent of the first processes) is not part of the
+        tree, and neither is a parent that is not listed.
+    */
+    void link() {
+        const size_t count = pids.size();
+        parent.assign(count, None);
+        firstChild.assign(count, None);
+        nextSibling.assign(count, None);
+        // Add children in reverse, so they end up in the order listed
+        for (size_t i = count; i-- > 0;) {
+            const uint32_t p = (ppids[i] == 0 || ppids[i] == pids[i]) ?
+                None : find(ppids[i]);
+            if (p != None) {
+                parent[i] = p;
+                nextSibling[i] = firstChild[p];
+                firstChild[p] = i;
+            }
+        }
+    }
+
+    /** Append the row ("PID\tPPID\tCMD\n") for a process to a string. */
+    void appendRow(const uint32_t i, std::string& out) const {
+        out += std::to_string(pids[i]);
+        out += '\t';
+        out += std::to_string(ppids[i]);
+        out += '\t';
+        out += cmds[i];
+        out += '\n';
+    }
+
+    /** \return The rows for a process and its ancestors, from the root
+        down.  The walk up the tree stops at the nearest ancestor whose
+        rows are cached, and the result is cached (while the cache is
+        below MaxCacheBytes) for later queries.
+    */
+    const std::string& ancestorPath(const uint32_t i) const {
+        if (const auto it = pathCache.find(i); it != pathCache.end()) {
+            return it->second;
+        }
+        // The walk also stops if the parent links form a cycle.
+        std::vector<uint32_t> uncached;
+        uint32_t j = i;
+        auto cached = pathCache.end();
+        while (j != None && uncached.size() < pids.size() &&
+               (cached = pathCache.find(j)) == pathCache.end()) {
+            uncached.push_back(j);
+            j = parent[j];
+        }
+        std::string path = (cached != pathCache.end()) ? cached->second : "";
+        for (auto k = uncached.rbegin(); k != uncached.rend(); k++) {
+            appendRow(*k, path);
+        }
+        if (cacheBytes + path.size() > MaxCacheBytes) {
+            scratch = std::move(path);
+            return scratch;
+        }
+        cacheBytes += path.size();
+        return pathCache[i] = std::move(path);
+    }
+
+    // The most memory used for the cached ancestor paths
+    static constexpr size_t MaxCacheBytes = 64 << 20;
+
+    // The processes, as a structure of arrays
+    std::vector<int> pids, ppids;
+    // The commands refer to the mapped file or to text
+    std::vector<std::string_view> cmds;
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    std::string text;
+    // The links between the processes (as indexes)
+    std::vector<uint32_t> parent, firstChild, nextSibling;
+    // The index of each PID in the arrays
+    std::unordered_map<int, uint32_t> index;
+    // The rows printed for the ancestors of queried processes, their size,
+    // and the rows for a process when the cache is full
+    mutable std::unordered_map<uint32_t, std::string> pathCache;
+    mutable size_t cacheBytes = 0;
+    mutable std::string scratch;
+};
+
 /** Main method which calls the helper methods of this program
         
-    Takes command line arguments specifying the file to be read and
- *  the PID who's process tree will be determined. Additionally, this
- *  method creates and instance of the ProcTree class to call helper
- *  methods to process the data.
+    Takes command line arguments specifying the file to be read (or
+ *  "/proc" to read the running processes directly) and the PIDs whose
+ *  process trees will be determined. Each PID may be
+ *  preceded by "-d" to print its descendants instead, and "-" reads
+ *  further PIDs (and "-d PID" pairs) from the standard input. This
+ *  method loads the processes into a ProcessTable that answers all of
+ *  the queries.
 
     \param[in] argc The integer number of arguments passed
  *  \param[in] *argv[] A list of char pointers to the command line
  *  arguments
 */
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    if (argc < 3) {
         std::cerr << "Specify ProcessListFile and PIDs\n";
         return 1;
     }
-    // Create file stream to process data
-    std::ifstream is(argv[1]);
-    // Create instance of ProcTree class for calling helper methods
-    ProcTree pt;
-    // Load data from file into an unordered map
-    pt.loadProcessList(is);
-    // Get the PID from the command line and convert it to an integer
-    int pid = atoi(argv[2]);
-    // Print the process tree associated with the given PID
-    pt.printProcessTree(pid , true);
-    return 0;
+    // Load data from the file (or /proc) into a table of processes
+    ProcessTable table;
+    if (std::string(argv[1]) == "/proc") {
+        table.loadFromProc();
+    } else if (!table.load(argv[1], std::thread::hardware_concurrency())) {
+        std::cerr << "Unable to read " << argv[1] << "\n";
+        return 1;
+    }
+    // Answer the queries, collecting the output in a large buffer
+    std::ios_base::sync_with_stdio(false);
+    int status = 0;
+    bool descendants = false;
+    auto query = [&](const std::string& word) {
+        if (word == "-d") {
+            descendants = true;
+            return;
+        }
+        int pid = 0;
+        const auto res = std::from_chars(word.data(), word.data() +
+                                         word.size(), pid);
+        if (res.ec != std::errc() || res.ptr != word.data() + word.size()) {
+            std::cerr << "PID " << word << " not found\n";
+            status = 2;
+            descendants = false;
+            return;
+        }
+        const bool found = descendants ? table.printDescendants(pid, std::cout)
+            : table.printAncestors(pid, std::cout);
+        if (!found) {
+            std::cerr << "PID " << pid << " not found\n";
+            status = 2;
+        }
+        descendants = false;
+    };
+    for (int i = 2; i < argc; i++) {
+        if (std::string(argv[i]) == "-") {
+            for (std::string word; std::cin >> word;) {
+                query(word);
+            }
+        } else {
+            query(argv[i]);
+        }
+    }
+    return status;
 }
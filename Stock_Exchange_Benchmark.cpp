@@ -0,0 +1,464 @@
+/**
+ * Copyright 2021 Michael Glum
+ *
+ * A load-generator and latency benchmark for the stock exchange
+ * web-server (Multithreaded_Stock_Exchange_Web_Server.cpp).
+ *
+ * The benchmark opens many concurrent persistent connections and
+ * replays a configurable mix of create/buy/sell/status transactions,
+ * optionally skewed toward a few hot stocks (using a Zipf
+ * distribution).  Each connection records the latency of every
+ * transaction in its own HDR-style histogram; the histograms are
+ * merged at the end of a run to report throughput along with p50,
+ * p99, and p99.9 latencies.
+ *
+ * The benchmark can either drive an already running server (--port)
+ * or, with --sweep, start the server in this process (via runServer)
+ * once for each given maxThreads value, so that lock contention and
+ * thread-pool regressions show up as a change across the sweep.
+ *
+ * On its own the benchmark builds with:
+ *
+ *   g++ -std=c++17 -O2 Stock_Exchange_Benchmark.cpp -lpthread
+ *
+ * --sweep is only available when STOCK_BENCHMARK_SWEEP is defined and
+ * the server's source (and its Stock.h) is compiled in as well:
+ *
+ *   g++ -std=c++17 -O2 -DSTOCK_BENCHMARK_SWEEP Stock_Exchange_Benchmark.cpp
+ *       Multithreaded_Stock_Exchange_Web_Server.cpp -lpthread
+ */
+
+#include <boost/asio.hpp>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+// Convenience namespace declarations to streamline the code below
+using namespace boost::asio;
+using namespace boost::asio::ip;
+
+// Clock used to measure latencies
+using Clock = std::chrono::steady_clock;
+
+#ifdef STOCK_BENCHMARK_SWEEP
+// Prototype for the server method defined in
+// Multithreaded_Stock_Exchange_Web_Server.cpp (used only by --sweep)
+void runServer(tcp::acceptor& server, const int maxThreads);
+#endif
+
+/**
+ * A histogram of latencies (in nanoseconds) in the style of an HDR
+ * histogram: values are grouped by their power of 2, and each power of
+ * 2 is split into a fixed number of linear sub-buckets.  This gives
+ * every recorded value a relative error of under 1% with a small,
+ * fixed amount of memory, and histograms are merged by adding buckets.
+ */
+class LatencyHistogram {
+public:
+    /** The number of linear sub-buckets in each power of 2. */
+    static constexpr int SubBuckets = 128;
+
+    /** The number of powers of 2 covered (values up to 2^48 ns). */
+    static constexpr int Magnitudes = 48;
+
+    LatencyHistogram() : counts(SubBuckets * Magnitudes, 0) {}
+
+    /**
+     * Record 1 value in the histogram.
+     *
+     * \param[in] nanos The value to be recorded.
+     */
+    void record(const uint64_t nanos) {
+        counts[bucketOf(nanos)]++;
+        total++;
+        maxValue = std::max(maxValue, nanos);
+    }
+
+    /**
+     * Add the values recorded in another histogram to this one.
+     *
+     * \param[in] other The histogram to be merged into this one.
+     */
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    /**
+     * \param[in] quantile The quantile of interest, e.g. 0.99.
+     *
+     * \return The (approximate) value at the given quantile.
+     */
+    uint64_t percentile(const double quantile) const {
+        const uint64_t rank = std::max<uint64_t>(1,
+            static_cast<uint64_t>(std::ceil(quantile * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            if ((seen += counts[i]) >= rank) {
+                return std::min(valueOf(i), maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+    /** \return The number of values recorded. */
+    uint64_t count() const { return total; }
+
+    /** \return The largest value recorded. */
+    uint64_t max() const { return maxValue; }
+
+private:
+    /** \return The index of the bucket for a value. */
+    static size_t bucketOf(const uint64_t value) {
+        if (value < SubBuckets) {
+            return value;
+        }
+        // Shift the value so that it falls in [SubBuckets, 2 * SubBuckets)
+        const int magnitude = 64 - __builtin_clzll(value) - 7;
+        const size_t bucket = magnitude * SubBuckets +
+            ((value >> (magnitude - 1)) - SubBuckets);
+        return std::min(bucket, size_t(SubBuckets) * Magnitudes - 1);
+    }
+
+    /** \return The largest value that maps to a given bucket. */
+    static uint64_t valueOf(const size_t bucket) {
+        if (bucket < SubBuckets) {
+            return bucket;
+        }
+        const int magnitude = bucket / SubBuckets;
+        return ((bucket % SubBuckets + SubBuckets + 1) <<
+                (magnitude - 1)) - 1;
+    }
+
+    // The number of values in each bucket
+    std::vector<uint64_t> counts;
+    // The number of values recorded and the largest value recorded
+    uint64_t total = 0, maxValue = 0;
+};
+
+/**
+ * The settings for a benchmark run, set from command-line arguments.
+ */
+struct Settings {
+    std::string host = "localhost", port = "8080";
+    // The number of concurrent client connections
+    int connections = 64;
+    // How long each run lasts
+    std::chrono::seconds duration{10};
+    // The number of stocks and the Zipf exponent (0 = uniform) used to
+    // pick the stock for each transaction
+    int stocks = 100;
+    double skew = 1.0;
+    // The relative weights of create, buy, sell, and status
+    int mix[4] = {1, 40, 40, 19};
+    // The maxThreads values to run the in-process server with
+    std::vector<int> sweep;
+};
+
+/**
+ * The results of a benchmark run for 1 client connection.
+ */
+struct ClientResult {
+    LatencyHistogram latency;
+    uint64_t errors = 0, reconnects = 0;
+};
+
+/**
+ * Helper method to send 1 GET request on a persistent connection and
+ * read the HTTP response.
+ *
+ * \param[in,out] conn The connection to the server.
+ *
+ * \param[in] path The path (including the transaction) to request.
+ *
+ * \param[out] keepAlive Set to false if the server closes the
+ * connection after this response.
+ *
+ * \return The body of the response, or an empty string on error.
+ */
+std::string sendRequest(tcp::iostream& conn, const std::string& path,
+                        bool& keepAlive) {
+    const std::string request = "GET " + path + " HTTP/1.1\r\n"
+        "Host: benchmark\r\n\r\n";
+    conn.write(request.data(), request.size()).flush();
+    std::string line;
+    if (!std::getline(conn, line) || line.find(" 200 ") == std::string::npos) {
+        keepAlive = false;
+        return "";
+    }
+    size_t contentLength = 0;
+    keepAlive = true;
+    for (std::string hdr; std::getline(conn, hdr) && !hdr.empty()
+         && hdr != "\r";) {
+        std::transform(hdr.begin(), hdr.end(), hdr.begin(), ::tolower);
+        if (hdr.compare(0, 15, "content-length:") == 0) {
+            contentLength = std::stoul(hdr.substr(15));
+        } else if (hdr.find("connection: close") == 0) {
+            keepAlive = false;
+        }
+    }
+    std::string body(contentLength, '\0');
+    conn.read(&body[0], contentLength);
+    keepAlive = keepAlive && conn.good();
+    return conn.good() ? body : "";
+}
+
+/**
+ * The method run by each client thread.  It sends transactions on a
+ * persistent connection (reconnecting when the server closes it)
+ * until the end time is reached.
+ *
+ * \param[in] settings The benchmark settings.
+ *
+ * \param[in] port The port of the server.
+ *
+ * \param[in] cdf The cumulative distribution used to pick stocks.
+ *
+ * \param[in] seed The seed for this client's random numbers.
+ *
+ * \param[in] end When the client should stop.
+ *
+ * \param[out] result The latencies and error counts for this client.
+ */
+void clientMain(const Settings& settings, const std::string& port,
+                const std::vector<double>& cdf, const unsigned int seed,
+                const Clock::time_point end, ClientResult& result) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::uniform_int_distribution<int> amount(1, 10);
+    const int totalWeight = settings.mix[0] + settings.mix[1] +
+        settings.mix[2] + settings.mix[3];
+    std::uniform_int_distribution<int> pick(0, std::max(totalWeight, 1) - 1);
+    const char* const Trans[] = {"create", "buy", "sell", "status"};
+
+    tcp::iostream conn(settings.host, port);
+    while (Clock::now() < end) {
+        // Pick the stock (from the skewed distribution) and transaction
+        const size_t stock = std::lower_bound(cdf.begin(), cdf.end(),
+            uniform(rng)) - cdf.begin();
+        int trans = 0;
+        for (int weight = pick(rng); weight >= settings.mix[trans]; trans++) {
+            weight -= settings.mix[trans];
+        }
+        const std::string path = std::string("/trans=") + Trans[trans] +
+            "&stock=bench" + std::to_string(stock) + "&amount=" +
+            std::to_string(trans == 0 ? 1000000000 : amount(rng));
+        // Time the transaction
+        bool keepAlive;
+        const auto start = Clock::now();
+        const std::string body = sendRequest(conn, path, keepAlive);
+        result.latency.record(std::chrono::duration_cast<
+            std::chrono::nanoseconds>(Clock::now() - start).count());
+        result.errors += body.empty();
+        if (!keepAlive) {
+            conn.close();
+            conn.clear();
+            conn.connect(settings.host, port);
+            result.reconnects++;
+        }
+    }
+}
+
+/**
+ * Helper method to compute the cumulative distribution used to pick
+ * stocks, where stock i is picked with a probability proportional to
+ * 1 / (i + 1)^skew.
+ *
+ * \param[in] stocks The number of stocks.
+ *
+ * \param[in] skew The Zipf exponent.  Zero gives a uniform distribution.
+ */
+std::vector<double> zipfCdf(const int stocks, const double skew) {
+    std::vector<double> cdf(std::max(stocks, 1));
+    double sum = 0;
+    for (size_t i = 0; i < cdf.size(); i++) {
+        cdf[i] = (sum += 1 / std::pow(i + 1, skew));
+    }
+    for (auto& p : cdf) {
+        p /= sum;
+    }
+    cdf.back() = 1;
+    return cdf;
+}
+
+/**
+ * Run the benchmark once against a server and print 1 line of results.
+ *
+ * \param[in] settings The benchmark settings.
+ *
+ * \param[in] port The port of the server.
+ *
+ * \param[in] label The value printed in the first column.
+ */
+void runBenchmark(const Settings& settings, const std::string& port,
+                  const std::string& label) {
+    // Start from a known set of stocks with balances large enough that
+    // buys never have to wait for sells.
+    {
+        bool keepAlive;
+        tcp::iostream conn(settings.host, port);
+        sendRequest(conn, "/trans=reset", keepAlive);
+        for (int i = 0; i < settings.stocks; i++) {
+            if (!keepAlive) {
+                conn.close();
+                conn.clear();
+                conn.connect(settings.host, port);
+            }
+            sendRequest(conn, "/trans=create&stock=bench" +
+                        std::to_string(i) + "&amount=1000000000", keepAlive);
+        }
+    }
+    const std::vector<double> cdf = zipfCdf(settings.stocks, settings.skew);
+    std::vector<ClientResult> results(settings.connections);
+    std::vector<std::thread> clients;
+    const auto start = Clock::now(), end = start + settings.duration;
+    for (int i = 0; i < settings.connections; i++) {
+        clients.emplace_back(clientMain, std::cref(settings), port,
+                             std::cref(cdf), i + 1, end, std::ref(results[i]));
+    }
+    for (auto& t : clients) {
+        t.join();
+    }
+    const double seconds = std::chrono::duration<double>(
+        Clock::now() - start).count();
+    // Merge the per-client results only now, so that recording a
+    // latency never contends with other clients.
+    ClientResult total;
+    for (const auto& r : results) {
+        total.latency.merge(r.latency);
+        total.errors += r.errors;
+        total.reconnects += r.reconnects;
+    }
+    auto micros = [&total](const double q) {
+        return total.latency.percentile(q) / 1000.0;
+    };
+    std::cout << std::setw(10) << label
+              << std::setw(12) << total.latency.count()
+              << std::setw(12) << std::fixed << std::setprecision(0)
+              << total.latency.count() / seconds
+              << std::setprecision(1)
+              << std::setw(10) << micros(0.5) << std::setw(10) << micros(0.99)
+              << std::setw(10) << micros(0.999)
+              << std::setw(10) << total.latency.max() / 1000.0
+              << std::setw(8) << total.errors
+              << std::setw(8) << total.reconnects << std::endl;
+}
+
+/**
+ * Helper method to parse the command-line arguments.
+ *
+ * \return False if the arguments are invalid.
+ */
+bool parseArgs(int argc, char* argv[], Settings& settings) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string opt = argv[i], val = argv[i + 1];
+        if (opt == "--host") {
+            settings.host = val;
+        } else if (opt == "--port") {
+            settings.port = val;
+        } else if (opt == "--connections") {
+            settings.connections = std::stoi(val);
+        } else if (opt == "--seconds") {
+            settings.duration = std::chrono::seconds(std::stoi(val));
+        } else if (opt == "--stocks") {
+            settings.stocks = std::stoi(val);
+        } else if (opt == "--skew") {
+            settings.skew = std::stod(val);
+        } else if (opt == "--mix") {
+            // 4 non-negative weights separated by ':', adding up to more
+            // than zero (the clients pick transactions by weight)
+            std::istringstream is(val);
+            char sep[3] = {};
+            is >> settings.mix[0] >> sep[0] >> settings.mix[1] >> sep[1]
+               >> settings.mix[2] >> sep[2] >> settings.mix[3];
+            const int* const mix = settings.mix;
+            const long long total = std::accumulate(mix, mix + 4, 0LL);
+            if (is.fail() || !(is >> std::ws).eof() ||
+                std::count(sep, sep + 3, ':') != 3 ||
+                std::any_of(mix, mix + 4, [](int w) { return w < 0; }) ||
+                total <= 0 || total > INT_MAX) {
+                return false;
+            }
+        } else if (opt == "--sweep") {
+            std::istringstream is(val);
+            for (std::string n; std::getline(is, n, ',');) {
+                settings.sweep.push_back(std::stoi(n));
+            }
+        } else {
+            return false;
+        }
+    }
+    return (argc % 2) == 1;
+}
+
+/**
+ * The main function that runs the benchmark based on command-line
+ * arguments.
+ *
+ * \param[in] argc The number of command-line arguments.
+ *
+ * \param[in] argv The actual command-line arguments (see the usage
+ * message below).
+ */
+int main(int argc, char* argv[]) {
+    Settings settings;
+    if (!parseArgs(argc, argv, settings)) {
+        std::cerr << "Usage: " << argv[0] << " [--host h] [--port p]"
+                  << " [--connections n] [--seconds s] [--stocks n]"
+                  << " [--skew zipf] [--mix create:buy:sell:status]"
+                  << " [--sweep maxThreads,...]\n";
+        return 1;
+    }
+#ifndef STOCK_BENCHMARK_SWEEP
+    if (!settings.sweep.empty()) {
+        std::cerr << "--sweep requires a build with -DSTOCK_BENCHMARK_SWEEP"
+                  << " that includes the server's source\n";
+        return 1;
+    }
+#endif
+    std::cout << std::setw(10) << (settings.sweep.empty() ? "server" :
+                                   "threads")
+              << std::setw(12) << "requests" << std::setw(12) << "req/sec"
+              << std::setw(10) << "p50(us)" << std::setw(10) << "p99(us)"
+              << std::setw(10) << "p999(us)" << std::setw(10) << "max(us)"
+              << std::setw(8) << "errors" << std::setw(8) << "reconn"
+              << std::endl;
+    if (settings.sweep.empty()) {
+        runBenchmark(settings, settings.port, settings.port);
+        return 0;
+    }
+#ifdef STOCK_BENCHMARK_SWEEP
+    // Start an in-process server for each maxThreads value.  The
+    // servers from earlier runs stay (idle) in the background.
+    settings.host = "localhost";
+    std::vector<std::unique_ptr<io_service>> services;
+    std::vector<std::unique_ptr<tcp::acceptor>> servers;
+    for (const int maxThreads : settings.sweep) {
+        services.push_back(std::make_unique<io_service>());
+        servers.push_back(std::make_unique<tcp::acceptor>(*services.back(),
+            tcp::endpoint(tcp::v4(), 0)));
+        tcp::acceptor& server = *servers.back();
+        std::thread([&server, maxThreads] {
+            runServer(server, maxThreads); }).detach();
+        runBenchmark(settings, std::to_string(server.local_endpoint().port()),
+                     std::to_string(maxThreads));
+    }
+    std::_Exit(0);  // Do not wait for the background servers
+#endif
+}